@@ -0,0 +1,710 @@
+#include "BackingAllocator.h"
+
+#include <algorithm>
+#include <assert.h>
+#include <cstring>
+#include <new>
+#include <stdint.h>
+#include <stdio.h>
+
+using namespace std;
+
+
+// Live allocators by index (slot 0 is unused; it stands for malloc)
+static BackingAllocator *registry[MEMORYTRACER_MAX_BACKENDS + 1];
+static mutex registryLock;
+static atomic<unsigned int> nextPoolGeneration(1);
+
+thread_local BackingAllocator *BackingAllocator::current = nullptr;
+
+/** @struct PoolThreadCaches
+Magazines held by one thread, for every SizeClassPool (indexed like the registry).  When the thread exits, its
+magazines are handed back to the pools which still exist.
+*/
+struct PoolThreadCaches
+{
+	struct Cache
+	{
+		SizeClassPool *pool;
+		unsigned int generation;
+		size_t classCount;
+		SizeClassPool::ThreadMagazines *magazines;
+	};
+	Cache caches[MEMORYTRACER_MAX_BACKENDS + 1];
+
+	~PoolThreadCaches()
+	{
+		for(Cache &cache : caches)
+		{
+			Release(cache);
+		}
+	}
+
+	// Returns the magazines to the pool (if it is still alive) and frees the cache
+	void Release(Cache &cache)
+	{
+		if(!cache.magazines)
+		{
+			return;
+		}
+		{
+			lock_guard<mutex> guard(registryLock);
+			// the slot's own index is used, since the pool may already be gone
+			if(registry[&cache - caches] == cache.pool && cache.pool->generation == cache.generation)
+			{
+				for(size_t c = 0; c < cache.classCount; c++)
+				{
+					cache.pool->ReturnMagazine(c, cache.magazines[c].loaded);
+					cache.pool->ReturnMagazine(c, cache.magazines[c].previous);
+					cache.magazines[c].loaded = cache.magazines[c].previous = nullptr;
+				}
+			}
+		}
+		Discard(cache);
+	}
+
+	// Frees the cache, along with any magazines still in it (their blocks belonged to a pool which is gone)
+	void Discard(Cache &cache)
+	{
+		for(size_t c = 0; cache.magazines && c < cache.classCount; c++)
+		{
+			free(cache.magazines[c].loaded);
+			free(cache.magazines[c].previous);
+		}
+		free(cache.magazines);
+		cache.magazines = nullptr;
+		cache.pool = nullptr;
+	}
+
+	// Returns this thread's cache for the pool, creating it if necessary; returns nullptr if it couldn't be created
+	Cache* Get(SizeClassPool *pool)
+	{
+		Cache &cache = caches[pool->GetIndex()];
+		if(cache.pool == pool && cache.generation == pool->generation)
+		{
+			return &cache;
+		}
+		// whatever pool used this slot before is gone, so its blocks went with it
+		Discard(cache);
+
+		cache.magazines = static_cast<SizeClassPool::ThreadMagazines*>(calloc(pool->classCount,
+			sizeof(SizeClassPool::ThreadMagazines)));
+		if(!cache.magazines)
+		{
+			return nullptr;
+		}
+		cache.pool = pool;
+		cache.generation = pool->generation;
+		cache.classCount = pool->classCount;
+		return &cache;
+	}
+};
+
+static thread_local PoolThreadCaches threadCaches;
+
+// Allocates memory which starts on a cache line; the pointer malloc returned is kept just before it
+static void* AllocateAligned(size_t size)
+{
+	unsigned char *raw = static_cast<unsigned char*>(malloc(size + MEMORYTRACER_CACHE_LINE));
+	if(!raw)
+	{
+		return nullptr;
+	}
+	// malloc's own alignment leaves at least 8 bytes before the next line for the pointer
+	uintptr_t aligned = (reinterpret_cast<uintptr_t>(raw) + MEMORYTRACER_CACHE_LINE)
+		& ~static_cast<uintptr_t>(MEMORYTRACER_CACHE_LINE - 1);
+	reinterpret_cast<void**>(aligned)[-1] = raw;
+	return reinterpret_cast<void*>(aligned);
+}
+
+static void FreeAligned(void *ptr)
+{
+	if(ptr)
+	{
+		free(static_cast<void**>(ptr)[-1]);
+	}
+}
+
+
+BackingAllocator::BackingAllocator() : index(0)
+{
+	lock_guard<mutex> guard(registryLock);
+	for(unsigned char i = 1; i <= MEMORYTRACER_MAX_BACKENDS; i++)
+	{
+		if(!registry[i])
+		{
+			registry[i] = this;
+			index = i;
+			break;
+		}
+	}
+	// too many allocators at once; this one can't be used with ScopedBackingAllocator
+	assert(index);
+}
+
+BackingAllocator::~BackingAllocator()
+{
+	lock_guard<mutex> guard(registryLock);
+	if(index)
+	{
+		registry[index] = nullptr;
+	}
+	if(current == this)
+	{
+		current = nullptr;
+	}
+}
+
+void BackingAllocator::DeallocateFrom(unsigned char index, void *ptr, size_t size)
+{
+	if(index)
+	{
+		registry[index]->Deallocate(ptr, size);
+	}
+	else
+	{
+		free(ptr);
+	}
+}
+
+
+BumpArena::BumpArena(size_t capacity) : used(0)
+{
+	begin = static_cast<unsigned char*>(malloc(capacity));
+	end = begin ? begin + capacity : nullptr;
+}
+
+BumpArena::~BumpArena()
+{
+	free(begin);
+}
+
+void* BumpArena::Allocate(size_t size)
+{
+	// keep every block 16-byte aligned, like malloc does
+	size_t rounded = (size + 15) & ~static_cast<size_t>(15);
+	size_t offset = used.fetch_add(rounded, memory_order_relaxed);
+	if(begin && offset + rounded <= static_cast<size_t>(end - begin))
+	{
+		return begin + offset;
+	}
+	return malloc(size);
+}
+
+void BumpArena::Deallocate(void *ptr, size_t)
+{
+	// blocks inside the arena are reclaimed all at once by Reset; only the overflow blocks are freed individually
+	unsigned char *block = static_cast<unsigned char*>(ptr);
+	if(block < begin || block >= end)
+	{
+		free(ptr);
+	}
+}
+
+const char* BumpArena::GetName() const
+{
+	return "BumpArena";
+}
+
+void BumpArena::Reset()
+{
+	used = 0;
+}
+
+size_t BumpArena::GetUsed() const
+{
+	return min<size_t>(used, end - begin);
+}
+
+
+SizeClassPool::SizeClassPool(const size_t *sizeClasses, size_t count, size_t slabSize)
+	: classes(nullptr), classCount(0), classLookup(nullptr), slabSize(slabSize), slabs(nullptr), slabCount(0),
+	slabCapacity(0), generation(nextPoolGeneration++)
+{
+	static const size_t defaultClasses[] = { 16, 32, 64, 128, 192, 256, 320, 384, 448, 512, 640, 768, 896, 1024, 1280,
+		1536, 1792, 2048, 2560, 3072, 3584, 4096 };
+	if(!sizeClasses || !count)
+	{
+		sizeClasses = defaultClasses;
+		count = sizeof(defaultClasses) / sizeof(defaultClasses[0]);
+	}
+	count = min<size_t>(count, 255);
+
+	classes = static_cast<SizeClass*>(AllocateAligned(count * sizeof(SizeClass)));
+	if(!classes)
+	{
+		return;
+	}
+	for(size_t i = 0; i < count; i++)
+	{
+		size_t size = RoundToClassSize(sizeClasses[i]);
+		if(classCount && size <= classes[classCount - 1].size)
+		{
+			continue;
+		}
+		SizeClass *sizeClass = new(&classes[classCount++]) SizeClass;
+		sizeClass->size = size;
+		sizeClass->fullMagazines = sizeClass->emptyMagazines = nullptr;
+		sizeClass->freeList = nullptr;
+		sizeClass->slabCursor = sizeClass->slabEnd = nullptr;
+	}
+
+	size_t largest = classes[classCount - 1].size;
+	this->slabSize = max(slabSize, largest * MEMORYTRACER_MAGAZINE_SIZE);
+	classLookup = static_cast<unsigned char*>(malloc(largest / 16 + 1));
+	if(!classLookup)
+	{
+		return;
+	}
+	for(size_t slot = 0, c = 0; slot <= largest / 16; slot++)
+	{
+		while(classes[c].size < slot * 16)
+		{
+			c++;
+		}
+		classLookup[slot] = static_cast<unsigned char>(c);
+	}
+}
+
+SizeClassPool::~SizeClassPool()
+{
+	{
+		// threads which exit from here on must not hand their magazines back to this pool
+		lock_guard<mutex> guard(registryLock);
+		generation = 0;
+	}
+	for(size_t i = 0; i < slabCount; i++)
+	{
+		FreeAligned(slabs[i]);
+	}
+	free(slabs);
+	for(size_t i = 0; i < classCount; i++)
+	{
+		for(Magazine *magazine = classes[i].fullMagazines, *next; magazine; magazine = next)
+		{
+			next = magazine->next;
+			free(magazine);
+		}
+		for(Magazine *magazine = classes[i].emptyMagazines, *next; magazine; magazine = next)
+		{
+			next = magazine->next;
+			free(magazine);
+		}
+		classes[i].~SizeClass();
+	}
+	FreeAligned(classes);
+	free(classLookup);
+}
+
+size_t SizeClassPool::RoundToClassSize(size_t size)
+{
+	// blocks up to a line are powers of two, so they pack into lines exactly; larger blocks take whole lines
+	if(size <= MEMORYTRACER_CACHE_LINE)
+	{
+		size_t rounded = 16;
+		while(rounded < size)
+		{
+			rounded *= 2;
+		}
+		return rounded;
+	}
+	return (size + MEMORYTRACER_CACHE_LINE - 1) & ~static_cast<size_t>(MEMORYTRACER_CACHE_LINE - 1);
+}
+
+bool SizeClassPool::AddSlab(SizeClass &shared)
+{
+	unsigned char *slab = static_cast<unsigned char*>(AllocateAligned(slabSize));
+	if(!slab)
+	{
+		return false;
+	}
+	{
+		lock_guard<mutex> slabGuard(slabLock);
+		if(slabCount == slabCapacity)
+		{
+			size_t newCapacity = slabCapacity ? slabCapacity * 2 : 64;
+			void **newSlabs = static_cast<void**>(realloc(slabs, newCapacity * sizeof(void*)));
+			if(!newSlabs)
+			{
+				FreeAligned(slab);
+				return false;
+			}
+			slabs = newSlabs;
+			slabCapacity = newCapacity;
+		}
+		slabs[slabCount++] = slab;
+	}
+	shared.slabCursor = slab;
+	shared.slabEnd = slab + slabSize;
+	return true;
+}
+
+SizeClassPool::Magazine* SizeClassPool::TakeEmptyMagazine(SizeClass &shared)
+{
+	Magazine *magazine = shared.emptyMagazines;
+	if(magazine)
+	{
+		shared.emptyMagazines = magazine->next;
+	}
+	else
+	{
+		magazine = static_cast<Magazine*>(malloc(sizeof(Magazine)));
+		if(!magazine)
+		{
+			return nullptr;
+		}
+	}
+	magazine->rounds = 0;
+	return magazine;
+}
+
+void SizeClassPool::FillMagazine(SizeClass &shared, Magazine *magazine)
+{
+	while(magazine->rounds < MEMORYTRACER_MAGAZINE_SIZE && shared.freeList)
+	{
+		FreeBlock *block = shared.freeList;
+		shared.freeList = block->next;
+		magazine->blocks[magazine->rounds++] = block;
+	}
+	while(magazine->rounds < MEMORYTRACER_MAGAZINE_SIZE)
+	{
+		if(shared.slabCursor + shared.size > shared.slabEnd && !AddSlab(shared))
+		{
+			break;
+		}
+		size_t count = min<size_t>(MEMORYTRACER_MAGAZINE_SIZE - magazine->rounds,
+			(shared.slabEnd - shared.slabCursor) / shared.size);
+		// stacked in reverse, so the blocks are handed out in address order
+		for(size_t i = count; i-- > 0; )
+		{
+			magazine->blocks[magazine->rounds + i] = shared.slabCursor;
+			shared.slabCursor += shared.size;
+		}
+		magazine->rounds += count;
+	}
+}
+
+bool SizeClassPool::Reload(size_t sizeClass, ThreadMagazines &magazines)
+{
+	// swapping with the previous magazine needs no lock, so it is tried first
+	if(magazines.previous && magazines.previous->rounds)
+	{
+		swap(magazines.loaded, magazines.previous);
+		return true;
+	}
+
+	SizeClass &shared = classes[sizeClass];
+	lock_guard<mutex> guard(shared.lock);
+	if(shared.fullMagazines)
+	{
+		Magazine *full = shared.fullMagazines;
+		shared.fullMagazines = full->next;
+		// both of the thread's magazines are empty, so one of them goes back to the depot
+		if(magazines.previous)
+		{
+			magazines.previous->next = shared.emptyMagazines;
+			shared.emptyMagazines = magazines.previous;
+		}
+		magazines.previous = magazines.loaded;
+		magazines.loaded = full;
+		return true;
+	}
+
+	// the depot has nothing either, so new blocks go straight into the loaded magazine
+	if(!magazines.loaded && !(magazines.loaded = TakeEmptyMagazine(shared)))
+	{
+		return false;
+	}
+	FillMagazine(shared, magazines.loaded);
+	return magazines.loaded->rounds != 0;
+}
+
+bool SizeClassPool::Unload(size_t sizeClass, ThreadMagazines &magazines)
+{
+	if(magazines.previous && !magazines.previous->rounds)
+	{
+		swap(magazines.loaded, magazines.previous);
+		return true;
+	}
+
+	SizeClass &shared = classes[sizeClass];
+	lock_guard<mutex> guard(shared.lock);
+	// the previous magazine (if any) has blocks in it, so the depot can hand it to a thread which needs them
+	if(magazines.previous)
+	{
+		magazines.previous->next = shared.fullMagazines;
+		shared.fullMagazines = magazines.previous;
+	}
+	magazines.previous = magazines.loaded;
+	magazines.loaded = TakeEmptyMagazine(shared);
+	return magazines.loaded != nullptr;
+}
+
+void SizeClassPool::ReturnMagazine(size_t sizeClass, Magazine *magazine)
+{
+	if(!magazine)
+	{
+		return;
+	}
+	SizeClass &shared = classes[sizeClass];
+	lock_guard<mutex> guard(shared.lock);
+	Magazine *&list = magazine->rounds ? shared.fullMagazines : shared.emptyMagazines;
+	magazine->next = list;
+	list = magazine;
+}
+
+void* SizeClassPool::TakeBlock(size_t sizeClass)
+{
+	SizeClass &shared = classes[sizeClass];
+	lock_guard<mutex> guard(shared.lock);
+	if(shared.freeList)
+	{
+		FreeBlock *block = shared.freeList;
+		shared.freeList = block->next;
+		return block;
+	}
+	if(shared.fullMagazines)
+	{
+		Magazine *magazine = shared.fullMagazines;
+		void *block = magazine->blocks[--magazine->rounds];
+		if(!magazine->rounds)
+		{
+			shared.fullMagazines = magazine->next;
+			magazine->next = shared.emptyMagazines;
+			shared.emptyMagazines = magazine;
+		}
+		return block;
+	}
+	if(shared.slabCursor + shared.size > shared.slabEnd && !AddSlab(shared))
+	{
+		return nullptr;
+	}
+	void *block = shared.slabCursor;
+	shared.slabCursor += shared.size;
+	return block;
+}
+
+void* SizeClassPool::Allocate(size_t size)
+{
+	if(!classLookup || size > classes[classCount - 1].size)
+	{
+		return malloc(size);
+	}
+	size_t sizeClass = classLookup[(size + 15) / 16];
+
+	PoolThreadCaches::Cache *cache = threadCaches.Get(this);
+	if(!cache)
+	{
+		return TakeBlock(sizeClass);
+	}
+	ThreadMagazines &magazines = cache->magazines[sizeClass];
+	if((!magazines.loaded || !magazines.loaded->rounds) && !Reload(sizeClass, magazines))
+	{
+		return nullptr;
+	}
+	return magazines.loaded->blocks[--magazines.loaded->rounds];
+}
+
+void SizeClassPool::Deallocate(void *ptr, size_t size)
+{
+	if(!classLookup || size > classes[classCount - 1].size)
+	{
+		free(ptr);
+		return;
+	}
+	size_t sizeClass = classLookup[(size + 15) / 16];
+
+	PoolThreadCaches::Cache *cache = threadCaches.Get(this);
+	if(cache)
+	{
+		ThreadMagazines &magazines = cache->magazines[sizeClass];
+		if((magazines.loaded && magazines.loaded->rounds < MEMORYTRACER_MAGAZINE_SIZE) || Unload(sizeClass, magazines))
+		{
+			magazines.loaded->blocks[magazines.loaded->rounds++] = ptr;
+			return;
+		}
+	}
+	// no magazine to put the block in, so it goes on the shared free list
+	SizeClass &shared = classes[sizeClass];
+	lock_guard<mutex> guard(shared.lock);
+	FreeBlock *block = static_cast<FreeBlock*>(ptr);
+	block->next = shared.freeList;
+	shared.freeList = block;
+}
+
+const char* SizeClassPool::GetName() const
+{
+	return "SizeClassPool";
+}
+
+size_t SizeClassPool::ComputeSizeClasses(const size_t *sizes, const long long *counts, size_t count, size_t *classes,
+	size_t maxClasses, size_t largestClass)
+{
+	maxClasses = min<size_t>(maxClasses, 255);
+	largestClass = RoundToClassSize(largestClass);
+	if(!maxClasses)
+	{
+		return 0;
+	}
+
+	// total the blocks by the smallest class size each could use; only these sizes are worth making classes of
+	size_t *bucketSizes = static_cast<size_t*>(malloc((count ? count : 1) * sizeof(size_t)));
+	double *bucketCounts = static_cast<double*>(malloc((count ? count : 1) * sizeof(double)));
+	size_t bucketCount = 0;
+	if(!bucketSizes || !bucketCounts)
+	{
+		free(bucketSizes);
+		free(bucketCounts);
+		return 0;
+	}
+	for(size_t i = 0; i < count; i++)
+	{
+		if(sizes[i] > largestClass || counts[i] <= 0)
+		{
+			continue;
+		}
+		size_t size = RoundToClassSize(sizes[i]);
+		size_t position = lower_bound(bucketSizes, bucketSizes + bucketCount, size) - bucketSizes;
+		if(position == bucketCount || bucketSizes[position] != size)
+		{
+			memmove(bucketSizes + position + 1, bucketSizes + position, (bucketCount - position) * sizeof(size_t));
+			memmove(bucketCounts + position + 1, bucketCounts + position, (bucketCount - position) * sizeof(double));
+			bucketSizes[position] = size;
+			bucketCounts[position] = 0;
+			bucketCount++;
+		}
+		bucketCounts[position] += static_cast<double>(counts[i]);
+	}
+
+	size_t classCount = 0;
+	if(bucketCount <= maxClasses)
+	{
+		for( ; classCount < bucketCount; classCount++)
+		{
+			classes[classCount] = bucketSizes[classCount];
+		}
+	}
+	else
+	{
+		// Dynamic programming over the sorted sizes: waste[k][j] is the least memory lost to rounding when the
+		// blocks up to size j are covered by k + 1 classes, the largest of which is size j.  Every block is rounded up
+		// to the next class, so the largest size must always be a class.
+		size_t n = bucketCount;
+		double *prefixCount = static_cast<double*>(malloc((n + 1) * sizeof(double)));
+		double *prefixBytes = static_cast<double*>(malloc((n + 1) * sizeof(double)));
+		double *waste = static_cast<double*>(malloc(maxClasses * n * sizeof(double)));
+		size_t *previous = static_cast<size_t*>(malloc(maxClasses * n * sizeof(size_t)));
+		if(prefixCount && prefixBytes && waste && previous)
+		{
+			prefixCount[0] = prefixBytes[0] = 0;
+			for(size_t i = 0; i < n; i++)
+			{
+				prefixCount[i + 1] = prefixCount[i] + bucketCounts[i];
+				prefixBytes[i + 1] = prefixBytes[i] + bucketCounts[i] * bucketSizes[i];
+			}
+			// memory lost when the sizes first..last all go into a class of size last
+			auto rangeWaste = [&](size_t first, size_t last) -> double
+			{
+				return bucketSizes[last] * (prefixCount[last + 1] - prefixCount[first])
+					- (prefixBytes[last + 1] - prefixBytes[first]);
+			};
+			for(size_t j = 0; j < n; j++)
+			{
+				waste[j] = rangeWaste(0, j);
+			}
+			for(size_t k = 1; k < maxClasses; k++)
+			{
+				for(size_t j = 0; j < n; j++)
+				{
+					double &best = waste[k * n + j];
+					best = waste[(k - 1) * n + j];
+					previous[k * n + j] = n;
+					for(size_t i = 0; i < j; i++)
+					{
+						double candidate = waste[(k - 1) * n + i] + rangeWaste(i + 1, j);
+						if(candidate < best)
+						{
+							best = candidate;
+							previous[k * n + j] = i;
+						}
+					}
+				}
+			}
+			// walk the choices back from the largest size
+			size_t j = n - 1;
+			for(size_t k = maxClasses; k-- > 0; )
+			{
+				if(k == 0)
+				{
+					classes[classCount++] = bucketSizes[j];
+				}
+				else if(previous[k * n + j] != n)
+				{
+					classes[classCount++] = bucketSizes[j];
+					j = previous[k * n + j];
+				}
+			}
+			reverse(classes, classes + classCount);
+		}
+		free(prefixCount);
+		free(prefixBytes);
+		free(waste);
+		free(previous);
+	}
+
+	free(bucketSizes);
+	free(bucketCounts);
+	return classCount;
+}
+
+size_t SizeClassPool::LoadSizeClasses(const char *fileName, size_t *classes, size_t maxClasses, size_t largestClass)
+{
+	FILE *file = fopen(fileName, "r");
+	if(!file)
+	{
+		return 0;
+	}
+	size_t *sizes = nullptr;
+	long long *counts = nullptr;
+	size_t count = 0, capacity = 0;
+	char line[256];
+	bool ok = true;
+	while(ok && fgets(line, sizeof(line), file))
+	{
+		size_t size;
+		long long blocks;
+		// lines which don't hold a size and a count (such as the comment at the top) are skipped
+		if(line[0] == '#' || sscanf(line, "%zu %lld", &size, &blocks) != 2)
+		{
+			continue;
+		}
+		if(count == capacity)
+		{
+			capacity = capacity ? capacity * 2 : 256;
+			size_t *newSizes = static_cast<size_t*>(realloc(sizes, capacity * sizeof(size_t)));
+			if(newSizes)
+			{
+				sizes = newSizes;
+			}
+			long long *newCounts = static_cast<long long*>(realloc(counts, capacity * sizeof(long long)));
+			if(newCounts)
+			{
+				counts = newCounts;
+			}
+			ok = newSizes && newCounts;
+			if(!ok)
+			{
+				break;
+			}
+		}
+		sizes[count] = size;
+		counts[count] = blocks;
+		count++;
+	}
+	fclose(file);
+
+	size_t classCount = ok ? ComputeSizeClasses(sizes, counts, count, classes, maxClasses, largestClass) : 0;
+	free(sizes);
+	free(counts);
+	return classCount;
+}
@@ -0,0 +1,346 @@
+/** @file BackingAllocator.h
+@brief Allocators MemoryTracer can get its memory from instead of malloc.  Included by MemoryTracer.h.
+*/
+
+#ifndef BACKINGALLOCATOR_H
+#define BACKINGALLOCATOR_H
+
+
+#include <atomic>
+#include <mutex>
+#include <stdlib.h>
+
+
+/** @def MEMORYTRACER_MAX_BACKENDS
+Maximum number of backing allocators which can exist at the same time.
+*/
+#ifndef MEMORYTRACER_MAX_BACKENDS
+#define MEMORYTRACER_MAX_BACKENDS 16
+#endif
+
+/** @class BackingAllocator
+@brief Interface for allocators which supply the memory handed out by MemoryTracer.
+
+By default, the tracer gets its memory from malloc; while a ScopedBackingAllocator is alive, the current thread's
+allocations come from the given allocator instead, so the tracer's measurements reflect the allocator the program
+actually uses.  Each block remembers which allocator it came from, so it can be freed from any scope or thread.  An
+allocator must outlive every block allocated from it.
+*/
+class BackingAllocator
+{
+private:
+
+	//! Position in the registry (1-based, so 0 can mean malloc in allocation headers)
+	unsigned char index;
+
+	//! Allocator used by the current thread, or nullptr for malloc
+	static thread_local BackingAllocator *current;
+
+	BackingAllocator(const BackingAllocator&);
+	BackingAllocator& operator=(const BackingAllocator&);
+
+	friend class ScopedBackingAllocator;
+
+public:
+
+	/** Registers the allocator so blocks can refer to it by index.
+	*/
+	BackingAllocator();
+	virtual ~BackingAllocator();
+
+	/** @brief Allocates memory
+		@param size Number of bytes needed
+		@return Pointer to memory aligned for any type, or nullptr on failure
+	*/
+	virtual void* Allocate(size_t size) = 0;
+
+	/** @brief Frees memory
+		@param ptr Pointer returned by Allocate
+		@param size Size which was passed to Allocate
+	*/
+	virtual void Deallocate(void *ptr, size_t size) = 0;
+
+	/** @return Name of the allocator, for reports
+	*/
+	virtual const char* GetName() const = 0;
+
+	/** @return Index which identifies the allocator in allocation headers, or 0 if it couldn't be registered
+	*/
+	unsigned char GetIndex() const
+	{
+		return index;
+	}
+
+	/** @return Allocator in effect on the current thread, or nullptr if it is malloc
+	*/
+	static BackingAllocator* GetCurrent()
+	{
+		return current;
+	}
+
+	/** @brief Allocates from the given allocator, or from malloc if it is nullptr
+		@param backend Allocator to use
+		@param size Number of bytes needed
+		@return Pointer to the memory, or nullptr on failure
+	*/
+	static void* AllocateFrom(BackingAllocator *backend, size_t size)
+	{
+		return backend ? backend->Allocate(size) : malloc(size);
+	}
+
+	/** @brief Frees memory through the allocator with the given index, or with free if the index is 0
+		@param index Index of the allocator the memory came from (see GetIndex)
+		@param ptr Pointer to the memory
+		@param size Size which was passed to Allocate
+	*/
+	static void DeallocateFrom(unsigned char index, void *ptr, size_t size);
+};
+
+/** @class ScopedBackingAllocator
+@brief Makes the current thread's allocations come from the given allocator until the object goes out of scope.
+
+Example: { ScopedBackingAllocator scope(framePool); Particle *p = new Particle; }
+*/
+class ScopedBackingAllocator
+{
+private:
+
+	BackingAllocator *previous;
+
+	ScopedBackingAllocator(const ScopedBackingAllocator&);
+	ScopedBackingAllocator& operator=(const ScopedBackingAllocator&);
+
+public:
+
+	/** @param backend Allocator to use, or nullptr for malloc
+	*/
+	explicit ScopedBackingAllocator(BackingAllocator *backend) : previous(BackingAllocator::current)
+	{
+		// an allocator which couldn't be registered can't be recorded in allocation headers, so it can't be used
+		if(!backend || backend->GetIndex())
+		{
+			BackingAllocator::current = backend;
+		}
+	}
+	explicit ScopedBackingAllocator(BackingAllocator &backend) : previous(BackingAllocator::current)
+	{
+		if(backend.GetIndex())
+		{
+			BackingAllocator::current = &backend;
+		}
+	}
+	~ScopedBackingAllocator()
+	{
+		BackingAllocator::current = previous;
+	}
+};
+
+/** @class BumpArena
+@brief Linear allocator for short-lived allocations, such as everything allocated during one frame.
+
+Allocation is a single atomic add; freeing an individual block does nothing, and Reset makes the whole arena available
+again at once.  Blocks which don't fit come from malloc instead (and are freed normally).
+*/
+class BumpArena : public BackingAllocator
+{
+private:
+
+	unsigned char *begin;
+	unsigned char *end;
+	std::atomic<size_t> used;
+
+public:
+
+	/** @param capacity Size of the arena in bytes
+	*/
+	explicit BumpArena(size_t capacity);
+	~BumpArena();
+
+	void* Allocate(size_t size);
+	void Deallocate(void *ptr, size_t size);
+	const char* GetName() const;
+
+	/** @brief Makes the whole arena available again.  Every block allocated from it must have been deleted already.
+	*/
+	void Reset();
+
+	/** @return Number of bytes of the arena in use
+	*/
+	size_t GetUsed() const;
+};
+
+/** @def MEMORYTRACER_MAGAZINE_SIZE
+Number of blocks in each of SizeClassPool's magazines.
+*/
+#ifndef MEMORYTRACER_MAGAZINE_SIZE
+#define MEMORYTRACER_MAGAZINE_SIZE 32
+#endif
+
+/** @def MEMORYTRACER_CACHE_LINE
+Cache line size assumed by SizeClassPool's slab layout.
+*/
+#ifndef MEMORYTRACER_CACHE_LINE
+#define MEMORYTRACER_CACHE_LINE 64
+#endif
+
+/** @class SizeClassPool
+@brief Pool allocator which rounds requests up to a fixed set of size classes.
+
+Freed blocks are kept in magazines (fixed-size stacks of blocks).  Each thread holds two magazines per size class, so
+most allocations and deallocations are a push or pop on one of them without touching any shared state.  When both are
+empty (or full), the thread trades a whole magazine with the pool's depot under a single lock.  Memory is carved out
+of large slabs which start on a cache line.  Classes up to a cache line in size are rounded up to a power of two, and
+larger classes to whole lines, so no block straddles more lines than it has to.  Slabs are only returned to the
+system when the pool is destroyed.  Requests larger than the largest size class go to malloc.
+
+The size classes can be derived from a previous run's size histogram (see MemoryTracer::ExportSizeHistogram and
+LoadSizeClasses).
+*/
+class SizeClassPool : public BackingAllocator
+{
+private:
+
+	struct FreeBlock
+	{
+		FreeBlock *next;
+	};
+
+	/** @struct Magazine
+	Stack of free blocks of one size class; traded whole between threads and the depot.
+	*/
+	struct Magazine
+	{
+		Magazine *next;
+		size_t rounds;
+		void *blocks[MEMORYTRACER_MAGAZINE_SIZE];
+	};
+
+	/** @struct ThreadMagazines
+	The two magazines a thread holds for one size class (either can be nullptr).
+	*/
+	struct ThreadMagazines
+	{
+		Magazine *loaded;
+		Magazine *previous;
+	};
+
+	/** @struct SizeClass
+	Shared state (the depot) for one size class.  Each one has its own cache line, so threads working on different
+	classes don't contend for the same line.
+	*/
+	struct alignas(MEMORYTRACER_CACHE_LINE) SizeClass
+	{
+		size_t size;
+		std::mutex lock;
+		//! Magazines with at least one block in them
+		Magazine *fullMagazines;
+		//! Magazines with no blocks in them
+		Magazine *emptyMagazines;
+		//! Blocks freed by threads which couldn't get a magazine
+		FreeBlock *freeList;
+		//! Next unused byte of the newest slab, and its end
+		unsigned char *slabCursor;
+		unsigned char *slabEnd;
+	};
+
+	SizeClass *classes;
+	size_t classCount;
+	//! Maps (size + 15) / 16 to a size class index
+	unsigned char *classLookup;
+	size_t slabSize;
+	//! Every slab the pool has allocated (freed when the pool is destroyed)
+	void **slabs;
+	size_t slabCount;
+	size_t slabCapacity;
+	std::mutex slabLock;
+	//! Distinguishes this pool from earlier pools which had the same index, so stale thread caches are never used
+	unsigned int generation;
+
+	/** @brief Allocates a new slab for a size class.  The class lock must be held.
+		@param shared Size class which needs the slab
+		@return False if the slab couldn't be allocated
+	*/
+	bool AddSlab(SizeClass &shared);
+
+	/** @brief Takes an empty magazine from the depot, or allocates one.  The class lock must be held.
+		@param shared Size class whose depot to use
+		@return Empty magazine, or nullptr if none could be allocated
+	*/
+	static Magazine* TakeEmptyMagazine(SizeClass &shared);
+
+	/** @brief Takes a single block from the depot or a slab, for threads which have no magazines
+		@param sizeClass Index of the size class
+		@return Block, or nullptr if no memory could be had
+	*/
+	void* TakeBlock(size_t sizeClass);
+
+	/** @brief Fills a magazine from the shared free list and the newest slab.  The class lock must be held.
+		@param shared Size class to take blocks from
+		@param magazine Magazine to fill
+	*/
+	void FillMagazine(SizeClass &shared, Magazine *magazine);
+
+	/** @brief Makes sure the thread's loaded magazine has a block in it, trading with the depot if needed
+		@param sizeClass Index of the size class
+		@param magazines The thread's magazines for the class
+		@return False if no memory could be had
+	*/
+	bool Reload(size_t sizeClass, ThreadMagazines &magazines);
+
+	/** @brief Makes sure the thread's loaded magazine has room for a block, trading with the depot if needed
+		@param sizeClass Index of the size class
+		@param magazines The thread's magazines for the class
+		@return False if no empty magazine could be had
+	*/
+	bool Unload(size_t sizeClass, ThreadMagazines &magazines);
+
+	/** @brief Hands a magazine back to the depot
+		@param sizeClass Index of the size class
+		@param magazine Magazine to return (may be nullptr)
+	*/
+	void ReturnMagazine(size_t sizeClass, Magazine *magazine);
+
+	friend struct PoolThreadCaches;
+
+public:
+
+	/**	@param sizeClasses Block sizes, in ascending order, or nullptr for the defaults (16 bytes to 4 KB)
+		@param classCount Number of entries in sizeClasses (at most 255)
+		@param slabSize Amount of memory requested from the system at a time (default: 256 KB)
+	*/
+	SizeClassPool(const size_t *sizeClasses = nullptr, size_t classCount = 0, size_t slabSize = 256 * 1024);
+	~SizeClassPool();
+
+	void* Allocate(size_t size);
+	void Deallocate(void *ptr, size_t size);
+	const char* GetName() const;
+
+	/** @brief Rounds a block size up to the size of the class it would be put in (see the class description)
+		@param size Block size in bytes
+		@return Class size in bytes
+	*/
+	static size_t RoundToClassSize(size_t size);
+
+	/** @brief Picks the size classes which waste the least memory for a given mix of block sizes
+		@param sizes Block sizes
+		@param counts Number of blocks of each size
+		@param count Number of entries in sizes and counts
+		@param classes Receives the class sizes, in ascending order
+		@param maxClasses Maximum number of classes to pick (at most 255)
+		@param largestClass Blocks larger than this are left to malloc (default: 4096)
+		@return Number of classes written to classes
+	*/
+	static size_t ComputeSizeClasses(const size_t *sizes, const long long *counts, size_t count, size_t *classes,
+		size_t maxClasses, size_t largestClass = 4096);
+
+	/** @brief Picks size classes (see ComputeSizeClasses) from a histogram written by MemoryTracer::ExportSizeHistogram
+		@param fileName Name of the histogram file
+		@param classes Receives the class sizes, in ascending order
+		@param maxClasses Maximum number of classes to pick (at most 255)
+		@param largestClass Blocks larger than this are left to malloc (default: 4096)
+		@return Number of classes written to classes, or 0 if the file couldn't be read
+	*/
+	static size_t LoadSizeClasses(const char *fileName, size_t *classes, size_t maxClasses, size_t largestClass = 4096);
+};
+
+#endif
@@ -0,0 +1,454 @@
+#include "MemoryTracer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <new>
+#include <thread>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+using namespace std;
+
+
+// Fewest blocks worth giving a thread of its own
+static const size_t blocksPerThread = 65536;
+
+/** @struct ReportText
+Growable text of one report thread.  Uses malloc, since the report is built while the tracer's lock is held.
+*/
+struct ReportText
+{
+	char *data;
+	size_t length;
+	size_t capacity;
+	bool failed;
+};
+
+struct BlockReportWorker;
+
+/** @struct BlockReportContext
+Everything the report threads share.  The live records don't change while the report is built, since the thread
+building it holds the tracer's lock.
+*/
+struct BlockReportContext
+{
+	const LiveRecordTable *records;
+	//! File and line of every site ID (index 0 is the unknown site)
+	const char **siteFiles;
+	int *siteLines;
+	const char *typeNames[2];
+	bool leaks;
+	bool countFirst;
+	bool detail;
+	unsigned int threadCount;
+	//! Rows in report order: by allocation type, then size, then age
+	uint32_t *sorted;
+	//! Position in sorted where each (allocation type, size) group starts, plus one entry for the end
+	size_t *groupStarts;
+	size_t groupCount;
+	//! Next group to be sorted by age
+	atomic<size_t> nextGroup;
+	void (*phase)(BlockReportWorker&);
+};
+
+/** @struct BlockReportWorker
+One thread's share of the report: a range of rows while grouping them, and the same range of positions in the sorted
+order while formatting.
+*/
+struct BlockReportWorker
+{
+	BlockReportContext *context;
+	size_t first;
+	size_t last;
+	//! Blocks of each (size, allocation type) in the range; once the groups are laid out, the position the next one goes
+	//! to in sorted
+	KeyMap counts;
+	bool failed;
+	ReportText text;
+};
+
+// Appends printf-style text to a report thread's text
+static void Append(ReportText &text, const char *format, ...)
+{
+	while(!text.failed)
+	{
+		va_list args;
+		va_start(args, format);
+		int written = vsnprintf(text.data + text.length, text.capacity - text.length, format, args);
+		va_end(args);
+		if(written < 0)
+		{
+			text.failed = true;
+		}
+		else if(text.length + written < text.capacity)
+		{
+			text.length += written;
+			return;
+		}
+		else
+		{
+			size_t newCapacity = max(text.capacity * 2, text.length + written + 1);
+			char *newData = static_cast<char*>(realloc(text.data, newCapacity));
+			if(newData)
+			{
+				text.data = newData;
+				text.capacity = newCapacity;
+			}
+			else
+			{
+				text.failed = true;
+			}
+		}
+	}
+}
+
+static void CountGroups(BlockReportWorker &worker)
+{
+	const LiveRecordTable &records = *worker.context->records;
+	for(size_t row = worker.first; row < worker.last; row++)
+	{
+		long long *count = worker.counts.FindOrAdd(records.Size(row), records.AllocType(row), 0);
+		if(!count)
+		{
+			worker.failed = true;
+			return;
+		}
+		(*count)++;
+	}
+}
+
+static void ScatterRows(BlockReportWorker &worker)
+{
+	const LiveRecordTable &records = *worker.context->records;
+	uint32_t *sorted = worker.context->sorted;
+	for(size_t row = worker.first; row < worker.last; row++)
+	{
+		long long *position = worker.counts.Find(records.Size(row), records.AllocType(row));
+		sorted[(*position)++] = static_cast<uint32_t>(row);
+	}
+}
+
+static void SortGroupsByAge(BlockReportWorker &worker)
+{
+	BlockReportContext &context = *worker.context;
+	const LiveRecordTable &records = *context.records;
+	// groups are claimed one at a time, since their sizes vary too much to split them up evenly in advance
+	for(size_t group; (group = context.nextGroup++) < context.groupCount; )
+	{
+		sort(context.sorted + context.groupStarts[group], context.sorted + context.groupStarts[group + 1],
+			[&records](uint32_t a, uint32_t b)
+		{
+			return records.AllocationNumber(a) < records.AllocationNumber(b);
+		});
+	}
+}
+
+static void FormatBlocks(BlockReportWorker &worker)
+{
+	BlockReportContext &context = *worker.context;
+	const LiveRecordTable &records = *context.records;
+	const size_t *starts = context.groupStarts;
+	if(worker.first >= worker.last)
+	{
+		return;
+	}
+
+	size_t group = upper_bound(starts, starts + context.groupCount + 1, worker.first) - starts - 1;
+	for(size_t position = worker.first; position < worker.last; position++)
+	{
+		if(position == starts[group + 1])
+		{
+			group++;
+		}
+		size_t row = context.sorted[position];
+		unsigned long long size = records.Size(row);
+		AllocationType type = static_cast<AllocationType>(records.AllocType(row));
+		if(position == starts[group])
+		{
+			unsigned long long blocks = starts[group + 1] - starts[group];
+			if(context.leaks)
+			{
+				Append(worker.text, "%llu memory leak(s) detected of size %llu and type %s", blocks, size,
+					context.typeNames[type]);
+			}
+			else
+			{
+				// the array allocations follow the non-array ones
+				if(type == ALLOC_NEW_ARRAY && (group == 0
+					|| records.AllocType(context.sorted[starts[group - 1]]) == ALLOC_NEW))
+				{
+					Append(worker.text, "\n<<Array allocations>>\n");
+				}
+				if(context.countFirst)
+				{
+					Append(worker.text, "\t%llu\tallocation(s) of size: %llu", blocks, size);
+				}
+				else
+				{
+					Append(worker.text, "\tSize: %llu\t# of allocations: %llu", size, blocks);
+				}
+			}
+		}
+		if(context.detail)
+		{
+			uint32_t siteId = records.SiteId(row);
+			// %p differs between C libraries (glibc adds the 0x itself, MSVC pads with zeros instead), so the address
+			// is written the way TraceWriter writes pointers
+			unsigned long long address = reinterpret_cast<uintptr_t>(records.Address(row));
+			Append(worker.text, context.leaks ? "\n\tAddress: 0x%llx File: %s Line: %d"
+				: "\n\tAddress: 0x%llx  File: %s  Line: %d", address, context.siteFiles[siteId],
+				context.siteLines[siteId]);
+		}
+		else
+		{
+			// nothing is listed per block, so skip to the group's last block in the range
+			position = min(starts[group + 1], worker.last) - 1;
+		}
+		if(position + 1 == starts[group + 1])
+		{
+			Append(worker.text, context.leaks ? "\n\n" : "\n");
+		}
+	}
+}
+
+// Gathers the groups the threads counted, orders them by allocation type and then size, and turns each thread's counts
+// into the positions its blocks go to; each thread's blocks of a group go after those of the threads before it, so
+// the order doesn't depend on how the rows were split up.  Returns false if memory ran out.
+static bool LayOutGroups(BlockReportContext &context, BlockReportWorker *workers, size_t blocks[2])
+{
+	struct GroupKey
+	{
+		uintptr_t size;
+		int type;
+	};
+
+	// totals of every group, which become the next position in sorted as the threads are handed their share
+	KeyMap totals;
+	size_t groupCount = 0;
+	bool ok = true;
+	for(unsigned int i = 0; i < context.threadCount && ok; i++)
+	{
+		ok = !workers[i].failed;
+		workers[i].counts.ForEach([&](uintptr_t size, int type, long long count)
+		{
+			long long *total = totals.Find(size, type);
+			if(!total)
+			{
+				total = totals.FindOrAdd(size, type, 0);
+				groupCount += total != nullptr;
+			}
+			if(total)
+			{
+				*total += count;
+			}
+			ok = ok && total;
+		});
+	}
+	GroupKey *keys = static_cast<GroupKey*>(malloc((groupCount ? groupCount : 1) * sizeof(GroupKey)));
+	context.groupStarts = static_cast<size_t*>(malloc((groupCount + 1) * sizeof(size_t)));
+	if(!ok || !keys || !context.groupStarts)
+	{
+		free(keys);
+		return false;
+	}
+
+	size_t key = 0;
+	totals.ForEach([&](uintptr_t size, int type, long long)
+	{
+		keys[key].size = size;
+		keys[key].type = type;
+		key++;
+	});
+	sort(keys, keys + groupCount, [](const GroupKey &a, const GroupKey &b)
+	{
+		return a.type != b.type ? a.type < b.type : a.size < b.size;
+	});
+	size_t start = 0;
+	for(size_t group = 0; group < groupCount; group++)
+	{
+		long long *total = totals.Find(keys[group].size, keys[group].type);
+		size_t count = static_cast<size_t>(*total);
+		context.groupStarts[group] = start;
+		*total = start;
+		start += count;
+		blocks[keys[group].type] += count;
+	}
+	context.groupStarts[groupCount] = start;
+	context.groupCount = groupCount;
+
+	for(unsigned int i = 0; i < context.threadCount; i++)
+	{
+		KeyMap &counts = workers[i].counts;
+		counts.ForEach([&](uintptr_t size, int type, long long count)
+		{
+			long long *next = totals.Find(size, type);
+			*counts.Find(size, type) = *next;
+			*next += count;
+		});
+	}
+	free(keys);
+	return true;
+}
+
+#ifdef _WIN32
+typedef HANDLE ReportThread;
+
+static DWORD WINAPI RunReportWorker(LPVOID worker)
+#else
+typedef pthread_t ReportThread;
+
+static void* RunReportWorker(void *worker)
+#endif
+{
+	BlockReportWorker *reportWorker = static_cast<BlockReportWorker*>(worker);
+	reportWorker->context->phase(*reportWorker);
+	return 0;
+}
+
+// Runs one phase of the report on every worker, each on a thread of its own (the calling thread being one of them),
+// and waits for all of them to finish
+static void RunPhase(BlockReportContext &context, BlockReportWorker *workers, void (*phase)(BlockReportWorker&))
+{
+	context.phase = phase;
+	// raw threads, since std::thread would allocate (and free, from the new thread) through the tracer, whose lock is
+	// held
+	ReportThread *threads = static_cast<ReportThread*>(malloc(context.threadCount * sizeof(ReportThread)));
+	bool *started = static_cast<bool*>(calloc(context.threadCount, sizeof(bool)));
+	for(unsigned int i = 1; i < context.threadCount && threads && started; i++)
+	{
+#ifdef _WIN32
+		threads[i] = CreateThread(nullptr, 0, RunReportWorker, &workers[i], 0, nullptr);
+		started[i] = threads[i] != nullptr;
+#else
+		started[i] = pthread_create(&threads[i], nullptr, RunReportWorker, &workers[i]) == 0;
+#endif
+	}
+	phase(workers[0]);
+	for(unsigned int i = 1; i < context.threadCount; i++)
+	{
+		if(started && started[i])
+		{
+#ifdef _WIN32
+			WaitForSingleObject(threads[i], INFINITE);
+			CloseHandle(threads[i]);
+#else
+			pthread_join(threads[i], nullptr);
+#endif
+		}
+		else
+		{
+			// couldn't get a thread, so do its share here
+			phase(workers[i]);
+		}
+	}
+	free(threads);
+	free(started);
+}
+
+char* MemoryTracer::BuildBlockReport(BlockReportStyle style, bool displayDetail, size_t &length, size_t blocks[2])
+{
+	size_t count = liveRecords.count;
+	length = 0;
+	blocks[ALLOC_NEW] = blocks[ALLOC_NEW_ARRAY] = 0;
+
+	BlockReportContext context;
+	context.records = &liveRecords;
+	context.typeNames[ALLOC_NEW] = GetAllocTypeAsString(ALLOC_NEW);
+	context.typeNames[ALLOC_NEW_ARRAY] = GetAllocTypeAsString(ALLOC_NEW_ARRAY);
+	context.leaks = style == REPORT_LEAKS;
+	context.countFirst = style == REPORT_COUNT_FIRST;
+	context.detail = displayDetail || context.leaks;
+	unsigned int processors = reportThreads ? reportThreads : max(thread::hardware_concurrency(), 1u);
+	context.threadCount = static_cast<unsigned int>(min<size_t>(processors, max<size_t>(count / blocksPerThread, 1)));
+	context.sorted = static_cast<uint32_t*>(malloc((count ? count : 1) * sizeof(uint32_t)));
+	context.siteFiles = static_cast<const char**>(malloc((siteCount + 1) * sizeof(const char*)));
+	context.siteLines = static_cast<int*>(malloc((siteCount + 1) * sizeof(int)));
+	context.groupStarts = nullptr;
+	context.groupCount = 0;
+	context.nextGroup = 0;
+
+	BlockReportWorker *workers = static_cast<BlockReportWorker*>(malloc(context.threadCount * sizeof(BlockReportWorker)));
+	bool ok = context.sorted && context.siteFiles && context.siteLines && workers;
+	for(unsigned int i = 0; workers && i < context.threadCount; i++)
+	{
+		BlockReportWorker *worker = new(&workers[i]) BlockReportWorker;
+		worker->context = &context;
+		worker->first = count * i / context.threadCount;
+		worker->last = count * (i + 1) / context.threadCount;
+		worker->failed = false;
+		worker->text.length = 0;
+		worker->text.capacity = 65536;
+		worker->text.data = static_cast<char*>(malloc(worker->text.capacity));
+		worker->text.failed = !worker->text.data;
+		ok = ok && worker->text.data;
+	}
+
+	if(ok)
+	{
+		context.siteFiles[0] = unknown;
+		context.siteLines[0] = 0;
+		for(size_t i = 1; i <= siteCount; i++)
+		{
+			context.siteFiles[i] = siteTable[i]->file;
+			context.siteLines[i] = siteTable[i]->line;
+		}
+
+		// group the rows by (allocation type, size) with a counting sort, whose result doesn't depend on the number of
+		// threads, then order each group by age and format each thread's share of the result
+		RunPhase(context, workers, CountGroups);
+		ok = LayOutGroups(context, workers, blocks);
+	}
+	if(ok)
+	{
+		RunPhase(context, workers, ScatterRows);
+		RunPhase(context, workers, SortGroupsByAge);
+		RunPhase(context, workers, FormatBlocks);
+	}
+
+	// join the threads' text in order, with the section headings of DisplayAllocations around it
+	char *text = nullptr;
+	if(ok)
+	{
+		const char *prefix = context.leaks ? "" : "<<Non-array allocations>>\n";
+		const char *suffix = !context.leaks && !blocks[ALLOC_NEW_ARRAY] ? "\n<<Array allocations>>\n" : "";
+		size_t total = strlen(prefix) + strlen(suffix);
+		for(unsigned int i = 0; i < context.threadCount; i++)
+		{
+			ok = ok && !workers[i].text.failed;
+			total += workers[i].text.length;
+		}
+		text = ok ? static_cast<char*>(malloc(total + 1)) : nullptr;
+		if(text)
+		{
+			memcpy(text, prefix, strlen(prefix));
+			length = strlen(prefix);
+			for(unsigned int i = 0; i < context.threadCount; i++)
+			{
+				memcpy(text + length, workers[i].text.data, workers[i].text.length);
+				length += workers[i].text.length;
+			}
+			memcpy(text + length, suffix, strlen(suffix));
+			length += strlen(suffix);
+			text[length] = '\0';
+		}
+	}
+
+	for(unsigned int i = 0; workers && i < context.threadCount; i++)
+	{
+		free(workers[i].text.data);
+		workers[i].~BlockReportWorker();
+	}
+	free(workers);
+	free(context.sorted);
+	free(context.siteFiles);
+	free(context.siteLines);
+	free(context.groupStarts);
+	return text;
+}
@@ -0,0 +1,196 @@
+#include "MemoryTracer.h"
+
+#include <algorithm>
+#include <cstring>
+
+using namespace std;
+
+
+// Frames belonging to the tracer itself (RecordGrowth, TrackGrowthOn*, RecordAllocation/RecordDeallocation,
+// Allocate/Deallocate, and the operator), which are the same for every growth step and so are left out of the site
+static const int tracerFrames = 5;
+
+/** @struct GrowthEvent
+The calling thread's most recent allocation or deallocation; a growth step is a pair of consecutive events.
+*/
+struct GrowthEvent
+{
+	//! Block the event was about, or nullptr if there is nothing to pair the next event with
+	const void *block;
+	//! MemoryTracer::growthCaller of the event
+	const void *caller;
+	size_t size;
+	bool allocation;
+	//! For deallocations, whether the freed block was itself the result of a growth step
+	bool grown;
+};
+
+static thread_local GrowthEvent lastGrowthEvent;
+
+thread_local const void *MemoryTracer::growthCaller = nullptr;
+
+// How far apart the operator new and delete calls of one growth step may be in the code.  A container makes both
+// calls from the same function (or, without inlining, from its allocator's allocate and deallocate, which are
+// instantiated next to each other), while unrelated code is almost always further away.
+static const uintptr_t growthSiteDistance = 4096;
+
+// Returns true if two events' calls came from the same site, so they could be one container replacing its buffer
+static bool IsSameGrowthSite(const void *a, const void *b)
+{
+	uintptr_t first = reinterpret_cast<uintptr_t>(a), second = reinterpret_cast<uintptr_t>(b);
+	return (first > second ? first - second : second - first) <= growthSiteDistance;
+}
+
+// Returns true if a block of newSize could have replaced one of oldSize as a container grew (vectors and strings grow
+// by 1.5x or 2x, depending on the library)
+static bool IsGrowthStep(size_t oldSize, size_t newSize)
+{
+	return oldSize && newSize * 10 >= oldSize * 14 && newSize * 10 <= oldSize * 21;
+}
+
+void MemoryTracer::TrackGrowthOnAllocate(AllocationHeader *header)
+{
+	GrowthEvent &last = lastGrowthEvent;
+	// freed and then reallocated larger, the way realloc-style code grows a buffer
+	if(last.block && !last.allocation && IsGrowthStep(last.size, header->rawSize)
+		&& IsSameGrowthSite(last.caller, growthCaller))
+	{
+		header->grown = true;
+		RecordGrowth(last.size, header->rawSize, last.grown);
+		last.block = nullptr;
+		return;
+	}
+	last.block = header;
+	last.caller = growthCaller;
+	last.size = header->rawSize;
+	last.allocation = true;
+	last.grown = false;
+}
+
+void MemoryTracer::TrackGrowthOnDeallocate(AllocationHeader *header)
+{
+	GrowthEvent &last = lastGrowthEvent;
+	// the new buffer is allocated and the contents moved over before the old one is freed, which is what
+	// std::vector and std::string do
+	if(last.block && last.allocation && last.block != header && IsGrowthStep(header->rawSize, last.size)
+		&& IsSameGrowthSite(last.caller, growthCaller))
+	{
+		AllocationHeader *newHeader = static_cast<AllocationHeader*>(const_cast<void*>(last.block));
+		newHeader->grown = true;
+		RecordGrowth(header->rawSize, last.size, header->grown);
+		// each block can only be part of one step
+		last.block = nullptr;
+		return;
+	}
+	last.block = header;
+	last.caller = growthCaller;
+	last.size = header->rawSize;
+	last.allocation = false;
+	last.grown = header->grown;
+}
+
+void MemoryTracer::RecordGrowth(size_t oldSize, size_t newSize, bool continued)
+{
+	// the stack is only captured once a step has been found, so tracking costs next to nothing for other allocations
+	void *frames[MEMORYTRACER_GROWTH_STACK_DEPTH];
+	int frameCount = CaptureStack(frames, MEMORYTRACER_GROWTH_STACK_DEPTH, tracerFrames);
+
+	GrowthSiteNode *site = head_growthSites;
+	while(site && (site->frameCount != frameCount || memcmp(site->frames, frames, frameCount * sizeof(void*))))
+	{
+		site = site->next;
+	}
+	if(!site)
+	{
+		site = static_cast<GrowthSiteNode*>(malloc(sizeof(GrowthSiteNode)));
+		if(!site)
+		{
+			return;
+		}
+		memcpy(site->frames, frames, frameCount * sizeof(void*));
+		site->frameCount = frameCount;
+		site->copies = 0;
+		site->containers = 0;
+		site->bytesCopied = 0;
+		site->largestBlock = 0;
+		site->next = head_growthSites;
+		head_growthSites = site;
+	}
+	site->copies++;
+	site->bytesCopied += oldSize;
+	site->largestBlock = max(site->largestBlock, newSize);
+	if(!continued)
+	{
+		site->containers++;
+	}
+}
+
+void MemoryTracer::DisplayGrowthReport(size_t maxRows)
+{
+	lock_guard<recursive_mutex> guard(tracerLock);
+	long long allocationsBefore = totalAllocations;
+	TraceWriter out(stdout);
+	size_t siteCount = 0;
+	long long totalCopies = 0;
+	size_t totalBytes = 0;
+	for(GrowthSiteNode *site = head_growthSites; site; site = site->next)
+	{
+		siteCount++;
+		totalCopies += site->copies;
+		totalBytes += site->bytesCopied;
+	}
+	if(!siteCount)
+	{
+		out << "No container growth recorded\n\n";
+		return;
+	}
+
+	GrowthSiteNode **sites = static_cast<GrowthSiteNode**>(malloc(siteCount * sizeof(GrowthSiteNode*)));
+	if(!sites)
+	{
+		return;
+	}
+	size_t i = 0;
+	for(GrowthSiteNode *site = head_growthSites; site; site = site->next)
+	{
+		sites[i++] = site;
+	}
+	size_t rows = min(maxRows, siteCount);
+	partial_sort(sites, sites + rows, sites + siteCount, [](const GrowthSiteNode *a, const GrowthSiteNode *b)
+	{
+		return a->bytesCopied > b->bytesCopied;
+	});
+
+	out << "Container growth: " << totalCopies << " copies (" << totalBytes << " bytes) at " << siteCount
+		<< " call stack(s) could be avoided with reserve()\n";
+	out << TraceWriter::Width(12) << "Copies"
+		<< TraceWriter::Width(12) << "Containers"
+		<< TraceWriter::Width(16) << "Bytes copied"
+		<< TraceWriter::Width(14) << "Largest block"
+		<< "\n========================================================================";
+	for(i = 0; i < rows; i++)
+	{
+		const GrowthSiteNode *site = sites[i];
+		out << "\n" << TraceWriter::Width(12, '.') << site->copies
+			<< TraceWriter::Width(12, '.') << site->containers
+			<< TraceWriter::Width(16, '.') << site->bytesCopied
+			<< site->largestBlock;
+		for(int f = 0; f < site->frameCount; f++)
+		{
+			out << "\n\t" << site->frames[f];
+			char *demangled;
+			const char *symbol = FindSymbolName(site->frames[f], demangled);
+			if(symbol)
+			{
+				// template names can be enormous; the start is the informative part
+				out << " ";
+				out.Write(symbol, min<size_t>(strlen(symbol), 100));
+			}
+			free(demangled);
+		}
+	}
+	out << "\n\n";
+	out.Flush();
+	free(sites);
+	assert(totalAllocations == allocationsBefore);
+}
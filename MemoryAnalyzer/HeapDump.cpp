@@ -0,0 +1,232 @@
+#include "MemoryTracer.h"
+#include "HeapDump.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdio.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+
+/** @struct DumpOutput
+Destination buffer for a heap dump.  On POSIX systems this is the file itself, mapped into memory; elsewhere it is a
+plain buffer which is written out with a single call once it's filled.
+*/
+struct DumpOutput
+{
+	unsigned char *data;
+	size_t size;
+#ifdef _WIN32
+	FILE *file;
+#else
+	int fd;
+#endif
+};
+
+// Creates the output file and returns a buffer of the given size to fill in; returns false on failure
+static bool OpenDumpOutput(const char *fileName, size_t size, DumpOutput &out)
+{
+	out.size = size;
+#ifdef _WIN32
+	out.file = fopen(fileName, "wb");
+	if(!out.file)
+	{
+		return false;
+	}
+	out.data = static_cast<unsigned char*>(malloc(size));
+	if(!out.data)
+	{
+		fclose(out.file);
+		return false;
+	}
+#else
+	out.fd = open(fileName, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if(out.fd < 0)
+	{
+		return false;
+	}
+	if(ftruncate(out.fd, size) != 0)
+	{
+		close(out.fd);
+		return false;
+	}
+	void *mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, out.fd, 0);
+	if(mapping == MAP_FAILED)
+	{
+		close(out.fd);
+		return false;
+	}
+	out.data = static_cast<unsigned char*>(mapping);
+#endif
+	return true;
+}
+
+// Flushes the buffer to the file (if it isn't the file already) and releases it
+static bool CloseDumpOutput(DumpOutput &out)
+{
+#ifdef _WIN32
+	bool ok = fwrite(out.data, 1, out.size, out.file) == out.size;
+	free(out.data);
+	return fclose(out.file) == 0 && ok;
+#else
+	bool ok = munmap(out.data, out.size) == 0;
+	return close(out.fd) == 0 && ok;
+#endif
+}
+
+bool MemoryTracer::WriteHeapDump(const char *fileName)
+{
+	lock_guard<recursive_mutex> guard(tracerLock);
+	return DumpHeap(fileName);
+}
+
+bool MemoryTracer::DumpHeap(const char *fileName)
+{
+	uint64_t recordCount = liveRecords.count;
+
+	// the strings are those of the type and site tables, which the records refer to by ID
+	size_t pointerCount = 0;
+	const char **pointers = static_cast<const char**>(malloc((typeCount + siteCount + 1) * sizeof(const char*)));
+	if(!pointers)
+	{
+		return false;
+	}
+	pointers[pointerCount++] = unknown;
+	for(size_t i = 1; i <= typeCount; i++)
+	{
+		pointers[pointerCount++] = typeTable[i]->type;
+	}
+	for(size_t i = 1; i <= siteCount; i++)
+	{
+		pointers[pointerCount++] = siteTable[i]->file;
+	}
+
+	// removing duplicate pointers leaves a short list; the same text can still live at several addresses (e.g.,
+	// __FILE__ in different translation units), so the ids are assigned by content
+	sort(pointers, pointers + pointerCount);
+	pointerCount = unique(pointers, pointers + pointerCount) - pointers;
+
+	uint32_t *byContent = static_cast<uint32_t*>(malloc(pointerCount * sizeof(uint32_t)));
+	uint32_t *ids = static_cast<uint32_t*>(malloc(pointerCount * sizeof(uint32_t)));
+	uint32_t *typeStrings = static_cast<uint32_t*>(malloc((typeCount + 1) * sizeof(uint32_t)));
+	uint32_t *siteStrings = static_cast<uint32_t*>(malloc((siteCount + 1) * sizeof(uint32_t)));
+	if(!byContent || !ids || !typeStrings || !siteStrings)
+	{
+		free(pointers);
+		free(byContent);
+		free(ids);
+		free(typeStrings);
+		free(siteStrings);
+		return false;
+	}
+	for(uint32_t i = 0; i < pointerCount; i++)
+	{
+		byContent[i] = i;
+	}
+	sort(byContent, byContent + pointerCount, [=](uint32_t a, uint32_t b)
+	{
+		return strcmp(pointers[a], pointers[b]) < 0;
+	});
+
+	// byContent is reused to hold the representative pointer index of each distinct string
+	uint64_t stringCount = 0;
+	uint64_t stringDataSize = 0;
+	for(size_t i = 0; i < pointerCount; i++)
+	{
+		if(i == 0 || strcmp(pointers[byContent[i]], pointers[byContent[stringCount - 1]]))
+		{
+			byContent[stringCount++] = byContent[i];
+			stringDataSize += strlen(pointers[byContent[i]]) + 1;
+		}
+		ids[byContent[i]] = static_cast<uint32_t>(stringCount - 1);
+	}
+
+	// the string of every type and site ID is looked up once, so filling in the records is a plain scan of the columns
+	auto stringId = [=](const char *str) -> uint32_t
+	{
+		return ids[lower_bound(pointers, pointers + pointerCount, str) - pointers];
+	};
+	typeStrings[0] = siteStrings[0] = stringId(unknown);
+	for(size_t i = 1; i <= typeCount; i++)
+	{
+		typeStrings[i] = stringId(typeTable[i]->type);
+	}
+	for(size_t i = 1; i <= siteCount; i++)
+	{
+		siteStrings[i] = stringId(siteTable[i]->file);
+	}
+
+	HeapDumpHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, HEAPDUMP_MAGIC, sizeof(HEAPDUMP_MAGIC));
+	header.version = HEAPDUMP_VERSION;
+	header.recordSize = sizeof(HeapDumpRecord);
+	header.recordCount = recordCount;
+	header.stringCount = stringCount;
+	header.stringTableOffset = sizeof(HeapDumpHeader);
+	header.stringDataOffset = header.stringTableOffset + stringCount * sizeof(uint64_t);
+	header.recordsOffset = (header.stringDataOffset + stringDataSize + 7) & ~static_cast<uint64_t>(7);
+	header.currentMemory = currentMemory;
+	header.peakMemory = peakMemory;
+
+	DumpOutput out;
+	bool ok = OpenDumpOutput(fileName, static_cast<size_t>(header.recordsOffset + recordCount * sizeof(HeapDumpRecord)),
+		out);
+	if(ok)
+	{
+		memcpy(out.data, &header, sizeof(header));
+		memset(out.data + header.stringDataOffset + stringDataSize, 0,
+			static_cast<size_t>(header.recordsOffset - header.stringDataOffset - stringDataSize));
+
+		uint64_t *offsets = reinterpret_cast<uint64_t*>(out.data + header.stringTableOffset);
+		unsigned char *stringData = out.data + header.stringDataOffset;
+		uint64_t stringOffset = 0;
+		for(uint64_t i = 0; i < stringCount; i++)
+		{
+			size_t length = strlen(pointers[byContent[i]]) + 1;
+			offsets[i] = stringOffset;
+			memcpy(stringData + stringOffset, pointers[byContent[i]], length);
+			stringOffset += length;
+		}
+
+		// the records are filled in directly in the output and sorted there
+		HeapDumpRecord *records = reinterpret_cast<HeapDumpRecord*>(out.data + header.recordsOffset);
+		HeapDumpRecord *record = records;
+		for(size_t row = 0; row < liveRecords.count; row++, record++)
+		{
+			record->address = reinterpret_cast<uintptr_t>(liveRecords.Address(row));
+			record->size = liveRecords.Size(row);
+			record->type = typeStrings[liveRecords.TypeId(row)];
+			record->file = siteStrings[liveRecords.SiteId(row)];
+			record->line = SiteLine(liveRecords.SiteId(row));
+			record->allocType = liveRecords.AllocType(row);
+		}
+		sort(records, record, [](const HeapDumpRecord &a, const HeapDumpRecord &b)
+		{
+			if(a.file != b.file)
+				return a.file < b.file;
+			if(a.line != b.line)
+				return a.line < b.line;
+			if(a.type != b.type)
+				return a.type < b.type;
+			if(a.size != b.size)
+				return a.size < b.size;
+			return a.address < b.address;
+		});
+
+		ok = CloseDumpOutput(out);
+	}
+
+	free(pointers);
+	free(byContent);
+	free(ids);
+	free(typeStrings);
+	free(siteStrings);
+	return ok;
+}
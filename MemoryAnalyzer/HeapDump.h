@@ -0,0 +1,74 @@
+/** @file HeapDump.h
+@brief Layout of the binary heap dump written by MemoryTracer::WriteHeapDump.  Shared with the HeapQuery tool.
+
+A dump is a single file laid out as:
+
+	HeapDumpHeader
+	string offset table (stringCount x uint64_t, relative to the start of the string data)
+	string data (NUL-terminated strings)
+	padding up to an 8-byte boundary
+	records (recordCount x HeapDumpRecord, sorted by site: file, line, type, then size)
+
+All integers are stored in the byte order of the machine which wrote the dump.  Every part of the file is located
+through the header, so readers can map the file and use it in place without parsing it first.
+*/
+
+#ifndef HEAPDUMP_H
+#define HEAPDUMP_H
+
+
+#include <stdint.h>
+
+
+//! Identifies a heap dump file (first 8 bytes of the header)
+#define HEAPDUMP_MAGIC "MAHEAPD"
+//! Version of the layout described in this file
+#define HEAPDUMP_VERSION 1
+
+/** @struct HeapDumpHeader
+File header.  Offsets are from the start of the file.
+*/
+struct HeapDumpHeader
+{
+	//! HEAPDUMP_MAGIC, NUL-terminated
+	char magic[8];
+	//! HEAPDUMP_VERSION
+	uint32_t version;
+	//! sizeof(HeapDumpRecord) of the writer, so readers can reject incompatible dumps
+	uint32_t recordSize;
+	//! Number of live blocks in the dump
+	uint64_t recordCount;
+	//! Number of distinct strings (types and filenames)
+	uint64_t stringCount;
+	//! Offset of the string offset table
+	uint64_t stringTableOffset;
+	//! Offset of the string data the string offset table points into
+	uint64_t stringDataOffset;
+	//! Offset of the first record
+	uint64_t recordsOffset;
+	//! Memory allocated at the time of the dump, in bytes
+	uint64_t currentMemory;
+	//! Peak memory at the time of the dump, in bytes
+	uint64_t peakMemory;
+};
+
+/** @struct HeapDumpRecord
+One live block.  String fields are indices into the string offset table.
+*/
+struct HeapDumpRecord
+{
+	//! Address handed to the program
+	uint64_t address;
+	//! Size requested by the program
+	uint64_t size;
+	//! Object type (string index)
+	uint32_t type;
+	//! Source file (string index)
+	uint32_t file;
+	//! Line number
+	uint32_t line;
+	//! AllocationType of the block (ALLOC_NEW or ALLOC_NEW_ARRAY)
+	uint32_t allocType;
+};
+
+#endif
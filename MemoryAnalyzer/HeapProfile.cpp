@@ -0,0 +1,539 @@
+#include "MemoryTracer.h"
+
+#include <algorithm>
+#include <cstring>
+
+using namespace std;
+
+
+// FNV-1a over the return addresses of a stack
+static uintptr_t HashFrames(void *const *frames, int frameCount)
+{
+	uint64_t hash = 14695981039346656037ull;
+	for(int i = 0; i < frameCount; i++)
+	{
+		hash = (hash ^ static_cast<uint64_t>(reinterpret_cast<uintptr_t>(frames[i]))) * 1099511628211ull;
+	}
+	return static_cast<uintptr_t>(hash);
+}
+
+size_t MemoryTracer::InternProfileSite(uint32_t siteId, uint32_t typeId)
+{
+	long long *knownIndex = profileSiteIds.Find(typeId, static_cast<int>(siteId));
+	if(knownIndex)
+	{
+		return static_cast<size_t>(*knownIndex);
+	}
+	if(!GrowArray(profileSites, profileSiteCapacity, profileSiteCount + 1)
+		|| !profileSiteIds.FindOrAdd(typeId, static_cast<int>(siteId), profileSiteCount))
+	{
+		return static_cast<size_t>(-1);
+	}
+	ProfileSite &entry = profileSites[profileSiteCount];
+	entry.siteId = siteId;
+	entry.typeId = typeId;
+	memset(&entry.totals, 0, sizeof(entry.totals));
+	return profileSiteCount++;
+}
+
+uint32_t MemoryTracer::InternProfileStack(void **frames, int frameCount)
+{
+	if(frameCount <= 0)
+	{
+		return 0;
+	}
+	uintptr_t hash = HashFrames(frames, frameCount);
+	long long *firstWithHash = profileStackHashes.Find(hash, 0);
+	uint32_t first = firstWithHash ? static_cast<uint32_t>(*firstWithHash) : 0;
+	for(uint32_t id = first; id; id = profileStacks[id].nextSameHash)
+	{
+		if(profileStacks[id].frameCount == frameCount && !memcmp(profileStacks[id].frames, frames,
+			frameCount * sizeof(void*)))
+		{
+			return id;
+		}
+	}
+
+	// entry 0 stands for blocks whose stack wasn't captured, so the first stack goes in entry 1
+	size_t id = max<size_t>(profileStackCount, 1);
+	if(!GrowArray(profileStacks, profileStackCapacity, id + 1))
+	{
+		return 0;
+	}
+	long long *head = profileStackHashes.FindOrAdd(hash, 0, id);
+	if(!head)
+	{
+		return 0;
+	}
+	// the new stack goes in front of the others with the same hash
+	*head = id;
+	ProfileStack &stack = profileStacks[id];
+	memcpy(stack.frames, frames, frameCount * sizeof(void*));
+	stack.frameCount = frameCount;
+	stack.nextSameHash = first;
+	memset(&stack.totals, 0, sizeof(stack.totals));
+	profileStackCount = id + 1;
+	return static_cast<uint32_t>(id);
+}
+
+void MemoryTracer::ProfileAllocation(size_t row, int callerFrames)
+{
+	size_t size = liveRecords.Size(row);
+	size_t site = InternProfileSite(0, 0);
+	if(site != static_cast<size_t>(-1))
+	{
+		profileSites[site].totals.AddBlock(size);
+	}
+	if(captureAllocationStacks)
+	{
+		// ProfileAllocation, RecordAllocation, and its callers in the tracer are the same for every allocation, so
+		// they are left out
+		void *frames[MEMORYTRACER_PROFILE_STACK_DEPTH];
+		int frameCount = CaptureStack(frames, MEMORYTRACER_PROFILE_STACK_DEPTH, 2 + callerFrames);
+		uint32_t stack = InternProfileStack(frames, frameCount);
+		// if the record has no room for the stack, neither does the profile
+		if(stack && liveRecords.SetStackId(row, stack))
+		{
+			profileStacks[stack].totals.AddBlock(size);
+		}
+	}
+}
+
+void MemoryTracer::ProfileDetails(size_t row)
+{
+	size_t to = InternProfileSite(liveRecords.SiteId(row), liveRecords.TypeId(row));
+	long long *from = profileSiteIds.Find(0, 0);
+	// if the entry couldn't be added, the block stays under the unknown site and type
+	if(to == static_cast<size_t>(-1) || !from || to == static_cast<size_t>(*from))
+	{
+		return;
+	}
+	profileSites[*from].totals.RemoveBlock(liveRecords.Size(row));
+	profileSites[to].totals.AddBlock(liveRecords.Size(row));
+}
+
+void MemoryTracer::ProfileDeallocation(size_t row)
+{
+	size_t size = liveRecords.Size(row);
+	long long *site = profileSiteIds.Find(liveRecords.TypeId(row), static_cast<int>(liveRecords.SiteId(row)));
+	if(site)
+	{
+		profileSites[*site].totals.FreeBlock(size);
+	}
+	uint32_t stack = liveRecords.StackId(row);
+	if(stack)
+	{
+		profileStacks[stack].totals.FreeBlock(size);
+	}
+}
+
+
+/** @class SymbolCache
+Names of the return addresses seen so far during an export, so each address is only looked up and demangled once.
+*/
+class SymbolCache
+{
+public:
+
+	SymbolCache()
+	{}
+	~SymbolCache()
+	{
+		names.ForEach([](uintptr_t, int, long long name)
+		{
+			free(reinterpret_cast<char*>(static_cast<intptr_t>(name)));
+		});
+	}
+
+	/** @return Name of the function the address belongs to, or nullptr if it isn't known
+	*/
+	const char* Find(const void *address)
+	{
+		long long *known = names.Find(reinterpret_cast<uintptr_t>(address), 0);
+		if(known)
+		{
+			return reinterpret_cast<const char*>(static_cast<intptr_t>(*known));
+		}
+		char *demangled;
+		const char *symbol = FindSymbolName(address, demangled);
+		char *name = nullptr;
+		if(symbol)
+		{
+			size_t length = strlen(symbol);
+			name = static_cast<char*>(malloc(length + 1));
+			if(name)
+			{
+				memcpy(name, symbol, length + 1);
+			}
+		}
+		free(demangled);
+		if(!names.FindOrAdd(reinterpret_cast<uintptr_t>(address), 0,
+			static_cast<long long>(reinterpret_cast<intptr_t>(name))))
+		{
+			free(name);
+			return nullptr;
+		}
+		return name;
+	}
+
+private:
+
+	KeyMap names;
+
+	SymbolCache(const SymbolCache&);
+	SymbolCache& operator=(const SymbolCache&);
+};
+
+// Writes one frame of a folded stack; ';' separates the frames, so any in the name are replaced
+static void WriteFoldedFrame(TraceWriter &out, const char *name)
+{
+	for(const char *part = name; *part; )
+	{
+		size_t length = strcspn(part, ";");
+		out.Write(part, length);
+		part += length;
+		if(*part)
+		{
+			out << ',';
+			part++;
+		}
+	}
+}
+
+bool MemoryTracer::ExportFoldedStacks(const char *fileName, ProfileKey key, ProfileValue value)
+{
+	FILE *file = fopen(fileName, "w");
+	if(!file)
+	{
+		return false;
+	}
+	lock_guard<recursive_mutex> guard(tracerLock);
+	auto amountOf = [value](const ProfileTotals &totals) -> long long
+	{
+		switch(value)
+		{
+		case PROFILE_LIVE_BLOCKS:
+			return totals.liveBlocks;
+		case PROFILE_ALLOCATED_BYTES:
+			return static_cast<long long>(totals.allocatedBytes);
+		case PROFILE_ALLOCATED_BLOCKS:
+			return totals.allocatedBlocks;
+		default:
+			return static_cast<long long>(totals.liveBytes);
+		}
+	};
+	{
+		TraceWriter out(file);
+		if(key == PROFILE_BY_SITE)
+		{
+			for(size_t i = 0; i < profileSiteCount; i++)
+			{
+				const ProfileSite &entry = profileSites[i];
+				long long amount = amountOf(entry.totals);
+				if(amount > 0)
+				{
+					WriteFoldedFrame(out, SiteFile(entry.siteId));
+					out << ':' << SiteLine(entry.siteId) << ';';
+					WriteFoldedFrame(out, TypeName(entry.typeId));
+					out << ' ' << amount << '\n';
+				}
+			}
+		}
+		else
+		{
+			SymbolCache symbols;
+			for(size_t i = 1; i < profileStackCount; i++)
+			{
+				const ProfileStack &stack = profileStacks[i];
+				long long amount = amountOf(stack.totals);
+				if(amount <= 0)
+				{
+					continue;
+				}
+				for(int f = stack.frameCount - 1; f >= 0; f--)
+				{
+					const char *name = symbols.Find(stack.frames[f]);
+					if(name)
+					{
+						WriteFoldedFrame(out, name);
+					}
+					else
+					{
+						out << static_cast<const void*>(stack.frames[f]);
+					}
+					out << (f ? ';' : ' ');
+				}
+				out << amount << '\n';
+			}
+		}
+	}
+	bool ok = !ferror(file);
+	return fclose(file) == 0 && ok;
+}
+
+
+/** @struct ProtoMessage
+A small protobuf message (a sample, location, function, or value type of a pprof profile), built in place before it
+is written out as a field of the profile.
+*/
+struct ProtoMessage
+{
+	unsigned char data[512];
+	size_t length;
+
+	ProtoMessage() : length(0)
+	{}
+
+	void PutVarint(uint64_t value)
+	{
+		assert(length + 10 <= sizeof(data));
+		while(value >= 0x80)
+		{
+			data[length++] = static_cast<unsigned char>(value | 0x80);
+			value >>= 7;
+		}
+		data[length++] = static_cast<unsigned char>(value);
+	}
+
+	//! Adds an integer field (negative numbers take ten bytes, as int64 fields do)
+	void PutField(int field, long long value)
+	{
+		PutVarint(static_cast<uint64_t>(field) << 3);
+		PutVarint(static_cast<uint64_t>(value));
+	}
+
+	//! Adds a repeated integer field in packed form
+	void PutPacked(int field, const long long *values, int count)
+	{
+		size_t size = 0;
+		for(int i = 0; i < count; i++)
+		{
+			uint64_t value = static_cast<uint64_t>(values[i]);
+			do
+			{
+				size++;
+				value >>= 7;
+			} while(value);
+		}
+		PutVarint(static_cast<uint64_t>(field) << 3 | 2);
+		PutVarint(size);
+		for(int i = 0; i < count; i++)
+		{
+			PutVarint(static_cast<uint64_t>(values[i]));
+		}
+	}
+
+	void PutMessage(int field, const ProtoMessage &message)
+	{
+		PutVarint(static_cast<uint64_t>(field) << 3 | 2);
+		PutVarint(message.length);
+		assert(length + message.length <= sizeof(data));
+		memcpy(data + length, message.data, message.length);
+		length += message.length;
+	}
+};
+
+/** @class PprofWriter
+Streams the fields of a pprof Profile message (see profile.proto in the pprof sources) to a file.  Protobuf fields can
+come in any order, so strings, functions, locations, and samples are written as soon as they are known, and only the
+number of strings written so far is kept.
+*/
+class PprofWriter
+{
+public:
+
+	explicit PprofWriter(FILE *file) : out(file), stringCount(0)
+	{}
+
+	//! Adds an entry to the string table; returns its index
+	long long AddString(const char *text)
+	{
+		size_t length = strlen(text);
+		ProtoMessage header;
+		header.PutVarint(6 << 3 | 2);
+		header.PutVarint(length);
+		out.Write(reinterpret_cast<const char*>(header.data), header.length);
+		out.Write(text, length);
+		return stringCount++;
+	}
+
+	void AddField(int field, long long value)
+	{
+		ProtoMessage header;
+		header.PutField(field, value);
+		out.Write(reinterpret_cast<const char*>(header.data), header.length);
+	}
+
+	void AddMessage(int field, const ProtoMessage &message)
+	{
+		ProtoMessage header;
+		header.PutVarint(static_cast<uint64_t>(field) << 3 | 2);
+		header.PutVarint(message.length);
+		out.Write(reinterpret_cast<const char*>(header.data), header.length);
+		out.Write(reinterpret_cast<const char*>(message.data), message.length);
+	}
+
+	void AddValueType(long long type, long long unit)
+	{
+		ProtoMessage valueType;
+		valueType.PutField(1, type);
+		valueType.PutField(2, unit);
+		AddMessage(1, valueType);
+	}
+
+	void AddFunction(long long id, long long name, long long fileName, long long startLine)
+	{
+		ProtoMessage function;
+		function.PutField(1, id);
+		function.PutField(2, name);
+		function.PutField(3, name);
+		function.PutField(4, fileName);
+		function.PutField(5, startLine);
+		AddMessage(5, function);
+	}
+
+	//! Adds a location with one line (address may be 0 if the location isn't code)
+	void AddLocation(long long id, uintptr_t address, long long functionId, long long line)
+	{
+		ProtoMessage lineInfo;
+		lineInfo.PutField(1, functionId);
+		lineInfo.PutField(2, line);
+		ProtoMessage location;
+		location.PutField(1, id);
+		if(address)
+		{
+			location.PutField(3, static_cast<long long>(address));
+		}
+		location.PutMessage(4, lineInfo);
+		AddMessage(4, location);
+	}
+
+	//! Adds a sample; the locations go from the innermost frame out
+	void AddSample(const long long *locations, int locationCount, const long long *values, int valueCount)
+	{
+		ProtoMessage sample;
+		sample.PutPacked(1, locations, locationCount);
+		sample.PutPacked(2, values, valueCount);
+		AddMessage(2, sample);
+	}
+
+private:
+
+	TraceWriter out;
+	long long stringCount;
+
+	PprofWriter(const PprofWriter&);
+	PprofWriter& operator=(const PprofWriter&);
+};
+
+bool MemoryTracer::ExportPprof(const char *fileName, ProfileKey key)
+{
+	FILE *file = fopen(fileName, "wb");
+	if(!file)
+	{
+		return false;
+	}
+	lock_guard<recursive_mutex> guard(tracerLock);
+	{
+		PprofWriter profile(file);
+		// the first string has to be the empty string
+		profile.AddString("");
+		long long count = profile.AddString("count");
+		long long bytes = profile.AddString("bytes");
+		profile.AddValueType(profile.AddString("alloc_objects"), count);
+		profile.AddValueType(profile.AddString("alloc_space"), bytes);
+		profile.AddValueType(profile.AddString("inuse_objects"), count);
+		long long inuseSpace = profile.AddString("inuse_space");
+		profile.AddValueType(inuseSpace, bytes);
+		profile.AddField(14, inuseSpace);
+
+		auto valuesOf = [](const ProfileTotals &totals, long long values[4])
+		{
+			values[0] = totals.allocatedBlocks;
+			values[1] = static_cast<long long>(totals.allocatedBytes);
+			values[2] = totals.liveBlocks;
+			values[3] = static_cast<long long>(totals.liveBytes);
+		};
+		long long values[4];
+		if(key == PROFILE_BY_SITE)
+		{
+			// every site and type is a function with one location; site n has ID 2n + 1 and type n has ID 2n + 2
+			KeyMap fileStrings;
+			for(size_t id = 0; id <= siteCount; id++)
+			{
+				const char *siteFile = SiteFile(static_cast<uint32_t>(id));
+				int line = SiteLine(static_cast<uint32_t>(id));
+				long long *knownFile = fileStrings.Find(reinterpret_cast<uintptr_t>(siteFile), 0);
+				long long fileString = knownFile ? *knownFile : profile.AddString(siteFile);
+				if(!knownFile)
+				{
+					// if this fails, the name is just written again for the next site in the file
+					fileStrings.FindOrAdd(reinterpret_cast<uintptr_t>(siteFile), 0, fileString);
+				}
+				char name[512];
+				snprintf(name, sizeof(name), "%s:%d", siteFile, line);
+				profile.AddFunction(2 * id + 1, profile.AddString(name), fileString, line);
+				profile.AddLocation(2 * id + 1, 0, 2 * id + 1, line);
+			}
+			for(size_t id = 0; id <= typeCount; id++)
+			{
+				profile.AddFunction(2 * id + 2, profile.AddString(TypeName(static_cast<uint32_t>(id))), 0, 0);
+				profile.AddLocation(2 * id + 2, 0, 2 * id + 2, 0);
+			}
+			for(size_t i = 0; i < profileSiteCount; i++)
+			{
+				const ProfileSite &entry = profileSites[i];
+				if(entry.totals.allocatedBlocks)
+				{
+					long long locations[2] = { 2ll * entry.typeId + 2, 2ll * entry.siteId + 1 };
+					valuesOf(entry.totals, values);
+					profile.AddSample(locations, 2, values, 4);
+				}
+			}
+		}
+		else
+		{
+			// every return address is a function with one location, numbered in the order they are first seen
+			KeyMap locationIds;
+			long long nextId = 1;
+			for(size_t i = 1; i < profileStackCount; i++)
+			{
+				const ProfileStack &stack = profileStacks[i];
+				if(!stack.totals.allocatedBlocks)
+				{
+					continue;
+				}
+				long long locations[MEMORYTRACER_PROFILE_STACK_DEPTH];
+				for(int f = 0; f < stack.frameCount; f++)
+				{
+					uintptr_t address = reinterpret_cast<uintptr_t>(stack.frames[f]);
+					long long *knownId = locationIds.Find(address, 0);
+					if(knownId)
+					{
+						locations[f] = *knownId;
+						continue;
+					}
+					char *demangled;
+					const char *symbol = FindSymbolName(stack.frames[f], demangled);
+					char hex[2 + sizeof(void*) * 2 + 1];
+					if(!symbol)
+					{
+						snprintf(hex, sizeof(hex), "0x%llx", static_cast<unsigned long long>(address));
+						symbol = hex;
+					}
+					long long id = nextId++;
+					profile.AddFunction(id, profile.AddString(symbol), 0, 0);
+					profile.AddLocation(id, address, id, 0);
+					free(demangled);
+					// if this fails, the address just gets another location the next time it is seen
+					locationIds.FindOrAdd(address, 0, id);
+					locations[f] = id;
+				}
+				valuesOf(stack.totals, values);
+				profile.AddSample(locations, stack.frameCount, values, 4);
+			}
+		}
+	}
+	bool ok = !ferror(file);
+	return fclose(file) == 0 && ok;
+}
@@ -0,0 +1,135 @@
+#ifndef _WIN32
+
+#include "MemoryTracer.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using namespace std;
+
+
+// Write end is used by the signal handler (and RequestHeapSnapshot) to wake up the snapshot thread
+static int snapshotPipe[2] = { -1, -1 };
+// File name prefix for snapshots; each one is named <prefix>.<pid>.<number>.dump
+static const char *snapshotPrefix = nullptr;
+
+// Only async-signal-safe calls are allowed here, so all the real work is handed off to the snapshot thread
+static void SnapshotSignalHandler(int)
+{
+	int savedErrno = errno;
+	char request = 1;
+	ssize_t written = write(snapshotPipe[1], &request, 1);
+	(void)written;
+	errno = savedErrno;
+}
+
+// Waits for snapshot requests and services them one at a time, away from the program's own threads
+static void* SnapshotThread(void *tracer)
+{
+	unsigned int snapshotNumber = 0;
+	for(;;)
+	{
+		char request;
+		ssize_t result = read(snapshotPipe[0], &request, 1);
+		if(result < 0 && errno == EINTR)
+		{
+			continue;
+		}
+		if(result <= 0)
+		{
+			return nullptr;
+		}
+
+		char fileName[1024];
+		snprintf(fileName, sizeof(fileName), "%s.%d.%u.dump", snapshotPrefix, static_cast<int>(getpid()),
+			snapshotNumber++);
+		static_cast<MemoryTracer*>(tracer)->WriteHeapSnapshot(fileName);
+	}
+}
+
+bool MemoryTracer::EnableHeapSnapshots(const char *filePrefix, int signalNumber)
+{
+	lock_guard<recursive_mutex> guard(tracerLock);
+	if(snapshotPipe[0] != -1)
+	{
+		snapshotPrefix = filePrefix;
+		return true;
+	}
+	if(pipe(snapshotPipe) != 0)
+	{
+		return false;
+	}
+	snapshotPrefix = filePrefix;
+
+	// a raw thread rather than std::thread, since this can run from inside the very first operator new call (when
+	// enabled from the environment) and must not allocate through the tracer
+	pthread_t thread;
+	if(pthread_create(&thread, nullptr, SnapshotThread, this) != 0)
+	{
+		close(snapshotPipe[0]);
+		close(snapshotPipe[1]);
+		snapshotPipe[0] = snapshotPipe[1] = -1;
+		return false;
+	}
+	pthread_detach(thread);
+
+	if(signalNumber)
+	{
+		struct sigaction action;
+		action.sa_handler = SnapshotSignalHandler;
+		sigemptyset(&action.sa_mask);
+		action.sa_flags = SA_RESTART;
+		sigaction(signalNumber, &action, nullptr);
+	}
+	return true;
+}
+
+void MemoryTracer::RequestHeapSnapshot()
+{
+	if(snapshotPipe[1] != -1)
+	{
+		SnapshotSignalHandler(0);
+	}
+}
+
+bool MemoryTracer::WriteHeapSnapshot(const char *fileName)
+{
+	pid_t child;
+	{
+		// holding the lock across fork() guarantees the child's copy of the lists isn't in the middle of an update; the
+		// program's threads are only held up for as long as fork() takes to copy the page tables
+		lock_guard<recursive_mutex> guard(tracerLock);
+		child = fork();
+		if(child == 0)
+		{
+			// the child is a single-threaded copy-on-write image of the heap taken while the lock was held, so the dump
+			// sees exactly the state at the time of the fork; the lock itself can't be used here, since its owner is
+			// recorded by thread id and the child's thread has a new one
+			_exit(DumpHeap(fileName) ? 0 : 1);
+		}
+		if(child > 0)
+		{
+			// the child reads the records which were spilled to a file from the file itself
+			runningSnapshots++;
+		}
+	}
+	if(child < 0)
+	{
+		return false;
+	}
+
+	int status;
+	pid_t waited;
+	while((waited = waitpid(child, &status, 0)) < 0 && errno == EINTR)
+	{
+	}
+	lock_guard<recursive_mutex> guard(tracerLock);
+	runningSnapshots--;
+	return waited == child && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+#endif
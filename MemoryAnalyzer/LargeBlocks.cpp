@@ -0,0 +1,232 @@
+#include "MemoryTracer.h"
+
+#include <algorithm>
+#include <stdint.h>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+
+#ifndef _WIN32
+
+// Size of the huge pages large blocks are aligned to when largeBlockHugePages is set (x86-64, and ARM64 with 4 KB base
+// pages)
+static const size_t hugePageSize = 2 << 20;
+
+static size_t PageSize()
+{
+	return static_cast<size_t>(sysconf(_SC_PAGESIZE));
+}
+
+// Maps anonymous memory of the given size, aligned to the given multiple of the page size; returns nullptr on failure
+static void* MapPages(size_t size, size_t alignment)
+{
+	// mmap only promises page alignment, so more is mapped and the ends outside the aligned range are unmapped again
+	size_t extra = alignment - PageSize();
+	if(size > SIZE_MAX - extra)
+	{
+		return nullptr;
+	}
+	void *mapped = mmap(nullptr, size + extra, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(mapped == MAP_FAILED)
+	{
+		return nullptr;
+	}
+	uintptr_t begin = reinterpret_cast<uintptr_t>(mapped);
+	uintptr_t aligned = (begin + alignment - 1) / alignment * alignment;
+	if(aligned > begin)
+	{
+		munmap(mapped, aligned - begin);
+	}
+	if(begin + extra > aligned)
+	{
+		munmap(reinterpret_cast<void*>(aligned + size), begin + extra - aligned);
+	}
+	return reinterpret_cast<void*>(aligned);
+}
+
+// Returns how many bytes of a mapping are resident in memory, or -1 if it can't be told
+static long long ResidentBytes(void *address, size_t size)
+{
+#ifdef __linux__
+	size_t pageSize = PageSize();
+	// one byte per page, a window at a time, so a huge block doesn't need a huge vector
+	unsigned char pages[4096];
+	long long residentPages = 0;
+	for(size_t offset = 0; offset < size; offset += sizeof(pages) * pageSize)
+	{
+		size_t length = min(size - offset, sizeof(pages) * pageSize);
+		if(mincore(static_cast<char*>(address) + offset, length, pages) != 0)
+		{
+			return -1;
+		}
+		for(size_t page = 0; page < (length + pageSize - 1) / pageSize; page++)
+		{
+			residentPages += pages[page] & 1;
+		}
+	}
+	return residentPages * static_cast<long long>(pageSize);
+#else
+	(void)address;
+	(void)size;
+	return -1;
+#endif
+}
+
+void* MemoryTracer::AllocateLarge(size_t size, AllocationType type, bool throwEx)
+{
+	size_t pageSize = PageSize();
+	size_t mappedSize = size <= SIZE_MAX - pageSize ? (size + pageSize - 1) / pageSize * pageSize : 0;
+	bool hugePages = false;
+#ifdef __linux__
+	// huge pages can only back the parts of a mapping which are aligned to them
+	hugePages = largeBlockHugePages && mappedSize >= hugePageSize;
+#endif
+	void *block = mappedSize ? MapPages(mappedSize, hugePages ? hugePageSize : pageSize) : nullptr;
+	if(block)
+	{
+#ifdef __linux__
+		// if the kernel doesn't support them, the block simply keeps normal pages
+		if(hugePages)
+		{
+			madvise(block, mappedSize, MADV_HUGEPAGE);
+		}
+#endif
+		LargeBlock entry;
+		entry.address = block;
+		entry.mappedSize = mappedSize;
+		entry.header.rawSize = size;
+		entry.header.type = type;
+		entry.header.backend = 0;
+		entry.header.grown = false;
+		entry.header.tracked = true;
+		entry.header.thread = 0;
+		entry.hugePages = hugePages;
+
+		{
+			lock_guard<recursive_mutex> guard(tracerLock);
+			// the entry's room is made before the block is recorded, and it is only filled in afterwards so that
+			// largeBlockLock isn't held while recording (which can end up freeing memory, e.g., in a no-alloc zone);
+			// other large allocations wait for tracerLock, and frees only shrink the table, so the room stays there
+			bool reserved;
+			{
+				lock_guard<mutex> blockGuard(largeBlockLock);
+				reserved = GrowArray(largeBlocks, largeBlockCapacity, largeBlockCount + 1);
+			}
+			if(reserved && RecordAllocation(block, &entry.header, false))
+			{
+				lock_guard<mutex> blockGuard(largeBlockLock);
+				largeBlocks[largeBlockCount++] = entry;
+				return block;
+			}
+		}
+		munmap(block, mappedSize);
+	}
+	if(throwEx)
+	{
+		throw std::bad_alloc();
+	}
+	return nullptr;
+}
+
+bool MemoryTracer::DeallocateLarge(void *ptr, AllocationType type, bool tracked)
+{
+	LargeBlock block;
+	{
+		lock_guard<mutex> blockGuard(largeBlockLock);
+		size_t i = 0;
+		while(i < largeBlockCount && largeBlocks[i].address != ptr)
+		{
+			i++;
+		}
+		if(i == largeBlockCount)
+		{
+			return false;
+		}
+		block = largeBlocks[i];
+		largeBlocks[i] = largeBlocks[--largeBlockCount];
+	}
+	// the range can't be handed out again before it is unmapped, so the record can be removed after the entry
+	if(tracked && block.header.tracked)
+	{
+		lock_guard<recursive_mutex> guard(tracerLock);
+		RecordDeallocation(ptr, type, &block.header, false);
+	}
+	// unmapping hundreds of megabytes takes a while, and nobody else can be using the range until it is done
+	munmap(block.address, block.mappedSize);
+	return true;
+}
+
+#endif
+
+void MemoryTracer::DisplayLargeBlocks()
+{
+	lock_guard<recursive_mutex> guard(tracerLock);
+	long long allocationsBefore = totalAllocations;
+	TraceWriter out(stdout);
+#ifndef _WIN32
+	lock_guard<mutex> blockGuard(largeBlockLock);
+	if(largeBlockCount)
+	{
+		// the table has no order of its own, so it is simply kept largest first
+		sort(largeBlocks, largeBlocks + largeBlockCount, [](const LargeBlock &a, const LargeBlock &b)
+		{
+			return a.header.rawSize > b.header.rawSize;
+		});
+
+		out << TraceWriter::Width(20) << "Address"
+			<< TraceWriter::Width(14) << "Size"
+			<< TraceWriter::Width(20) << "Resident"
+			<< TraceWriter::Width(8) << "Huge"
+			<< TraceWriter::Width(8) << "Thread"
+			<< "Type / File:Line\n"
+			<< "====================================================================================================";
+		size_t totalSize = 0;
+		long long totalResident = 0;
+		bool residencyKnown = true;
+		for(size_t i = 0; i < largeBlockCount; i++)
+		{
+			const LargeBlock &block = largeBlocks[i];
+			// the records are gone once the exit report has been written, leaving the block's type unknown
+			size_t row = liveRecords.Find(block.address);
+			uint32_t typeId = row != static_cast<size_t>(-1) ? liveRecords.TypeId(row) : 0;
+			uint32_t siteId = row != static_cast<size_t>(-1) ? liveRecords.SiteId(row) : 0;
+			long long resident = ResidentBytes(block.address, block.mappedSize);
+			char residentText[32];
+			if(resident >= 0)
+			{
+				snprintf(residentText, sizeof(residentText), "%lld (%d%%)", resident,
+					static_cast<int>(resident * 100 / static_cast<long long>(block.mappedSize)));
+				totalResident += resident;
+			}
+			else
+			{
+				snprintf(residentText, sizeof(residentText), "?");
+				residencyKnown = false;
+			}
+			totalSize += block.header.rawSize;
+			out << "\n" << TraceWriter::Width(20, '.') << static_cast<const void*>(block.address)
+				<< TraceWriter::Width(14, '.') << block.header.rawSize
+				<< TraceWriter::Width(20, '.') << residentText
+				<< TraceWriter::Width(8, '.') << (block.hugePages ? "yes" : "no")
+				<< TraceWriter::Width(8, '.') << static_cast<unsigned int>(block.header.thread)
+				<< TypeName(typeId) << "  " << SiteFile(siteId) << ":" << SiteLine(siteId);
+		}
+		out << "\n" << largeBlockCount << " large block(s), " << totalSize << " bytes";
+		if(residencyKnown)
+		{
+			out << ", " << totalResident << " bytes resident";
+		}
+		out << "\n\n";
+	}
+	else
+#endif
+	{
+		out << "No large blocks are allocated\n\n";
+	}
+	assert(totalAllocations == allocationsBefore);
+}
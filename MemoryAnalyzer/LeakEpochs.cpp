@@ -0,0 +1,124 @@
+#include "MemoryTracer.h"
+
+#include <algorithm>
+
+using namespace std;
+
+
+void MemoryTracer::LogEpochAllocation(size_t row, uint16_t thread)
+{
+	if(epochLogCount == epochLogCapacity)
+	{
+		// drop the entries of blocks which have been freed (or whose address now belongs to a newer block), keeping
+		// the rest in allocation order
+		size_t kept = 0;
+		for(size_t i = 0; i < epochLogCount; i++)
+		{
+			size_t liveRow = liveRecords.Find(epochLog[i].address);
+			if(liveRow != static_cast<size_t>(-1)
+				&& liveRecords.AllocationNumber(liveRow) == epochLog[i].allocationNumber)
+			{
+				epochLog[kept++] = epochLog[i];
+			}
+		}
+		epochLogCount = kept;
+		// grow if less than half was dropped, so compacting takes constant time per allocation on average
+		if(epochLogCount * 2 >= epochLogCapacity)
+		{
+			GrowArray(epochLog, epochLogCapacity, epochLogCapacity + 1);
+		}
+		// if memory ran out, the block is left out of the open epochs
+		if(epochLogCount == epochLogCapacity)
+		{
+			return;
+		}
+	}
+	EpochEntry &entry = epochLog[epochLogCount++];
+	entry.address = liveRecords.Address(row);
+	entry.allocationNumber = liveRecords.AllocationNumber(row);
+	entry.thread = thread;
+}
+
+MemoryTracer::LeakEpoch MemoryTracer::BeginLeakEpoch(bool currentThreadOnly)
+{
+	lock_guard<recursive_mutex> guard(tracerLock);
+	LeakEpoch epoch;
+	epoch.firstAllocation = totalAllocations + 1;
+	// if the thread has no number, its blocks can't be told apart, so the epoch covers every thread
+	epoch.thread = currentThreadOnly ? CurrentThreadNumber() : 0;
+	openEpochs++;
+	return epoch;
+}
+
+long long MemoryTracer::EndLeakEpoch(const LeakEpoch &epoch, bool displayLeaks)
+{
+	lock_guard<recursive_mutex> guard(tracerLock);
+	assert(openEpochs);
+	if(!openEpochs)
+	{
+		return 0;
+	}
+	long long allocationsBefore = totalAllocations;
+
+	// the log is in allocation order, so the epoch's entries are the ones from its first allocation on
+	EpochEntry *begin = lower_bound(epochLog, epochLog + epochLogCount, epoch.firstAllocation,
+		[](const EpochEntry &entry, uint64_t allocationNumber)
+	{
+		return entry.allocationNumber < allocationNumber;
+	});
+	EpochEntry *end = epochLog + epochLogCount;
+	// returns the entry's row if it belongs to the epoch and its block is still allocated
+	auto leakedRow = [&](const EpochEntry &entry) -> size_t
+	{
+		if(epoch.thread && entry.thread != epoch.thread)
+		{
+			return static_cast<size_t>(-1);
+		}
+		size_t row = liveRecords.Find(entry.address);
+		if(row != static_cast<size_t>(-1) && liveRecords.AllocationNumber(row) != entry.allocationNumber)
+		{
+			return static_cast<size_t>(-1);
+		}
+		return row;
+	};
+
+	long long blocks = 0;
+	size_t bytes = 0;
+	for(EpochEntry *entry = begin; entry != end; entry++)
+	{
+		size_t row = leakedRow(*entry);
+		if(row != static_cast<size_t>(-1))
+		{
+			blocks++;
+			bytes += liveRecords.Size(row);
+		}
+	}
+
+	if(displayLeaks)
+	{
+		TraceWriter out(stdout);
+		out << "Leak epoch (allocations " << epoch.firstAllocation << " to " << totalAllocations << "): " << blocks
+			<< " block(s) still allocated (" << bytes << " bytes)";
+		for(EpochEntry *entry = begin; entry != end; entry++)
+		{
+			size_t row = leakedRow(*entry);
+			if(row != static_cast<size_t>(-1))
+			{
+				uint32_t siteId = liveRecords.SiteId(row);
+				out << "\n\tAllocation " << entry->allocationNumber << ": " << liveRecords.Size(row) << " bytes ("
+					<< GetAllocTypeAsString(static_cast<AllocationType>(liveRecords.AllocType(row))) << ")  Type: "
+					<< TypeName(liveRecords.TypeId(row)) << "  File: " << SiteFile(siteId) << "  Line: "
+					<< SiteLine(siteId) << "  Address: " << static_cast<const void*>(entry->address);
+			}
+		}
+		out << "\n\n";
+	}
+
+	// once no epoch is open, nothing needs the log any more
+	if(--openEpochs == 0)
+	{
+		epochLogCount = 0;
+	}
+	assert(totalAllocations == allocationsBefore);
+	return blocks;
+}
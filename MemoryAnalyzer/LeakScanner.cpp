@@ -0,0 +1,548 @@
+#ifdef __linux__
+
+#include "MemoryTracer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <link.h>
+#include <pthread.h>
+#include <new>
+#include <setjmp.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+using namespace std;
+
+
+// Reachability states of a block during a scan
+enum ScanState
+{
+	SCAN_UNREACHED,		// not (yet) found from any root
+	SCAN_REACHABLE,		// found from a root, directly or through other reachable blocks
+	SCAN_INDIRECT		// not reachable, but pointed to by another unreachable block
+};
+
+/** @struct RootRegion
+Memory range scanned for pointers at the start of a reachability scan.
+*/
+struct RootRegion
+{
+	uintptr_t begin;
+	uintptr_t end;
+};
+
+/** @struct RootRegionList
+Growable array of root regions (allocated with malloc so it never shows up in the tracer's own lists).
+*/
+struct RootRegionList
+{
+	RootRegion *regions;
+	size_t count;
+	size_t capacity;
+
+	bool Add(uintptr_t begin, uintptr_t end)
+	{
+		if(count == capacity)
+		{
+			size_t newCapacity = capacity ? capacity * 2 : 16;
+			RootRegion *newRegions = static_cast<RootRegion*>(realloc(regions, newCapacity * sizeof(RootRegion)));
+			if(!newRegions)
+			{
+				return false;
+			}
+			regions = newRegions;
+			capacity = newCapacity;
+		}
+		regions[count].begin = begin;
+		regions[count].end = end;
+		count++;
+		return true;
+	}
+};
+
+/** @struct ScanWorkQueue
+Per-worker stack of block indices waiting to be scanned.  The owner pushes and pops at the back; idle workers steal
+half of the items from the front.
+*/
+struct ScanWorkQueue
+{
+	mutex lock;
+	size_t *items;
+	size_t head;
+	size_t tail;
+	size_t capacity;
+};
+
+/** @struct ScanContext
+Everything shared by the scan workers.  The blocks are sorted by address so that a candidate pointer can be checked
+for membership with a binary search over the (dense) start address array.
+*/
+struct ScanContext
+{
+	//! Block start addresses, sorted
+	uintptr_t *starts;
+	//! Block sizes, in the same order as starts
+	size_t *sizes;
+	atomic<unsigned char> *states;
+	size_t blockCount;
+	uintptr_t lowest;
+	uintptr_t highest;
+
+	ScanWorkQueue *queues;
+	unsigned int workerCount;
+	//! Number of blocks which have been queued but not yet scanned; the mark phase is over when it reaches zero
+	atomic<size_t> pending;
+	//! Set if a queue couldn't grow, which leaves some reachable blocks unscanned and so the results unusable
+	atomic<bool> outOfMemory;
+};
+
+/** @struct ScanWorker
+Argument for one scan thread.
+*/
+struct ScanWorker
+{
+	ScanContext *context;
+	unsigned int index;
+	//! Range of blocks handled by this worker in the indirect-leak pass
+	size_t firstBlock;
+	size_t lastBlock;
+};
+
+// User-registered root regions (e.g., stacks of other threads)
+static RootRegionList userRoots = { nullptr, 0, 0 };
+
+// Returns the index of the block containing address, or -1 if it isn't inside a tracked block
+static size_t FindBlock(const ScanContext &context, uintptr_t address)
+{
+	if(address < context.lowest || address >= context.highest)
+	{
+		return static_cast<size_t>(-1);
+	}
+	const uintptr_t *after = upper_bound(context.starts, context.starts + context.blockCount, address);
+	if(after == context.starts)
+	{
+		return static_cast<size_t>(-1);
+	}
+	size_t index = after - context.starts - 1;
+	// interior pointers count as references, like they do for any conservative collector
+	return address < context.starts[index] + context.sizes[index] ? index : static_cast<size_t>(-1);
+}
+
+// Queues a block for scanning; if memory runs out, the block is dropped and the scan marked as failed
+static void PushWork(ScanContext &context, ScanWorkQueue &queue, size_t block)
+{
+	lock_guard<mutex> guard(queue.lock);
+	if(queue.tail == queue.capacity)
+	{
+		// reclaim the space at the front left by thieves before growing
+		if(queue.head > 0)
+		{
+			memmove(queue.items, queue.items + queue.head, (queue.tail - queue.head) * sizeof(size_t));
+			queue.tail -= queue.head;
+			queue.head = 0;
+		}
+		if(queue.tail == queue.capacity)
+		{
+			size_t newCapacity = queue.capacity ? queue.capacity * 2 : 1024;
+			size_t *newItems = static_cast<size_t*>(realloc(queue.items, newCapacity * sizeof(size_t)));
+			if(!newItems)
+			{
+				context.outOfMemory = true;
+				context.pending--;
+				return;
+			}
+			queue.items = newItems;
+			queue.capacity = newCapacity;
+		}
+	}
+	queue.items[queue.tail++] = block;
+}
+
+static bool PopWork(ScanWorkQueue &queue, size_t &block)
+{
+	lock_guard<mutex> guard(queue.lock);
+	if(queue.head == queue.tail)
+	{
+		return false;
+	}
+	block = queue.items[--queue.tail];
+	return true;
+}
+
+// Moves half of a victim's items into the thief's queue; returns false if the victim had nothing to spare
+static bool StealWork(ScanContext &context, ScanWorkQueue &victim, ScanWorkQueue &thief)
+{
+	size_t stolen[256];
+	size_t count;
+	{
+		lock_guard<mutex> guard(victim.lock);
+		size_t available = victim.tail - victim.head;
+		count = min<size_t>((available + 1) / 2, sizeof(stolen) / sizeof(stolen[0]));
+		memcpy(stolen, victim.items + victim.head, count * sizeof(size_t));
+		victim.head += count;
+	}
+	for(size_t i = 0; i < count; i++)
+	{
+		PushWork(context, thief, stolen[i]);
+	}
+	return count > 0;
+}
+
+// Marks every unreached block referenced from [begin, end) as reachable and queues it for scanning
+static void MarkRange(ScanContext &context, ScanWorkQueue &queue, uintptr_t begin, uintptr_t end)
+{
+	begin = (begin + sizeof(uintptr_t) - 1) & ~(sizeof(uintptr_t) - 1);
+	for(const uintptr_t *word = reinterpret_cast<const uintptr_t*>(begin);
+		reinterpret_cast<uintptr_t>(word) + sizeof(uintptr_t) <= end; word++)
+	{
+		size_t block = FindBlock(context, *word);
+		if(block == static_cast<size_t>(-1))
+		{
+			continue;
+		}
+		unsigned char expected = SCAN_UNREACHED;
+		if(context.states[block].compare_exchange_strong(expected, SCAN_REACHABLE))
+		{
+			context.pending++;
+			PushWork(context, queue, block);
+		}
+	}
+}
+
+static void* MarkWorker(void *arg)
+{
+	ScanWorker &worker = *static_cast<ScanWorker*>(arg);
+	ScanContext &context = *worker.context;
+	ScanWorkQueue &queue = context.queues[worker.index];
+
+	while(context.pending > 0)
+	{
+		size_t block;
+		if(PopWork(queue, block))
+		{
+			MarkRange(context, queue, context.starts[block], context.starts[block] + context.sizes[block]);
+			context.pending--;
+			continue;
+		}
+		// out of local work, so try to steal from the others, starting with the next worker over
+		bool stole = false;
+		for(unsigned int i = 1; i < context.workerCount && !stole; i++)
+		{
+			stole = StealWork(context, context.queues[(worker.index + i) % context.workerCount], queue);
+		}
+		if(!stole)
+		{
+			sched_yield();
+		}
+	}
+	return nullptr;
+}
+
+static void* IndirectWorker(void *arg)
+{
+	ScanWorker &worker = *static_cast<ScanWorker*>(arg);
+	ScanContext &context = *worker.context;
+
+	// every block referenced by an unreachable block (other than itself) is only lost because its referrer is
+	for(size_t block = worker.firstBlock; block < worker.lastBlock; block++)
+	{
+		if(context.states[block] == SCAN_REACHABLE)
+		{
+			continue;
+		}
+		const uintptr_t *word = reinterpret_cast<const uintptr_t*>(context.starts[block]);
+		for(size_t i = 0; i < context.sizes[block] / sizeof(uintptr_t); i++)
+		{
+			size_t target = FindBlock(context, word[i]);
+			if(target != static_cast<size_t>(-1) && target != block)
+			{
+				unsigned char expected = SCAN_UNREACHED;
+				context.states[target].compare_exchange_strong(expected, SCAN_INDIRECT);
+			}
+		}
+	}
+	return nullptr;
+}
+
+// Runs the given worker function on workerCount threads (the calling thread being one of them)
+static void RunWorkers(ScanContext &context, ScanWorker *workers, void* (*function)(void*))
+{
+	// raw threads, since std::thread would allocate (and free, from the worker) through the tracer, whose lock is held
+	pthread_t *threads = static_cast<pthread_t*>(malloc(context.workerCount * sizeof(pthread_t)));
+	bool *started = static_cast<bool*>(malloc(context.workerCount * sizeof(bool)));
+	for(unsigned int i = 1; i < context.workerCount; i++)
+	{
+		started[i] = pthread_create(&threads[i], nullptr, function, &workers[i]) == 0;
+	}
+	function(&workers[0]);
+	for(unsigned int i = 1; i < context.workerCount; i++)
+	{
+		if(started[i])
+		{
+			pthread_join(threads[i], nullptr);
+		}
+		else
+		{
+			// couldn't get a thread, so do its share here
+			function(&workers[i]);
+		}
+	}
+	free(threads);
+	free(started);
+}
+
+// dl_iterate_phdr callback which adds the writable segments (data and bss) of every loaded module to the roots
+static int AddModuleRoots(struct dl_phdr_info *info, size_t, void *roots)
+{
+	for(int i = 0; i < info->dlpi_phnum; i++)
+	{
+		const ElfW(Phdr) &segment = info->dlpi_phdr[i];
+		if(segment.p_type == PT_LOAD && (segment.p_flags & PF_W))
+		{
+			uintptr_t begin = info->dlpi_addr + segment.p_vaddr;
+			static_cast<RootRegionList*>(roots)->Add(begin, begin + segment.p_memsz);
+		}
+	}
+	return 0;
+}
+
+// Returns where the mapped part of a stack which grows down to begin from end starts.  The main thread's stack is
+// reported at its full size limit, while only the pages it has used so far are mapped.
+static uintptr_t MappedStackBegin(uintptr_t begin, uintptr_t end)
+{
+	uintptr_t pageSize = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+	begin &= ~(pageSize - 1);
+	// mincore fails for a range with unmapped pages in it, so one call settles the usual case of a stack which is
+	// mapped in full
+	unsigned char *resident = static_cast<unsigned char*>(malloc((end - begin + pageSize - 1) / pageSize));
+	bool mapped = resident && mincore(reinterpret_cast<void*>(begin), end - begin, resident) == 0;
+	free(resident);
+	if(mapped)
+	{
+		return begin;
+	}
+	uintptr_t page = (end - 1) & ~(pageSize - 1);
+	unsigned char pageResident;
+	while(page > begin && mincore(reinterpret_cast<void*>(page - pageSize), pageSize, &pageResident) == 0)
+	{
+		page -= pageSize;
+	}
+	return max(page, begin);
+}
+
+void MemoryTracer::AddRootRegion(const void *begin, size_t size)
+{
+	lock_guard<recursive_mutex> guard(tracerLock);
+	userRoots.Add(reinterpret_cast<uintptr_t>(begin), reinterpret_cast<uintptr_t>(begin) + size);
+}
+
+void MemoryTracer::RemoveRootRegion(const void *begin)
+{
+	lock_guard<recursive_mutex> guard(tracerLock);
+	for(size_t i = 0; i < userRoots.count; i++)
+	{
+		if(userRoots.regions[i].begin == reinterpret_cast<uintptr_t>(begin))
+		{
+			userRoots.regions[i] = userRoots.regions[--userRoots.count];
+			return;
+		}
+	}
+}
+
+MemoryTracer::LeakScanSummary MemoryTracer::ScanForLeaks(bool displayLeaks)
+{
+	lock_guard<recursive_mutex> guard(tracerLock);
+	LeakScanSummary summary = {};
+	summary.completed = true;
+
+	// spill the registers onto the stack so pointers which only live in registers are seen as well
+	jmp_buf registers;
+	setjmp(registers);
+
+	ScanContext context;
+	context.blockCount = liveRecords.count;
+	if(context.blockCount == 0)
+	{
+		return summary;
+	}
+
+	// build the address index: blocks sorted by start address, with the columns the scan needs kept separate
+	uint32_t *rows = static_cast<uint32_t*>(malloc(context.blockCount * sizeof(uint32_t)));
+	context.starts = static_cast<uintptr_t*>(malloc(context.blockCount * sizeof(uintptr_t)));
+	context.sizes = static_cast<size_t*>(malloc(context.blockCount * sizeof(size_t)));
+	context.states = static_cast<atomic<unsigned char>*>(malloc(context.blockCount * sizeof(atomic<unsigned char>)));
+	if(!rows || !context.starts || !context.sizes || !context.states)
+	{
+		free(rows);
+		free(context.starts);
+		free(context.sizes);
+		free(context.states);
+		summary.completed = false;
+		return summary;
+	}
+	size_t block;
+	for(block = 0; block < context.blockCount; block++)
+	{
+		rows[block] = static_cast<uint32_t>(block);
+	}
+	const LiveRecordTable &records = liveRecords;
+	sort(rows, rows + context.blockCount, [&records](uint32_t a, uint32_t b)
+	{
+		return records.Address(a) < records.Address(b);
+	});
+	for(block = 0; block < context.blockCount; block++)
+	{
+		context.starts[block] = reinterpret_cast<uintptr_t>(records.Address(rows[block]));
+		context.sizes[block] = records.Size(rows[block]);
+		new(&context.states[block]) atomic<unsigned char>(SCAN_UNREACHED);
+	}
+	context.lowest = context.starts[0];
+	context.highest = context.starts[context.blockCount - 1] + context.sizes[context.blockCount - 1];
+
+	long processors = sysconf(_SC_NPROCESSORS_ONLN);
+	context.workerCount = static_cast<unsigned int>(min<size_t>(max<long>(processors, 1),
+		max<size_t>(context.blockCount / 4096, 1)));
+	context.queues = static_cast<ScanWorkQueue*>(malloc(context.workerCount * sizeof(ScanWorkQueue)));
+	ScanWorker *workers = static_cast<ScanWorker*>(malloc(context.workerCount * sizeof(ScanWorker)));
+	if(!context.queues || !workers)
+	{
+		free(context.queues);
+		free(workers);
+		free(rows);
+		free(context.starts);
+		free(context.sizes);
+		free(context.states);
+		summary.completed = false;
+		return summary;
+	}
+	size_t blocksPerWorker = (context.blockCount + context.workerCount - 1) / context.workerCount;
+	for(unsigned int i = 0; i < context.workerCount; i++)
+	{
+		ScanWorkQueue *queue = new(&context.queues[i]) ScanWorkQueue;
+		queue->items = nullptr;
+		queue->head = queue->tail = queue->capacity = 0;
+		workers[i].context = &context;
+		workers[i].index = i;
+		workers[i].firstBlock = min(context.blockCount, i * blocksPerWorker);
+		workers[i].lastBlock = min(context.blockCount, (i + 1) * blocksPerWorker);
+	}
+	context.pending = 0;
+	context.outOfMemory = false;
+
+	// gather the roots: data and bss of every module, this thread's stack (from the saved registers up), the stacks of
+	// the other threads the tracer knows of (all of each, since where they are up to isn't known), and anything the
+	// program registered
+	RootRegionList roots = { nullptr, 0, 0 };
+	dl_iterate_phdr(AddModuleRoots, &roots);
+	pthread_attr_t attributes;
+	if(pthread_getattr_np(pthread_self(), &attributes) == 0)
+	{
+		void *stackBase;
+		size_t stackSize;
+		pthread_attr_getstack(&attributes, &stackBase, &stackSize);
+		roots.Add(reinterpret_cast<uintptr_t>(&registers), reinterpret_cast<uintptr_t>(stackBase) + stackSize);
+		pthread_attr_destroy(&attributes);
+	}
+	for(size_t i = 1; i <= threadCount; i++)
+	{
+		const ThreadStats *thread = threadTable[i];
+		if(thread != currentThreadStats && thread->stackEnd)
+		{
+			roots.Add(MappedStackBegin(thread->stackBegin, thread->stackEnd), thread->stackEnd);
+		}
+	}
+	for(size_t i = 0; i < userRoots.count; i++)
+	{
+		roots.Add(userRoots.regions[i].begin, userRoots.regions[i].end);
+	}
+
+	// seed the queues round-robin so the workers start out with comparable amounts of work
+	for(size_t i = 0; i < roots.count; i++)
+	{
+		MarkRange(context, context.queues[i % context.workerCount], roots.regions[i].begin, roots.regions[i].end);
+	}
+	free(roots.regions);
+
+	RunWorkers(context, workers, MarkWorker);
+	// some reachable blocks weren't followed, so whatever they point to would be reported as lost
+	if(context.outOfMemory)
+	{
+		TraceWriter(stdout) << "Leak scan ran out of memory; no results\n\n";
+		summary.completed = false;
+	}
+	else
+	{
+		RunWorkers(context, workers, IndirectWorker);
+	}
+
+	for(block = 0; block < context.blockCount && summary.completed; block++)
+	{
+		switch(context.states[block].load())
+		{
+		case SCAN_REACHABLE:
+			summary.reachableBlocks++;
+			summary.reachableBytes += context.sizes[block];
+			break;
+		case SCAN_INDIRECT:
+			summary.indirectlyLostBlocks++;
+			summary.indirectlyLostBytes += context.sizes[block];
+			break;
+		default:
+			summary.definitelyLostBlocks++;
+			summary.definitelyLostBytes += context.sizes[block];
+			break;
+		}
+	}
+
+	if(displayLeaks && summary.completed)
+	{
+		auto displayClass = [&](TraceWriter &out, const char *title, ScanState state, long long blocks, size_t bytes)
+		{
+			out << title << ": " << blocks << " block(s), " << bytes << " bytes";
+			for(block = 0; block < context.blockCount; block++)
+			{
+				if(context.states[block] == state)
+				{
+					size_t row = rows[block];
+					uint32_t siteId = liveRecords.SiteId(row);
+					out << "\n\tAddress: " << liveRecords.Address(row) << " Size: " << context.sizes[block]
+						<< " File: " << SiteFile(siteId) << " Line: " << SiteLine(siteId) << " Type: "
+						<< TypeName(liveRecords.TypeId(row));
+				}
+			}
+			out << "\n\n";
+		};
+		auto displaySummary = [&](FILE *file)
+		{
+			TraceWriter out(file);
+			displayClass(out, "Definitely lost", SCAN_UNREACHED, summary.definitelyLostBlocks,
+				summary.definitelyLostBytes);
+			displayClass(out, "Indirectly lost", SCAN_INDIRECT, summary.indirectlyLostBlocks,
+				summary.indirectlyLostBytes);
+			out << "Still reachable: " << summary.reachableBlocks << " block(s), " << summary.reachableBytes
+				<< " bytes (not listed)\n\n";
+		};
+		displaySummary(stdout);
+		// the leak file is only open while the exit report is being written
+		if(dumpFile)
+		{
+			displaySummary(dumpFile);
+		}
+	}
+
+	for(unsigned int i = 0; i < context.workerCount; i++)
+	{
+		free(context.queues[i].items);
+		context.queues[i].~ScanWorkQueue();
+	}
+	free(context.queues);
+	free(workers);
+	free(rows);
+	free(context.starts);
+	free(context.sizes);
+	free(context.states);
+	return summary;
+}
+
+#endif
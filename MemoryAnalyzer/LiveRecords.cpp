@@ -0,0 +1,510 @@
+#include "LiveRecords.h"
+
+#include <assert.h>
+#include <cstring>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+
+// Number of 64-bit words of a dirty page bitmap covering the given number of records
+static size_t DirtyWords(size_t records, size_t pageRecords)
+{
+	return (records + pageRecords * 64 - 1) / (pageRecords * 64);
+}
+
+LiveRecordTable::LiveRecordTable()
+	: records(nullptr), capacity(0), index(nullptr), indexMask(0), latestAllocation(0), contexts(nullptr),
+	contextCount(0), contextCapacity(0), spillFile(-1), pageRecords(0), dirtyPages(nullptr), count(0)
+{}
+
+LiveRecordTable::~LiveRecordTable()
+{
+	Clear();
+}
+
+void LiveRecordTable::Clear()
+{
+#ifdef __linux__
+	if(spillFile >= 0)
+	{
+		munmap(records, capacity * sizeof(Record));
+		close(spillFile);
+		records = nullptr;
+		spillFile = -1;
+	}
+#endif
+	free(records);
+	free(index);
+	free(contexts);
+	free(dirtyPages);
+	records = nullptr;
+	index = nullptr;
+	indexMask = 0;
+	contexts = nullptr;
+	contextCount = contextCapacity = 0;
+	contextIds.Clear();
+	largeSizes.Clear();
+	dirtyPages = nullptr;
+	count = capacity = 0;
+	latestAllocation = 0;
+}
+
+bool LiveRecordTable::Reserve()
+{
+	// the index is kept at most five eighths full, which trades a little of the speed of a half-full one (mostly in
+	// Remove, which shifts probe sequences back) for a fifth less memory; probing only reads the index, not the records
+	size_t slots = index ? indexMask + 1 : 0;
+	if((count + 1) * 8 > slots * 5 && !RebuildIndex(slots ? slots * 2 : 2048))
+	{
+		return false;
+	}
+	if(count < capacity)
+	{
+		return true;
+	}
+	// context 0 (nothing known) is there before the first record which could refer to it
+	if(!contexts)
+	{
+		if(!GrowArray(contexts, contextCapacity, 1))
+		{
+			return false;
+		}
+		memset(contexts, 0, sizeof(Context));
+		contextCount = 1;
+	}
+
+	// growing by half rather than doubling keeps the unused rows at a third of the table at most; the capacity stays a
+	// multiple of 1024 rows, so the spill file's mapping ends on a page boundary
+	size_t newCapacity = (capacity + capacity / 2 + 1024) / 1024 * 1024;
+	if(spillFile < 0)
+	{
+		Record *newRecords = static_cast<Record*>(realloc(records, newCapacity * sizeof(Record)));
+		if(!newRecords)
+		{
+			return false;
+		}
+		records = newRecords;
+	}
+#ifdef __linux__
+	else
+	{
+		// the pages which only exist in memory move along with the mapping; the rest are read from the file
+		size_t words = DirtyWords(capacity, pageRecords), newWords = DirtyWords(newCapacity, pageRecords);
+		uint64_t *newDirtyPages = static_cast<uint64_t*>(realloc(dirtyPages, newWords * sizeof(uint64_t)));
+		if(!newDirtyPages)
+		{
+			return false;
+		}
+		dirtyPages = newDirtyPages;
+		memset(dirtyPages + words, 0, (newWords - words) * sizeof(uint64_t));
+		if(ftruncate(spillFile, static_cast<off_t>(newCapacity * sizeof(Record))) != 0)
+		{
+			return false;
+		}
+		void *newRecords = mremap(records, capacity * sizeof(Record), newCapacity * sizeof(Record), MREMAP_MAYMOVE);
+		if(newRecords == MAP_FAILED)
+		{
+			return false;
+		}
+		records = static_cast<Record*>(newRecords);
+	}
+#endif
+	capacity = newCapacity;
+	return true;
+}
+
+bool LiveRecordTable::RebuildIndex(size_t slots)
+{
+	uint64_t *newIndex = static_cast<uint64_t*>(calloc(slots, sizeof(uint64_t)));
+	if(!newIndex)
+	{
+		return false;
+	}
+	// the slots carry their hashes along, so spilled records aren't read back just to move them
+	for(size_t oldSlot = 0; index && oldSlot <= indexMask; oldSlot++)
+	{
+		if(index[oldSlot])
+		{
+			size_t slot = SlotHash(index[oldSlot]) & (slots - 1);
+			while(newIndex[slot])
+			{
+				slot = (slot + 1) & (slots - 1);
+			}
+			newIndex[slot] = index[oldSlot];
+		}
+	}
+	free(index);
+	index = newIndex;
+	indexMask = slots - 1;
+	return true;
+}
+
+size_t LiveRecordTable::LargeSize(size_t row) const
+{
+	long long *size = largeSizes.Find(reinterpret_cast<uintptr_t>(Address(row)), 0);
+	assert(size);
+	return size ? static_cast<size_t>(*size) : largeSize;
+}
+
+uint32_t LiveRecordTable::InternContext(uint32_t typeId, uint32_t siteId, uint32_t stackId)
+{
+	if(!typeId && !siteId && !stackId)
+	{
+		return 0;
+	}
+	// the key only has to spread the contexts out, since the ones it leads to are compared in full
+	uintptr_t key = static_cast<uintptr_t>(siteId) * 0x9E3779B1u ^ typeId;
+	long long *first = contextIds.Find(key, static_cast<int>(stackId));
+	for(uint32_t id = first ? static_cast<uint32_t>(*first) : 0; id; id = contexts[id].nextSameKey)
+	{
+		if(contexts[id].typeId == typeId && contexts[id].siteId == siteId && contexts[id].stackId == stackId)
+		{
+			return id;
+		}
+	}
+
+	uint32_t id = static_cast<uint32_t>(contextCount);
+	if(contextCount == maxContexts || !GrowArray(contexts, contextCapacity, contextCount + 1)
+		|| (!first && !(first = contextIds.FindOrAdd(key, static_cast<int>(stackId), 0))))
+	{
+		return static_cast<uint32_t>(-1);
+	}
+	contexts[id].typeId = typeId;
+	contexts[id].siteId = siteId;
+	contexts[id].stackId = stackId;
+	contexts[id].nextSameKey = static_cast<uint32_t>(*first);
+	*first = id;
+	contextCount++;
+	return id;
+}
+
+bool LiveRecordTable::SetDetails(size_t row, uint32_t typeId, uint32_t siteId)
+{
+	uint32_t id = InternContext(typeId, siteId, StackId(row));
+	if(id == static_cast<uint32_t>(-1))
+	{
+		return false;
+	}
+	SetContext(row, id);
+	return true;
+}
+
+bool LiveRecordTable::SetStackId(size_t row, uint32_t stackId)
+{
+	uint32_t id = InternContext(TypeId(row), SiteId(row), stackId);
+	if(id == static_cast<uint32_t>(-1))
+	{
+		return false;
+	}
+	SetContext(row, id);
+	return true;
+}
+
+size_t LiveRecordTable::Add(void *address, size_t size, unsigned char allocType, uint64_t allocationNumber)
+{
+	uint64_t addressBits = static_cast<uint64_t>(reinterpret_cast<uintptr_t>(address));
+	assert(!(addressBits & 7) && !(addressBits >> 48) && allocType < 4 && allocationNumber > latestAllocation);
+	if((addressBits & 7) || (addressBits >> 48) || !Reserve())
+	{
+		return static_cast<size_t>(-1);
+	}
+	if(size >= largeSize)
+	{
+		long long *largeEntry = largeSizes.FindOrAdd(static_cast<uintptr_t>(addressBits), 0, 0);
+		if(!largeEntry)
+		{
+			return static_cast<size_t>(-1);
+		}
+		*largeEntry = static_cast<long long>(size);
+		size = largeSize;
+	}
+	size_t row = count++;
+	records[row].block = addressBits >> 3 | static_cast<uint64_t>(allocType) << allocTypeShift
+		| static_cast<uint64_t>(size) << sizeShift;
+	records[row].origin = allocationNumber & numberMask;
+	latestAllocation = allocationNumber;
+	MarkDirty(row);
+
+	uint32_t hash = AddressHash(address);
+	size_t slot = hash & indexMask;
+	while(index[slot])
+	{
+		slot = (slot + 1) & indexMask;
+	}
+	index[slot] = static_cast<uint64_t>(hash) << 32 | (row + 1);
+	return row;
+}
+
+size_t LiveRecordTable::Find(const void *address) const
+{
+	if(!index)
+	{
+		return static_cast<size_t>(-1);
+	}
+	// only a slot with the same hash can be the address's, so other records are almost never read
+	uint32_t hash = AddressHash(address);
+	for(size_t slot = hash & indexMask; index[slot]; slot = (slot + 1) & indexMask)
+	{
+		if(SlotHash(index[slot]) == hash && Address(SlotRow(index[slot])) == address)
+		{
+			return SlotRow(index[slot]);
+		}
+	}
+	return static_cast<size_t>(-1);
+}
+
+size_t LiveRecordTable::SlotOf(size_t row) const
+{
+	size_t slot = AddressHash(Address(row)) & indexMask;
+	while(SlotRow(index[slot]) != row)
+	{
+		assert(index[slot]);
+		slot = (slot + 1) & indexMask;
+	}
+	return slot;
+}
+
+void LiveRecordTable::Remove(size_t row)
+{
+	assert(row < count);
+	if(records[row].block >> sizeShift == largeSize)
+	{
+		largeSizes.Remove(reinterpret_cast<uintptr_t>(Address(row)), 0);
+	}
+
+	// empty the row's slot, then shift later entries of the probe sequence back into the hole so lookups never stop
+	// early (linear probing without tombstones)
+	size_t hole = SlotOf(row);
+	index[hole] = 0;
+	for(size_t slot = (hole + 1) & indexMask; index[slot]; slot = (slot + 1) & indexMask)
+	{
+		size_t home = SlotHash(index[slot]) & indexMask;
+		// the entry can move into the hole unless its home lies cyclically after the hole (up to its current slot)
+		bool homeBetween = hole <= slot ? (hole < home && home <= slot) : (hole < home || home <= slot);
+		if(!homeBetween)
+		{
+			index[hole] = index[slot];
+			index[slot] = 0;
+			hole = slot;
+		}
+	}
+
+	// fill the row with the last one so the table stays dense
+	size_t last = --count;
+	if(row != last)
+	{
+		uint64_t &lastSlot = index[SlotOf(last)];
+		lastSlot = (lastSlot & ~0xFFFFFFFFull) | (row + 1);
+		records[row] = records[last];
+		MarkDirty(row);
+	}
+}
+
+bool LiveRecordTable::SpillToFile(const char *fileName)
+{
+#ifdef __linux__
+	if(spillFile >= 0)
+	{
+		return true;
+	}
+	if(!capacity && !Reserve())
+	{
+		return false;
+	}
+	int file = open(fileName, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if(file < 0)
+	{
+		return false;
+	}
+	unlink(fileName);
+	size_t pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+	size_t newPageRecords = pageSize / sizeof(Record);
+	uint64_t *newDirtyPages = static_cast<uint64_t*>(calloc(DirtyWords(capacity, newPageRecords),
+		sizeof(uint64_t)));
+	void *mapped = MAP_FAILED;
+	if(newDirtyPages && ftruncate(file, static_cast<off_t>(capacity * sizeof(Record))) == 0)
+	{
+		// private, so the mapping can be copied by fork() like the rest of the tracer's memory (see WriteHeapSnapshot)
+		mapped = mmap(nullptr, capacity * sizeof(Record), PROT_READ | PROT_WRITE, MAP_PRIVATE, file, 0);
+	}
+	if(mapped == MAP_FAILED)
+	{
+		free(newDirtyPages);
+		close(file);
+		return false;
+	}
+	memcpy(mapped, records, count * sizeof(Record));
+	free(records);
+	records = static_cast<Record*>(mapped);
+	spillFile = file;
+	pageRecords = newPageRecords;
+	dirtyPages = newDirtyPages;
+	for(size_t row = 0; row < count; row += pageRecords)
+	{
+		MarkDirty(row);
+	}
+	return true;
+#else
+	(void)fileName;
+	return false;
+#endif
+}
+
+void LiveRecordTable::SpillColdRecords(size_t residentRows)
+{
+#ifdef __linux__
+	if(spillFile < 0)
+	{
+		return;
+	}
+	size_t pageBytes = pageRecords * sizeof(Record);
+	// pages past the last row hold nothing since the table shrank, so they are dropped without being written out
+	size_t usedPages = (count + pageRecords - 1) / pageRecords, mappedPages = capacity / pageRecords;
+	if(usedPages < mappedPages)
+	{
+		for(size_t page = usedPages; page < mappedPages; page++)
+		{
+			dirtyPages[page / 64] &= ~(1ull << (page % 64));
+		}
+		madvise(reinterpret_cast<char*>(records) + usedPages * pageBytes, (mappedPages - usedPages) * pageBytes,
+			MADV_DONTNEED);
+	}
+	size_t coldPages = count > residentRows ? (count - residentRows) / pageRecords : 0;
+	for(size_t page = 0; page < coldPages; page++)
+	{
+		uint64_t bit = 1ull << (page % 64);
+		if(!(dirtyPages[page / 64] & bit))
+		{
+			continue;
+		}
+		// the mapping is private, so a changed page only exists in memory until it is written out; one which can't be
+		// written out stays in memory, along with the ones after it
+		off_t offset = static_cast<off_t>(page * pageBytes);
+		if(pwrite(spillFile, reinterpret_cast<char*>(records) + page * pageBytes, pageBytes, offset)
+			!= static_cast<ssize_t>(pageBytes))
+		{
+			coldPages = page;
+			break;
+		}
+		dirtyPages[page / 64] &= ~bit;
+	}
+	if(coldPages)
+	{
+		// the mapping reads the pages back from the file when they are next used; the file's own cached copies go
+		// once they are on disk
+		madvise(records, coldPages * pageBytes, MADV_DONTNEED);
+		posix_fadvise(spillFile, 0, static_cast<off_t>(coldPages * pageBytes), POSIX_FADV_DONTNEED);
+	}
+#else
+	(void)residentRows;
+#endif
+}
+
+
+long long* KeyMap::Find(uintptr_t key, int line) const
+{
+	if(!slots)
+	{
+		return nullptr;
+	}
+	for(size_t slot = HomeSlot(key, line); slots[slot].used; slot = (slot + 1) & mask)
+	{
+		if(slots[slot].key == key && slots[slot].line == line)
+		{
+			return &slots[slot].value;
+		}
+	}
+	return nullptr;
+}
+
+long long* KeyMap::FindOrAdd(uintptr_t key, int line, long long value)
+{
+	long long *existing = Find(key, line);
+	if(existing)
+	{
+		return existing;
+	}
+	if((used + 1) * 2 > (slots ? mask + 1 : 0))
+	{
+		size_t newSize = slots ? (mask + 1) * 2 : 64;
+		Slot *newSlots = static_cast<Slot*>(calloc(newSize, sizeof(Slot)));
+		if(!newSlots)
+		{
+			return nullptr;
+		}
+		Slot *oldSlots = slots;
+		size_t oldSize = slots ? mask + 1 : 0;
+		slots = newSlots;
+		mask = newSize - 1;
+		for(size_t i = 0; i < oldSize; i++)
+		{
+			if(oldSlots[i].used)
+			{
+				size_t slot = HomeSlot(oldSlots[i].key, oldSlots[i].line);
+				while(slots[slot].used)
+				{
+					slot = (slot + 1) & mask;
+				}
+				slots[slot] = oldSlots[i];
+			}
+		}
+		free(oldSlots);
+	}
+
+	size_t slot = HomeSlot(key, line);
+	while(slots[slot].used)
+	{
+		slot = (slot + 1) & mask;
+	}
+	slots[slot].key = key;
+	slots[slot].line = line;
+	slots[slot].used = true;
+	slots[slot].value = value;
+	used++;
+	return &slots[slot].value;
+}
+
+void KeyMap::Remove(uintptr_t key, int line)
+{
+	if(!slots)
+	{
+		return;
+	}
+	size_t hole = HomeSlot(key, line);
+	while(slots[hole].used && !(slots[hole].key == key && slots[hole].line == line))
+	{
+		hole = (hole + 1) & mask;
+	}
+	if(!slots[hole].used)
+	{
+		return;
+	}
+	// same backward shift as LiveRecordTable::Remove
+	slots[hole].used = false;
+	used--;
+	for(size_t slot = (hole + 1) & mask; slots[slot].used; slot = (slot + 1) & mask)
+	{
+		size_t home = HomeSlot(slots[slot].key, slots[slot].line);
+		bool homeBetween = hole <= slot ? (hole < home && home <= slot) : (hole < home || home <= slot);
+		if(!homeBetween)
+		{
+			slots[hole] = slots[slot];
+			slots[slot].used = false;
+			hole = slot;
+		}
+	}
+}
+
+void KeyMap::Clear()
+{
+	free(slots);
+	slots = nullptr;
+	mask = 0;
+	used = 0;
+}
@@ -0,0 +1,364 @@
+/** @file LiveRecords.h
+@brief Storage for the tracer's records of live allocations.  Included by MemoryTracer.h.
+*/
+
+#ifndef LIVERECORDS_H
+#define LIVERECORDS_H
+
+
+#include <stdint.h>
+#include <stdlib.h>
+
+
+/** @class KeyMap
+@brief Small open-addressing hash map from a (key, line) pair to a number.  Used to intern types and sites (the number
+is an ID) and to count allocations by size (the number is a count).  Not thread-safe.
+*/
+class KeyMap
+{
+private:
+
+	struct Slot
+	{
+		uintptr_t key;
+		int line;
+		bool used;
+		long long value;
+	};
+
+	Slot *slots;
+	size_t mask;
+	size_t used;
+
+	KeyMap(const KeyMap&);
+	KeyMap& operator=(const KeyMap&);
+
+	size_t HomeSlot(uintptr_t key, int line) const
+	{
+		uint64_t hash = (static_cast<uint64_t>(key) ^ (static_cast<uint64_t>(static_cast<unsigned int>(line)) << 40))
+			* 0x9E3779B97F4A7C15ull;
+		return static_cast<size_t>(hash >> 32) & mask;
+	}
+
+public:
+
+	KeyMap() : slots(nullptr), mask(0), used(0)
+	{}
+	~KeyMap()
+	{
+		free(slots);
+	}
+
+	/** @return Value stored for the key, or nullptr if there is none
+	*/
+	long long* Find(uintptr_t key, int line) const;
+
+	/** @brief Returns the value stored for the key, adding it with the given value first if it isn't there
+		@return Pointer to the value, or nullptr if memory ran out
+	*/
+	long long* FindOrAdd(uintptr_t key, int line, long long value);
+
+	/** @brief Removes the key's entry, if there is one
+	*/
+	void Remove(uintptr_t key, int line);
+
+	/** @brief Removes every entry and frees the memory
+	*/
+	void Clear();
+
+	/** @brief Calls function(key, line, value) for every entry, in no particular order
+	*/
+	template<typename Function>
+	void ForEach(Function function) const
+	{
+		for(size_t i = 0; slots && i <= mask; i++)
+		{
+			if(slots[i].used)
+			{
+				function(slots[i].key, slots[i].line, slots[i].value);
+			}
+		}
+	}
+};
+
+/** @class LiveRecordTable
+@brief Table of live allocations, one 16-byte record per block.
+
+A record packs the block's address (shifted right by 3, since blocks are 8-byte aligned), its AllocationType, its size
+(blocks of largeSize bytes or more keep theirs in a side map), the number of the allocation which created it (the low
+40 bits; the rest is recovered from the latest number), and a context: the block's type, site, and call stack, which
+are interned once, since most blocks share them with many others.  Records are kept whole, one after the other, rather
+than in separate columns, so a record fits in 16 bytes and a page of them can be spilled as it is (see below); scans
+over the table read every row in full.  A hash index maps addresses to rows, so adding, finding, and removing a record
+is constant time; each of its slots keeps the hash of its address next to the row, so probing the index (and growing
+it) never reads a record other than the one being looked for.  A removed row is filled with the last row, so the table
+never has gaps.  Row order is therefore arbitrary, but old blocks tend to stay near the front.
+
+On Linux, the records can live in a private mapping of a file (see SpillToFile), so the pages of old records which
+haven't changed can be written back and dropped from memory, and are read back only when a report or a free touches
+them.  Not thread-safe (the tracer guards it with its lock).
+*/
+class LiveRecordTable
+{
+private:
+
+	/** @struct Record
+	One block, packed as described above
+	*/
+	struct Record
+	{
+		//! Address >> 3 (bits 0-44), AllocationType (bits 45-46), and size, or largeSize (bits 47-63)
+		uint64_t block;
+		//! Low 40 bits of the allocation number (bits 0-39) and context ID (bits 40-63)
+		uint64_t origin;
+	};
+
+	/** @struct Context
+	Type, site, and stack shared by blocks
+	*/
+	struct Context
+	{
+		uint32_t typeId;
+		uint32_t siteId;
+		uint32_t stackId;
+		//! Next context with the same key in contextIds (0 if none)
+		uint32_t nextSameKey;
+	};
+
+	static const uint64_t addressMask = (1ull << 45) - 1;
+	static const int allocTypeShift = 45;
+	static const int sizeShift = 47;
+	static const uint64_t numberMask = (1ull << 40) - 1;
+	static const int contextShift = 40;
+	static const uint32_t maxContexts = 1u << 24;
+
+	Record *records;
+	size_t capacity;
+	//! Open-addressing hash index: each slot holds the hash of the block's address (bits 32-63, see AddressHash) and
+	//! its row number + 1 (bits 0-31), or 0 if it is empty
+	uint64_t *index;
+	size_t indexMask;
+	//! Highest allocation number added so far, which the full allocation numbers are recovered from
+	uint64_t latestAllocation;
+	//! Sizes of the blocks which are too large for their record, by address
+	KeyMap largeSizes;
+
+	//! Every context, indexed by ID; 0 has no type, site, or stack
+	Context *contexts;
+	size_t contextCount;
+	size_t contextCapacity;
+	//! Maps a mix of the type and site IDs (and the stack ID as the line) to the first context with that key
+	KeyMap contextIds;
+
+	//! File the records are mapped from, or -1 if they are in ordinary memory
+	int spillFile;
+	//! Number of records per page of memory
+	size_t pageRecords;
+	//! One bit per page of records, set when the page has changed since it was last written to spillFile
+	uint64_t *dirtyPages;
+
+	LiveRecordTable(const LiveRecordTable&);
+	LiveRecordTable& operator=(const LiveRecordTable&);
+
+	/** @return Hash of an address; its low bits are the slot the address would occupy if nothing else were in the way
+	*/
+	static uint32_t AddressHash(const void *address)
+	{
+		uint64_t key = static_cast<uint64_t>(reinterpret_cast<uintptr_t>(address)) >> 3;
+		return static_cast<uint32_t>((key * 0x9E3779B97F4A7C15ull) >> 32);
+	}
+
+	/** @return Row of a (used) index slot
+	*/
+	static size_t SlotRow(uint64_t slot)
+	{
+		return static_cast<size_t>(static_cast<uint32_t>(slot)) - 1;
+	}
+
+	/** @return Hash of the address of a (used) index slot
+	*/
+	static uint32_t SlotHash(uint64_t slot)
+	{
+		return static_cast<uint32_t>(slot >> 32);
+	}
+
+	/** @return Slot holding the given row (which must be in the index)
+	*/
+	size_t SlotOf(size_t row) const;
+
+	/** @brief Makes room for at least one more record, in the table and in the index
+		@return False if memory ran out
+	*/
+	bool Reserve();
+
+	/** @brief Rebuilds the index with the given number of slots
+		@return False if memory ran out
+	*/
+	bool RebuildIndex(size_t slots);
+
+	/** @return Size of a block whose record holds largeSize instead
+	*/
+	size_t LargeSize(size_t row) const;
+
+	/** @brief Finds the context with the given IDs, adding it if there is none
+		@return ID of the context, or -1 if memory (or IDs) ran out
+	*/
+	uint32_t InternContext(uint32_t typeId, uint32_t siteId, uint32_t stackId);
+
+	/** @brief Gives a row a different context, keeping the rest of the record
+	*/
+	void SetContext(size_t row, uint32_t contextId)
+	{
+		records[row].origin = (records[row].origin & numberMask) | static_cast<uint64_t>(contextId) << contextShift;
+		MarkDirty(row);
+	}
+
+	/** @brief Notes that a row changed, so its page is written to the spill file before it is dropped
+	*/
+	void MarkDirty(size_t row)
+	{
+		if(dirtyPages)
+		{
+			size_t page = row / pageRecords;
+			dirtyPages[page / 64] |= 1ull << (page % 64);
+		}
+	}
+
+public:
+
+	//! Blocks of this size or more keep their size outside of the record
+	static const size_t largeSize = 0x1FFFF;
+
+	//! Number of rows
+	size_t count;
+
+	LiveRecordTable();
+	~LiveRecordTable();
+
+	/** @return Address of the block (as returned to the program)
+	*/
+	void* Address(size_t row) const
+	{
+		return reinterpret_cast<void*>(static_cast<uintptr_t>((records[row].block & addressMask) << 3));
+	}
+
+	/** @return Size of the block, not including the header
+	*/
+	size_t Size(size_t row) const
+	{
+		size_t size = static_cast<size_t>(records[row].block >> sizeShift);
+		return size != largeSize ? size : LargeSize(row);
+	}
+
+	/** @return AllocationType of the block
+	*/
+	unsigned char AllocType(size_t row) const
+	{
+		return static_cast<unsigned char>((records[row].block >> allocTypeShift) & 3);
+	}
+
+	/** @return Number of the allocation which created the block (counting from 1), which orders blocks by age
+	*/
+	uint64_t AllocationNumber(size_t row) const
+	{
+		// the block was created less than 2^40 allocations ago, so the difference fits in the bits the record keeps
+		return latestAllocation - ((latestAllocation - records[row].origin) & numberMask);
+	}
+
+	/** @return Type of the block (an index into the tracer's type table, 0 if unknown)
+	*/
+	uint32_t TypeId(size_t row) const
+	{
+		return contexts[records[row].origin >> contextShift].typeId;
+	}
+
+	/** @return Allocation site of the block (an index into the tracer's site table, 0 if unknown)
+	*/
+	uint32_t SiteId(size_t row) const
+	{
+		return contexts[records[row].origin >> contextShift].siteId;
+	}
+
+	/** @return Call stack the block was allocated from (an index into the tracer's profile stacks, 0 if it wasn't
+		captured)
+	*/
+	uint32_t StackId(size_t row) const
+	{
+		return contexts[records[row].origin >> contextShift].stackId;
+	}
+
+	/** @brief Sets the type and site of a block
+		@return False if memory ran out (the record is left as it was)
+	*/
+	bool SetDetails(size_t row, uint32_t typeId, uint32_t siteId);
+
+	/** @brief Sets the call stack of a block
+		@return False if memory ran out (the record is left as it was)
+	*/
+	bool SetStackId(size_t row, uint32_t stackId);
+
+	/** @brief Adds a record with an unknown type, site, and stack
+		@param address Address of the block (8-byte aligned, and below 2^48)
+		@param size Size of the block
+		@param allocType AllocationType of the block
+		@param allocationNumber Number of the allocation (higher than that of every record already in the table)
+		@return Row of the new record, or -1 if memory ran out
+	*/
+	size_t Add(void *address, size_t size, unsigned char allocType, uint64_t allocationNumber);
+
+	/** @brief Finds the record of a block
+		@param address Address of the block
+		@return Row of the record, or -1 if there isn't one
+	*/
+	size_t Find(const void *address) const;
+
+	/** @brief Removes a record; the last row takes its place
+		@param row Row of the record
+	*/
+	void Remove(size_t row);
+
+	/** @brief Removes every record and frees the memory (including the spill file's mapping)
+	*/
+	void Clear();
+
+	/** @brief Moves the records into a private mapping of a new file (Linux only).  The file is removed as soon as it
+	is open, since it is only needed while the program runs.
+		@param fileName File to create
+		@return True if the records are now mapped from the file
+	*/
+	bool SpillToFile(const char *fileName);
+
+	/** @brief Writes the changed pages of the oldest rows to the spill file and drops them from memory, leaving the
+	given number of the newest rows alone, and drops the pages left empty past the last row.  Does nothing unless
+	SpillToFile succeeded.
+		@param residentRows Number of rows at the end of the table to keep in memory
+	*/
+	void SpillColdRecords(size_t residentRows);
+};
+
+/** @brief Makes sure a malloc'd array has room for the given number of entries, doubling its capacity as needed
+	@return False if memory ran out (the array is left as it was)
+*/
+template<typename T>
+bool GrowArray(T *&array, size_t &capacity, size_t entries)
+{
+	if(entries <= capacity)
+	{
+		return true;
+	}
+	size_t newCapacity = capacity ? capacity * 2 : 64;
+	if(newCapacity < entries)
+	{
+		newCapacity = entries;
+	}
+	T *newArray = static_cast<T*>(realloc(array, newCapacity * sizeof(T)));
+	if(!newArray)
+	{
+		return false;
+	}
+	array = newArray;
+	capacity = newCapacity;
+	return true;
+}
+
+#endif
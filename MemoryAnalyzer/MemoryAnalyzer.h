@@ -8,8 +8,8 @@
 MemoryAnalyzer is a very simple, portable memory information tool for C++ projects.  It was written for educational
 purposes, for determining the correct memory scheme to use when developing video games (for example, to help
 the user determine whether using a pool would be worthwhile), and for detecting leaks.  It was written with
-single-threaded applications in	mind and is not thread-safe (although you are free to extend it for multi-threaded apps)
-and has very few dependencies, all of which are part of the standard library.  MemoryAnalyzer was also designed to be
+single-threaded applications in	mind (allocation tracking is serialized by a single lock, so it is safe, if not fast,
+in multi-threaded apps) and has very few dependencies, all of which are part of the standard library.  MemoryAnalyzer was also designed to be
 simple to understand and use (both installation and usage).
 
 Note that since it was written with portability in mind, it does not have all the features of memory tools written
@@ -36,6 +36,31 @@ when your program exits.  If you also want to dump leaks to a file when your pro
 
 Example: memAnalyzer->dumpLeaksToFile = true;
 
+The tracer is constructed in place the first time memory is allocated and is never destroyed, so static objects in
+other files can allocate and free memory in their constructors and destructors in any order.  The exit report is
+written by a handler registered with atexit at that point, so it runs after the destructors of the static objects
+constructed from then on; memory freed after the report is simply released.  Anything allocated while the tracer itself
+is being constructed goes straight to malloc and isn't tracked.
+
+On Linux, you can set reachabilityLeakCheck to true to have the exit report only list blocks which can no longer be
+reached from the program's globals or stack (much like a garbage collector would find them), instead of every block
+which is still allocated.  Singletons and caches which are intentionally never freed are then left out.  Lost blocks are
+split into definitely lost blocks (nothing points to them) and indirectly lost blocks (only other lost blocks point to
+them, e.g., the rest of a leaked list).  You can also run the same check at any time by calling ScanForLeaks().  The
+stacks of the program's other threads are scanned too, but not their registers, so other threads should be idle at that
+point; memory only they can reach (e.g., a region from mmap) can be registered with AddRootRegion().
+
+Example: memAnalyzer->reachabilityLeakCheck = true;
+
+In a long-running program, the exit report comes too late and lists everything at once.  To check one request, level,
+or other unit of work, call BeginLeakEpoch() when it starts and EndLeakEpoch() when it is done; the blocks allocated in
+between which are still allocated are listed, oldest first.  While an epoch is open, the tracer logs every allocation,
+so ending it only looks at the blocks allocated during the epoch instead of the whole heap.  Pass true to
+BeginLeakEpoch() to leave out the allocations of other threads.
+
+Example: MemoryTracer::LeakEpoch epoch = memAnalyzer->BeginLeakEpoch(true);
+Example: HandleRequest(request); memAnalyzer->EndLeakEpoch(epoch);
+
 @subsection allocInfo Alloc/Dealloc Information
 
 Although it can create a (very) large amount of spam in the console if left on all the time, sometimes it may be useful
@@ -44,6 +69,10 @@ to true; likewise, to turn on diagnostic information for deallocations, set show
 
 Example: memAnalyzer->showAllAllocs = true;
 
+These messages, like all of the tracer's reports, are formatted into a fixed buffer and written to stdout with stdio
+(see TraceWriter), so printing them from inside operator new and delete never allocates memory of its own.  Debug
+builds assert that the reports leave the allocation count untouched.
+
 You may wish to get a summarized list of all the current allocations; for example, you may want to see if you
 are making a lot of small allocations and relatively few large allocations, in order to determine if your memory scheme
 could be improved.  To get a list of the current allocations, call DisplayAllocations().  Check the documentation for an
@@ -51,6 +80,14 @@ explanation of the parameters.
 
 Example: memAnalyzer->DisplayAllocations();
 
+Each live block has one packed 16-byte record (address, size, allocation type and number, and a context), kept whole in
+one table with a hash index by address rather than in a list per block size, so finding a block when it is freed takes
+constant time, and DisplayAllocations(), the exit report, heap dumps, and leak scans stay fast even with millions of
+live blocks.  Types, sites, and call stacks are shared by many blocks, so each combination is stored once as a context
+which the records refer to.  On Linux, the records of old blocks can also be moved out to a file (see Huge Heaps).  The
+detailed listing and the exit report are grouped and formatted on several threads and written out in one piece; set
+reportThreads to choose how many (the output is the same for any number).
+
 If you're working within strict memory limits, keeping an eye on how much memory you are using is important.  To see how
 much memory you currently have allocated, call GetCurrentMemory().  To see the peak amount of memory you had allocated
 during your program's run, call GetPeakMemory().
@@ -64,6 +101,86 @@ performance slightly in your debug builds.
 
 Example: "#define DISABLE_DEBUG_INFO_COLLECTION" (minus the quotes)
 
+@subsection growth Container Growth
+
+Containers such as std::vector and std::string which grow one element at a time reallocate (and copy their contents)
+every time they run out of room.  Those allocations don't go through DEBUG_NEW, so they only show up as blocks of
+unknown type in ever-growing sizes.  Set detectContainerGrowth to true to have each such step (a block replaced by one
+1.5 to 2 times its size on the same thread, with both calls made from the same code) attributed to the call stack it
+happened at.  DisplayGrowthReport(), which
+also runs at exit, then lists the stacks where a reserve() would have saved the most copying.  The stacks are only
+captured when a step is found, so the check costs very little otherwise.  Stacks are available on Windows and on
+Linux with glibc (link with -rdynamic to get function names on Linux).
+
+Example: memAnalyzer->detectContainerGrowth = true;
+
+@subsection sampler Memory Over Time
+
+GetPeakMemory() tells you how high memory use got, but not when.  Call StartSampler() to have a background thread
+record the current memory, number of blocks, allocation and deallocation rates, and the largest types at a fixed
+interval, then export the samples with ExportSamplesCSV() or ExportSamplesJSON() to graph them.  The sampler reads
+the counters without locking, so it has no effect on allocation speed.
+
+Example: memAnalyzer->StartSampler(50);
+Example: memAnalyzer->ExportSamplesCSV("memory.csv");
+
+@subsection timeline Timeline
+
+To see allocation activity next to the rest of a frame, call StartTimeline() to record a trace that chrome://tracing
+and the Perfetto UI can open.  It has counter tracks of the current memory and blocks, an instant event for every
+allocation of at least the given size, a slice for the lifetime of every block with a type (one track per type,
+starting when the object has been constructed), and the markers added with Mark(), such as the start of each frame.
+Each thread collects its events in memory and a background thread writes them out, so no file output happens in the
+frame; reading the clock for every typed block still adds to the cost of tracking it.  The timeline is finished by
+StopTimeline() or at exit.
+
+Example: memAnalyzer->StartTimeline("timeline.json", 64 * 1024);
+Example: memAnalyzer->Mark("Frame");
+
+@subsection threads Threads
+
+Every block records which thread allocated it, and each thread keeps its own counters (allocations, frees, memory
+allocated, memory still live, and its peak), so keeping them doesn't make threads wait on each other.
+DisplayThreadStats() lists the threads, along with every pair of threads where one frees memory the other allocated
+(which is expensive for per-thread pools and arenas); DisplayStatTable() shows the same once a second thread has
+allocated.  Give threads names with NameCurrentThread() to tell them apart in the report.  Block headers have room for
+65535 thread numbers; once they are all taken, the numbers of threads which have exited are given to new ones, and
+the report counts the threads which shared a number in one row.
+
+Example: memAnalyzer->NameCurrentThread("render");
+Example: memAnalyzer->DisplayThreadStats();
+
+@subsection zones No-Alloc Zones
+
+In latency-critical code (a render thread's frame, a network thread's packet loop), any heap allocation is a bug.
+Create a NoAllocZone at the start of such a scope, and every allocation the thread makes until the zone goes out of
+scope is recorded as a violation of the zone, with its call stack.  Depending on the zone's policy, each violation is
+only counted, also printed, or stops the program.  A zone can also let a fixed number of allocations through before it
+complains.  DisplayNoAllocReport() (also shown at exit) lists the violations of each zone by call stack, and
+GetNoAllocViolations() returns the count, e.g., for a test to check.  When no zone is active, the check costs one
+thread-local load per allocation, so zones can be left in place for good.
+
+Example: NoAllocZone zone("render", NOALLOC_LOG);
+
+@subsection backends Backing Allocators
+
+By default, MemoryTracer gets the memory it hands out from malloc.  To see how your program behaves on top of a different
+allocator (or to try one out), derive from BackingAllocator and select it for a scope with ScopedBackingAllocator;
+every allocation the current thread makes in that scope comes from your allocator, and is freed back to it no matter
+where it is deleted.  Two allocators are included: SizeClassPool, a pool with per-thread caches which rounds requests
+up to a set of size classes, and BumpArena, a linear allocator for memory which is thrown away all at once (e.g., at the
+end of a frame).  When no allocator is selected, the only extra cost over malloc is checking which one is current.
+
+Example: SizeClassPool pool; { ScopedBackingAllocator scope(pool); Particle *p = new Particle; }
+
+SizeClassPool's size classes work best when they match the sizes your program actually allocates.  Call
+ExportSizeHistogram() (or set sizeHistogramFileName) at the end of one run, then have LoadSizeClasses() pick the classes
+which waste the least memory for that mix in the next.  To find out whether a pool pays off at all, BenchmarkPool() runs
+the same workload with and without it and compares the allocation rate and (on Linux) the cache misses.
+
+Example: size_t classes[16]; size_t count = SizeClassPool::LoadSizeClasses("sizes.txt", classes, 16);
+Example: SizeClassPool pool(classes, count); memAnalyzer->BenchmarkPool(RunFrame, &game, pool);
+
 @subsection table Statistics Table
 
 While you can call DisplayAllocations to see the current number of allocations and their sizes, you may want to get further
@@ -73,6 +190,25 @@ not be available.
 
 Example: memAnalyzer->DisplayStatTable();
 
+Type names are taken from the compiler's own signature strings rather than from RTTI, so the table works in builds with
+RTTI turned off (e.g., -fno-rtti), and tagging an allocation with its type costs no run-time lookup.
+
+Code with many template instantiations can fill the table with thousands of rows of one template.  SetTypeGrouping()
+puts them together instead: GROUP_BY_TEMPLATE makes one row of every std::vector<...> (and of arrays of any length),
+and GROUP_BY_NAMESPACE one row of every outermost namespace.  AddTypeGroupRule() sends the types whose names start with
+a prefix to a group of your choosing ahead of the grouping.  Each type is grouped once, and the totals are summed from
+the ones kept per type, so GetTypeGroups() can fetch the largest groups every frame, e.g., for an in-game overlay.
+
+Example: memAnalyzer->SetTypeGrouping(GROUP_BY_TEMPLATE); memAnalyzer->AddTypeGroupRule("physx::", "Physics");
+Example: TypeGroupStats groups[8]; size_t count = memAnalyzer->GetTypeGroups(groups, 8);
+
+DisplayStatTable() also shows what memory was made up of at its peak, by type and by source line (also available on its
+own through DisplayPeakComposition()).  To keep allocations fast, this composition is only recorded when the peak has
+grown by more than peakSnapshotThreshold (5% by default) since it was last recorded, so it can be slightly older than the
+exact peak; lower the threshold if you need it closer.
+
+Example: memAnalyzer->peakSnapshotThreshold = 0.01f;
+
 @subsection heap Heap Checking
 
 Heap corruption is a very serious problem.  If you are on a Windows system, you can call HeapCheck() to determine the state
@@ -80,6 +216,110 @@ of the heap.  Although calling the function could shuffle things around in memor
 else, it can often be helpful in narrowing down the problem region.
 
 Example: memAnalyzer->HeapCheck();
+
+@subsection dump Heap Dumps
+
+The text reports become slow and unwieldy once there are millions of blocks.  For large heaps, call WriteHeapDump()
+to save every current allocation in a compact binary file instead (the layout is described in HeapDump.h), or set
+heapDumpFileName to have one written at exit.  The dump can then be filtered and totaled by type, file, site, or size
+with the HeapQuery tool in the Tools folder, which maps the file instead of loading it.
+
+Example: memAnalyzer->WriteHeapDump("heap.dump");
+Example: HeapQuery heap.dump --type Texture --min-size 4096 --group site
+
+On Linux and other POSIX systems, a dump can also be taken from a running program without stopping it.  After
+EnableHeapSnapshots() is called, sending the process SIGUSR2 (or calling RequestHeapSnapshot()) makes a background
+thread fork a copy of the process and write the dump from the copy; the program itself only pauses for the fork.
+
+Example: memAnalyzer->EnableHeapSnapshots("/tmp/server-heap");
+Example: kill -USR2 <pid>
+
+@subsection profile Heap Profiles
+
+To look at memory with the same tools you use for CPU profiles, export a heap profile.  ExportPprof() writes a file
+which pprof can read, with the live memory and blocks (inuse_space, inuse_objects) and everything allocated so far
+(alloc_space, alloc_objects) for each source line and type.  ExportFoldedStacks() writes one of these measures in the
+folded-stack format that flame graph scripts take.  Set heapProfileFileName to have a pprof profile written at exit.
+Both are built from totals the tracer keeps as it goes, and written out a piece at a time, so they stay quick and
+small in memory however many sites there are.
+
+Example: memAnalyzer->ExportPprof("heap.pb");
+Example: pprof -http=:8080 heap.pb
+Example: memAnalyzer->ExportFoldedStacks("heap.folded");
+Example: flamegraph.pl heap.folded > heap.svg
+
+To see the call stacks the memory was allocated from instead (including the allocations made inside containers, which
+have no source line or type), set captureAllocationStacks to true and export with PROFILE_BY_STACK.  A stack is then
+captured for every allocation, which is slow, so it is off by default.  Stacks are available on Windows and on Linux
+with glibc; function names are only filled in on Linux (link with -rdynamic).
+
+Example: memAnalyzer->captureAllocationStacks = true;
+Example: memAnalyzer->ExportPprof("heap.pb", MemoryTracer::PROFILE_BY_STACK);
+
+@subsection records Huge Heaps
+
+The tracer keeps a 16-byte record for every live block.  With the room the record table and its index keep free for
+growth, that comes to 29 to 50 bytes per block (16 to 24 of records and 13 to 26 of index), so a heap of 50 million
+blocks costs it 1.5 to 2.5 GB.  On Linux, EnableRecordSpilling() moves the records into a scratch file so that only the
+newest ones stay in memory; the older ones are written out every so often and read back when a block is freed or a
+report runs, which is slower but leaves only the index (13 to 26 bytes per block) and the resident records in memory.
+
+Example: memAnalyzer->EnableRecordSpilling("/var/tmp/records.bin", 1 << 20);
+
+@subsection large Large Blocks
+
+Outside Windows, blocks of largeBlockThreshold bytes or more (16 MB by default, 0 turns it off) get pages of their own
+from mmap instead of coming from the heap, with their header kept in a separate table, so they start on a page
+boundary and give their memory back to the system as soon as they are freed.  On Linux, largeBlockHugePages also aligns
+them to 2 MB and asks for transparent huge pages.  DisplayLargeBlocks() lists them with how much of each is resident.
+Blocks made through a BackingAllocator never take this path.
+
+Example: memAnalyzer->largeBlockThreshold = 64 << 20;
+Example: memAnalyzer->DisplayLargeBlocks();
+
+@subsection overhead Overhead
+
+Every allocation and deallocation takes the tracer's lock and updates its tables, so tracked code runs slower than
+untracked code.  To see by how much on allocation patterns like a game's (per-frame temporaries, a scene graph, a
+polymorphic component hierarchy, particle arrays, and multithreaded job bursts), build the TracerBenchmark tool in the
+Tools folder with and without the tracer and compare the two.  The tool can fail a script when the overhead of any
+workload goes over a limit, which catches regressions in the allocation path.
+
+Example: TracerBenchmarkBase --save base.txt && TracerBenchmark --baseline base.txt --fail-above 8
+
+@subsection preload Preload Mode
+
+If you can't rebuild a program with MemoryAnalyzer.h included, you can build the tracer's sources (all but
+MemoryAnalyzer.cpp) on their own as a shared library and preload it into the unmodified (and optimized) binary on Linux.
+Since the program's calls to new and delete are replaced at load time, you get the same allocation tracking and leak
+report, minus the filename, line number, and object type information (which require DEBUG_NEW).  Define
+MEMORYANALYZER_PRELOAD when building the library so the leak report doesn't wait for input at exit.
+
+Example: g++ -O2 -fPIC -shared -DMEMORYANALYZER_PRELOAD $(ls *.cpp | grep -v MemoryAnalyzer.cpp) -o libma.so -lpthread
+Example: LD_PRELOAD=./libma.so ./server
+
+Since the preloaded program can't set any options itself, they are read from the environment the first time the
+tracer is used (these also work in normal debug builds):
+
+MEMANALYZER_SHOW_ALLOCS -- same as showAllAllocs (1/0)
+MEMANALYZER_SHOW_DEALLOCS -- same as showAllDeallocs (1/0)
+MEMANALYZER_DUMP_LEAKS -- same as dumpLeaksToFile (1/0)
+MEMANALYZER_LEAK_FILE -- same as leakFileName
+MEMANALYZER_PAUSE_ON_EXIT -- same as pauseOnExit (1/0)
+MEMANALYZER_REACHABILITY -- same as reachabilityLeakCheck (1/0)
+MEMANALYZER_GROWTH -- same as detectContainerGrowth (1/0)
+MEMANALYZER_REPORT_THREADS -- same as reportThreads
+MEMANALYZER_PEAK_THRESHOLD -- same as peakSnapshotThreshold
+MEMANALYZER_HEAP_DUMP -- same as heapDumpFileName
+MEMANALYZER_SIZE_HISTOGRAM -- same as sizeHistogramFileName
+MEMANALYZER_HEAP_PROFILE -- same as heapProfileFileName
+MEMANALYZER_PROFILE_STACKS -- same as captureAllocationStacks (1/0)
+MEMANALYZER_TIMELINE -- calls StartTimeline with this file
+MEMANALYZER_SNAPSHOT_PREFIX -- calls EnableHeapSnapshots with this prefix
+MEMANALYZER_SPILL_FILE -- calls EnableRecordSpilling with this file
+MEMANALYZER_RESIDENT_RECORDS -- number of records EnableRecordSpilling keeps in memory
+MEMANALYZER_LARGE_BLOCKS -- same as largeBlockThreshold
+MEMANALYZER_HUGE_PAGES -- same as largeBlockHugePages (1/0)
 */
 
 #ifndef MEMORYANALYZER_H
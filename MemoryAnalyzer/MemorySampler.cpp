@@ -0,0 +1,263 @@
+#include "MemoryTracer.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <stdio.h>
+#include <thread>
+
+using namespace std;
+
+
+// Everything below is guarded by samplerLock, which is private to the sampler: the sampler thread only reads the
+// tracer's atomic counters, so neither it nor the export functions ever wait on (or hold up) Allocate/Deallocate.
+static mutex samplerLock;
+static condition_variable samplerWake;
+static thread *samplerThread = nullptr;
+static bool samplerStop = false;
+static unsigned int samplerInterval = 0;
+// Ring buffer of samples (allocated with malloc so it never shows up in the tracer's own lists)
+static MemorySample *samples = nullptr;
+static size_t sampleCapacity = 0;
+// Total number of samples taken; the newest one is at (sampleCount - 1) % sampleCapacity
+static size_t sampleCount = 0;
+
+// Copies the retained samples, oldest first, into a malloc'd array; the caller frees it
+static MemorySample* CopySamples(size_t &count)
+{
+	lock_guard<mutex> guard(samplerLock);
+	count = sampleCount < sampleCapacity ? sampleCount : sampleCapacity;
+	MemorySample *copy = static_cast<MemorySample*>(malloc((count ? count : 1) * sizeof(MemorySample)));
+	if(!copy)
+	{
+		count = 0;
+		return nullptr;
+	}
+	size_t first = sampleCount - count;
+	for(size_t i = 0; i < count; i++)
+	{
+		copy[i] = samples[(first + i) % sampleCapacity];
+	}
+	return copy;
+}
+
+// Writes a string as a JSON string literal
+static void WriteJSONString(FILE *file, const char *str)
+{
+	fputc('"', file);
+	for( ; *str; str++)
+	{
+		if(*str == '"' || *str == '\\')
+		{
+			fputc('\\', file);
+		}
+		fputc(*str, file);
+	}
+	fputc('"', file);
+}
+
+// Writes a string as a quoted CSV field, since type names can contain commas (e.g., std::map<int, Foo>)
+static void WriteCSVString(FILE *file, const char *str)
+{
+	fputc('"', file);
+	for( ; *str; str++)
+	{
+		if(*str == '"')
+		{
+			fputc('"', file);
+		}
+		fputc(*str, file);
+	}
+	fputc('"', file);
+}
+
+void MemoryTracer::TakeSample(MemorySample &sample, double time, double elapsed, long long &lastAllocations,
+	long long &lastDeallocations)
+{
+	sample.time = time;
+	sample.currentMemory = currentMemory.load(memory_order_relaxed);
+	sample.currentBlocks = currentBlocks.load(memory_order_relaxed);
+
+	long long allocations = totalAllocations.load(memory_order_relaxed);
+	long long deallocations = totalDeallocations.load(memory_order_relaxed);
+	sample.allocationRate = elapsed > 0 ? (allocations - lastAllocations) / elapsed : 0;
+	sample.deallocationRate = elapsed > 0 ? (deallocations - lastDeallocations) / elapsed : 0;
+	lastAllocations = allocations;
+	lastDeallocations = deallocations;
+
+	// keep the K largest types with an insertion sort; the registry chain is never relinked, so it is safe to walk
+	// while other threads add types
+	size_t found = 0;
+	for(TypeNode *node = typeRegistry.load(memory_order_acquire); node; node = node->nextRegistered)
+	{
+		size_t memSize = node->memSize.load(memory_order_relaxed);
+		long blocks = node->blocks.load(memory_order_relaxed);
+		if(blocks <= 0)
+		{
+			continue;
+		}
+		size_t position = found;
+		while(position > 0 && sample.topTypeMemory[position - 1] < memSize)
+		{
+			if(position < MEMORYTRACER_SAMPLE_TOP_TYPES)
+			{
+				sample.topTypes[position] = sample.topTypes[position - 1];
+				sample.topTypeMemory[position] = sample.topTypeMemory[position - 1];
+				sample.topTypeBlocks[position] = sample.topTypeBlocks[position - 1];
+			}
+			position--;
+		}
+		if(position < MEMORYTRACER_SAMPLE_TOP_TYPES)
+		{
+			sample.topTypes[position] = node->type;
+			sample.topTypeMemory[position] = memSize;
+			sample.topTypeBlocks[position] = blocks;
+			if(found < MEMORYTRACER_SAMPLE_TOP_TYPES)
+			{
+				found++;
+			}
+		}
+	}
+	for( ; found < MEMORYTRACER_SAMPLE_TOP_TYPES; found++)
+	{
+		sample.topTypes[found] = nullptr;
+		sample.topTypeMemory[found] = 0;
+		sample.topTypeBlocks[found] = 0;
+	}
+}
+
+bool MemoryTracer::StartSampler(unsigned int intervalMilliseconds, size_t capacity)
+{
+	StopSampler();
+	if(!intervalMilliseconds || !capacity)
+	{
+		return false;
+	}
+
+	{
+		lock_guard<mutex> guard(samplerLock);
+		MemorySample *newSamples = static_cast<MemorySample*>(realloc(samples, capacity * sizeof(MemorySample)));
+		if(!newSamples)
+		{
+			return false;
+		}
+		samples = newSamples;
+		sampleCapacity = capacity;
+		sampleCount = 0;
+		samplerInterval = intervalMilliseconds;
+		samplerStop = false;
+	}
+
+	samplerThread = new thread([this]()
+	{
+		typedef chrono::steady_clock Clock;
+		Clock::time_point start = Clock::now(), last = start;
+		long long lastAllocations = totalAllocations, lastDeallocations = totalDeallocations;
+
+		unique_lock<mutex> guard(samplerLock);
+		while(!samplerWake.wait_for(guard, chrono::milliseconds(samplerInterval), [] { return samplerStop; }))
+		{
+			// the sample is taken straight into its slot; the slot isn't visible to readers until sampleCount moves
+			Clock::time_point now = Clock::now();
+			TakeSample(samples[sampleCount % sampleCapacity], chrono::duration<double>(now - start).count(),
+				chrono::duration<double>(now - last).count(), lastAllocations, lastDeallocations);
+			sampleCount++;
+			last = now;
+		}
+	});
+	return true;
+}
+
+void MemoryTracer::StopSampler()
+{
+	if(!samplerThread)
+	{
+		return;
+	}
+	{
+		lock_guard<mutex> guard(samplerLock);
+		samplerStop = true;
+	}
+	samplerWake.notify_all();
+	samplerThread->join();
+	delete samplerThread;
+	samplerThread = nullptr;
+}
+
+size_t MemoryTracer::GetSamples(MemorySample *destination, size_t maxSamples)
+{
+	size_t count;
+	MemorySample *copy = CopySamples(count);
+	// keep the newest ones if there isn't room for all of them
+	size_t skip = count > maxSamples ? count - maxSamples : 0;
+	for(size_t i = skip; i < count; i++)
+	{
+		destination[i - skip] = copy[i];
+	}
+	free(copy);
+	return count - skip;
+}
+
+bool MemoryTracer::ExportSamplesCSV(const char *fileName)
+{
+	FILE *file = fopen(fileName, "w");
+	if(!file)
+	{
+		return false;
+	}
+	size_t count;
+	MemorySample *copy = CopySamples(count);
+
+	fprintf(file, "time,current_memory,current_blocks,allocation_rate,deallocation_rate");
+	for(int k = 1; k <= MEMORYTRACER_SAMPLE_TOP_TYPES; k++)
+	{
+		fprintf(file, ",type_%d,type_%d_memory,type_%d_blocks", k, k, k);
+	}
+	fputc('\n', file);
+	for(size_t i = 0; i < count; i++)
+	{
+		const MemorySample &sample = copy[i];
+		fprintf(file, "%.3f,%zu,%lld,%.1f,%.1f", sample.time, sample.currentMemory, sample.currentBlocks,
+			sample.allocationRate, sample.deallocationRate);
+		for(int k = 0; k < MEMORYTRACER_SAMPLE_TOP_TYPES; k++)
+		{
+			fputc(',', file);
+			WriteCSVString(file, sample.topTypes[k] ? sample.topTypes[k] : "");
+			fprintf(file, ",%zu,%ld", sample.topTypeMemory[k], sample.topTypeBlocks[k]);
+		}
+		fputc('\n', file);
+	}
+
+	free(copy);
+	return fclose(file) == 0;
+}
+
+bool MemoryTracer::ExportSamplesJSON(const char *fileName)
+{
+	FILE *file = fopen(fileName, "w");
+	if(!file)
+	{
+		return false;
+	}
+	size_t count;
+	MemorySample *copy = CopySamples(count);
+
+	fprintf(file, "{\"interval_ms\":%u,\"samples\":[", samplerInterval);
+	for(size_t i = 0; i < count; i++)
+	{
+		const MemorySample &sample = copy[i];
+		fprintf(file, "%s\n{\"time\":%.3f,\"current_memory\":%zu,\"current_blocks\":%lld,\"allocation_rate\":%.1f,"
+			"\"deallocation_rate\":%.1f,\"top_types\":[", i ? "," : "", sample.time, sample.currentMemory,
+			sample.currentBlocks, sample.allocationRate, sample.deallocationRate);
+		for(int k = 0; k < MEMORYTRACER_SAMPLE_TOP_TYPES && sample.topTypes[k]; k++)
+		{
+			fprintf(file, "%s{\"type\":", k ? "," : "");
+			WriteJSONString(file, sample.topTypes[k]);
+			fprintf(file, ",\"memory\":%zu,\"blocks\":%ld}", sample.topTypeMemory[k], sample.topTypeBlocks[k]);
+		}
+		fprintf(file, "]}");
+	}
+	fprintf(file, "\n]}\n");
+
+	free(copy);
+	return fclose(file) == 0;
+}
@@ -1,206 +1,417 @@
 #include "MemoryTracer.h"
 
+#include <algorithm>
+#include <cstring>
 #include <exception>
-#include <iomanip>
+#include <new>
+#include <thread>
+#include <type_traits>
 
 #ifdef _WIN32
+#include <intrin.h>
 #include <malloc.h>
 #endif
 
 using namespace std;
 
 
-MemoryTracer::MemoryTracer()
-	: head_new(nullptr), head_new_array(nullptr), showAllAllocs(false), showAllDeallocs(false),
-	peakMemory(0), currentMemory(0), unknown("Unknown"), dumpLeaksToFile(true), currentBlocks(0), 
-	peakBlocks(0), head_types(nullptr)
+// The tracer lives here rather than in a function-local static: it is never destroyed, so blocks freed by the
+// destructors of other static objects still find it, and nothing runs before the first allocation
+static aligned_storage<sizeof(MemoryTracer), alignof(MemoryTracer)>::type tracerStorage;
+
+atomic<int> MemoryTracer::state(MemoryTracer::TRACER_UNCONSTRUCTED);
+thread_local bool MemoryTracer::constructingThread = false;
+MemoryTracer *MemoryTracer::instance = nullptr;
+const size_t MemoryTracer::maxTypeNameLength;
+
+#ifndef _WIN32
+// Pages are a multiple of this size everywhere, so a pointer which isn't aligned to it can't be a large block
+static const uintptr_t minimumPageSize = 4096;
+#endif
+
+// Interprets an environment variable as a flag ("1", "true", "yes", "on"); returns defaultValue if it isn't set
+static bool EnvFlag(const char *name, bool defaultValue)
 {
+	const char *value = getenv(name);
+	if(!value || !*value)
+	{
+		return defaultValue;
+	}
+	return !strcmp(value, "1") || !strcmp(value, "true") || !strcmp(value, "yes") || !strcmp(value, "on");
 }
 
-MemoryTracer::~MemoryTracer()
+const char* ParseTypeName(const char *signature)
 {
-	int totalLeaks = 0;
-
-	auto cleanupLeakCheck = [&](MemInfoNode *head, AllocationType type)
+	const char *begin = nullptr, *end = nullptr;
+	// GCC: "... TypeTag<T>::Name() [with T = Foo]"; Clang: "... TypeTag<Foo>::Name() [T = Foo]"
+	const char *with = strstr(signature, "[with T = ");
+	const char *plain = strstr(signature, "[T = ");
+	if(with || plain)
+	{
+		begin = with ? with + strlen("[with T = ") : plain + strlen("[T = ");
+		// the name ends at the closing bracket, or at a "; " GCC adds for typedefs, whichever comes first outside of
+		// any template arguments
+		int depth = 0;
+		for(end = begin; *end && !(depth == 0 && (*end == ']' || *end == ';')); end++)
+		{
+			depth += *end == '<' || *end == '(' || *end == '[';
+			depth -= *end == '>' || *end == ')' || *end == ']';
+		}
+	}
+	// MSVC: "const char *__cdecl TypeTag<class Foo>::Name(void)"
+	else if((begin = strstr(signature, "TypeTag<")) != nullptr)
 	{
-		// step through the list of nodes (which contain info on allocs of a single size) and check if
-		// there are any allocations left
-		for(MemInfoNode *temp; head; head = temp)
+		begin += strlen("TypeTag<");
+		end = strstr(begin, ">::Name");
+		for(const char *keyword : { "class ", "struct ", "union ", "enum " })
 		{
-			// if there are stored allocations, it means the user didn't free them, so list them
-			// and, if the user wants, output them to the file
-			if(head->numberOfAllocations != 0)
+			if(!strncmp(begin, keyword, strlen(keyword)))
 			{
-				cout << head->numberOfAllocations << " memory leak(s) detected of size " << head->size 
-					<< " and type " << GetAllocTypeAsString(type);
-				if(dumpLeaksToFile)
-				{
-					dumpFile << head->numberOfAllocations << " memory leak(s) detected of size " << head->size 
-						<< " and type " << GetAllocTypeAsString(type);
-				}
-
-				totalLeaks += head->numberOfAllocations;
-
-				// go through all the remaining addresses and display/store file & line #
-				for(AddrListNode *addrNode = head->addresses, *temp; addrNode; )
-				{
-					cout << "\n\tAddress: 0x" << addrNode->address << " File: " << addrNode->file 
-						<< " Line: " << addrNode->line;
-					if(dumpLeaksToFile)
-					{
-						dumpFile << "\n\tAddress: 0x" << addrNode->address << " File: " << addrNode->file 
-							<< " Line: " << addrNode->line;
-					}
-					temp = addrNode;
-					addrNode = addrNode->next;
-					free(temp);
-				}
-				cout << "\n\n";
-				if(dumpLeaksToFile)
-				{
-					dumpFile << "\n\n";
-				}
+				begin += strlen(keyword);
+				break;
 			}
-
-			temp = head->next;
-			free(head);
 		}
-	};
-	// this is here to basically clear the file contents
-	remove( "memleaks.log" );
-	if(dumpLeaksToFile)
+	}
+	if(!begin || !end || end <= begin)
 	{
-		dumpFile.open("memleaks.log", ios::app);
+		return signature;
 	}
 
-	cleanupLeakCheck(head_new, ALLOC_NEW);
-	cleanupLeakCheck(head_new_array, ALLOC_NEW_ARRAY);
-
-	cout << "Total number of leaks found: " << totalLeaks << "\nTotal memory leaked: " << currentMemory 
-		<< " bytes (" << currentMemory / 1000. << " kilobytes / " << currentMemory / 1000000. << " megabytes)" 
-		<< "\n\nPress any key twice to continue";
-	if(dumpLeaksToFile)
+	char *name = static_cast<char*>(malloc(end - begin + 1));
+	if(!name)
 	{
-		dumpFile << "Total number of leaks found: " << totalLeaks << "\nTotal memory leaked: " << currentMemory 
-			<< " bytes (" << currentMemory / 1000. << " kilobytes / " << currentMemory / 1000000. << " megabytes)" 
-			<< "\n\nPress any key twice to continue";
+		return signature;
 	}
-	cin.get();
-	cin.get();
+	memcpy(name, begin, end - begin);
+	name[end - begin] = '\0';
+	return name;
+}
+
+MemoryTracer::MemoryTracer()
+	: largeBlocks(nullptr), largeBlockCount(0), largeBlockCapacity(0), residentRecordLimit(0), runningSnapshots(0),
+	typeTable(nullptr), typeCount(0), typeTableCapacity(0), typeGroups(nullptr), typeGroupCount(0),
+	typeGroupCapacity(0), typeGroupRules(nullptr), typeGroupRuleCount(0), typeGroupRuleCapacity(0),
+	typeGrouping(GROUP_BY_TYPE), siteTable(nullptr), siteCount(0), siteTableCapacity(0), profileSites(nullptr),
+	profileSiteCount(0), profileSiteCapacity(0), profileStacks(nullptr), profileStackCount(0), profileStackCapacity(0),
+	threadTable(nullptr), threadCount(0), threadTableCapacity(0), exitedThreads(nullptr), exitedThreadCount(0),
+	exitedThreadCapacity(0), zoneTable(nullptr), zoneCount(0), zoneTableCapacity(0), epochLog(nullptr),
+	epochLogCount(0), epochLogCapacity(0), openEpochs(0), timelineRunning(false), head_types(nullptr),
+	typeRegistry(nullptr), head_sites(nullptr), nextPeakSnapshot(0), head_growthSites(nullptr), currentMemory(0),
+	peakMemory(0), currentBlocks(0), peakBlocks(0), totalAllocations(0), totalDeallocations(0), unknown("Unknown"),
+	dumpFile(nullptr), showAllAllocs(false), showAllDeallocs(false), dumpLeaksToFile(true),
+	leakFileName("memleaks.log"), heapDumpFileName(nullptr), sizeHistogramFileName(nullptr),
+	reachabilityLeakCheck(false), peakSnapshotThreshold(0.05f), detectContainerGrowth(false), reportThreads(0),
+	captureAllocationStacks(false), heapProfileFileName(nullptr), largeBlockThreshold(16 << 20),
+	largeBlockHugePages(false),
+#ifdef MEMORYANALYZER_PRELOAD
+	pauseOnExit(false)
+#else
+	pauseOnExit(true)
+#endif
+{
+	memset(&peakSnapshot, 0, sizeof(peakSnapshot));
+	LoadEnvironmentConfig();
 }
 
-void MemoryTracer::AddAllocationToList(size_t size, AllocationType type, void *ptr)
+MemoryTracer* MemoryTracer::Construct()
 {
-	MemInfoNode *head = GetListHead(type);
-	auto current = head;
-	// move through the list until the correct node is found (based on alloc size)
-	while(current && current->size != size)
+	int current = TRACER_UNCONSTRUCTED;
+	if(state.compare_exchange_strong(current, TRACER_CONSTRUCTING, memory_order_acquire))
 	{
-		current = current->next;
+		// whatever the constructor allocates (e.g. getenv, the sampler thread) goes around the tracer
+		constructingThread = true;
+		MemoryTracer *tracer = new(&tracerStorage) MemoryTracer;
+		atexit(ExitHandler);
+		instance = tracer;
+		constructingThread = false;
+		state.store(TRACER_READY, memory_order_release);
+		return tracer;
 	}
+	// another thread is constructing it; construction is short, so waiting for it is cheaper than anything else
+	while(current == TRACER_CONSTRUCTING && !constructingThread)
+	{
+		this_thread::yield();
+		current = state.load(memory_order_acquire);
+	}
+	return current == TRACER_READY ? instance : nullptr;
+}
 
-	auto addAddress = [&](void *newAddr, MemInfoNode **curMemNode)
+void MemoryTracer::ExitHandler()
+{
+	if(state.load(memory_order_acquire) == TRACER_READY)
 	{
-		AddrListNode *newAddrNode = static_cast<AddrListNode*>(malloc(sizeof(AddrListNode)));
-		// set the "next" pointer to the address the MemInfoNode is currently pointing to
-		newAddrNode->next = (*curMemNode)->addresses;
-		newAddrNode->address = newAddr;
-		// object type, file, and line # start out as unknown or 0; the information, if available, will be added
-		// through the use of the SourcePacket mechanism after the entire allocation is complete
-		newAddrNode->type = unknown;
-		newAddrNode->file = unknown;
-		newAddrNode->line = 0;
+		instance->WriteExitReport();
+	}
+}
 
-		// push the new node in the front of the address list of the mem node (ie, push_front)
-		(*curMemNode)->addresses = newAddrNode;
-		mostRecentAllocAddrNode = newAddrNode;
+void MemoryTracer::WriteExitReport()
+{
+	// the sampler thread has to be gone before the report is written (and its own allocations are still tracked)
+	StopSampler();
+	StopTimeline();
+
+	// other threads may still be allocating and freeing; the ones already past the READY check wait for the lock
+	// and then find the tracer finished (see RecordAllocation), so the records hold still until they are cleared
+	unique_lock<recursive_mutex> guard(tracerLock);
+	// anything allocated or freed from here on (including the leak file's buffer, and the destructors of static objects
+	// which run after this) goes around the tracer
+	state.store(TRACER_FINISHED, memory_order_release);
+	long long totalLeaks = 0;
+	size_t leakedMemory = currentMemory;
+	// when the reachability scan has already reported the leaks, the lists are only freed
+	bool listLeaks = true;
+
+	auto reportLeaks = [&]()
+	{
+		size_t length, blocks[2];
+		char *text = BuildBlockReport(REPORT_LEAKS, true, length, blocks);
+		if(!text)
+		{
+			return;
+		}
+		fwrite(text, 1, length, stdout);
+		if(dumpFile)
+		{
+			fwrite(text, 1, length, dumpFile);
+		}
+		totalLeaks += blocks[ALLOC_NEW] + blocks[ALLOC_NEW_ARRAY];
+		free(text);
 	};
+	// this is here to basically clear the file contents
+	remove( leakFileName );
+	if(dumpLeaksToFile)
+	{
+		dumpFile = fopen(leakFileName, "a");
+	}
 
-	// if we found a mem node with the correct size, just stick a new address node onto the list
-	if(current)
+	if(heapDumpFileName)
 	{
-		current->numberOfAllocations++;
-		addAddress(ptr, &current);
+		WriteHeapDump(heapDumpFileName);
 	}
-	// otherwise, create a mem node for the new size and then add the address to the list
-	else
+	if(sizeHistogramFileName)
+	{
+		ExportSizeHistogram(sizeHistogramFileName);
+	}
+	if(heapProfileFileName)
 	{
-		MemInfoNode *newMemNode = static_cast<MemInfoNode*>(malloc(sizeof(MemInfoNode)));
-		newMemNode->size = size;
-		newMemNode->numberOfAllocations = 1;
-		// set "next" to be the current head node
-		newMemNode->next = GetListHead(type);
-		newMemNode->addresses = nullptr;
+		ExportPprof(heapProfileFileName, captureAllocationStacks ? PROFILE_BY_STACK : PROFILE_BY_SITE);
+	}
 
-		addAddress(ptr, &newMemNode);
+	if(detectContainerGrowth && head_growthSites)
+	{
+		DisplayGrowthReport();
+	}
+	if(zoneCount)
+	{
+		DisplayNoAllocReport();
+	}
+	bool largeBlocksLeft;
+	{
+		lock_guard<mutex> blockGuard(largeBlockLock);
+		largeBlocksLeft = largeBlockCount != 0;
+	}
+	if(largeBlocksLeft)
+	{
+		DisplayLargeBlocks();
+	}
 
-		// stick the new MemInfoNode at the beginning of the list (ie, push_front)
-		if(type == ALLOC_NEW)
-		{
-			head_new = newMemNode;
-		}
-		else
+#ifdef __linux__
+	if(reachabilityLeakCheck)
+	{
+		// only blocks which can no longer be reached count as leaks; singletons, caches, etc. are left out
+		LeakScanSummary summary = ScanForLeaks(true);
+		// if the scan couldn't finish, every block is listed as usual
+		if(summary.completed)
 		{
-			head_new_array = newMemNode;
+			totalLeaks = summary.definitelyLostBlocks + summary.indirectlyLostBlocks;
+			leakedMemory = summary.definitelyLostBytes + summary.indirectlyLostBytes;
+			listLeaks = false;
 		}
 	}
+#endif
+
+	if(listLeaks)
+	{
+		reportLeaks();
+	}
+	liveRecords.Clear();
+	guard.unlock();
+
+	auto reportTotals = [&](FILE *file)
+	{
+		TraceWriter out(file);
+		out << "Total number of leaks found: " << totalLeaks << "\nTotal memory leaked: " << leakedMemory 
+			<< " bytes (" << leakedMemory / 1000. << " kilobytes / " << leakedMemory / 1000000. << " megabytes)\n";
+	};
+	reportTotals(stdout);
+	if(dumpFile)
+	{
+		reportTotals(dumpFile);
+		fclose(dumpFile);
+		dumpFile = nullptr;
+	}
+	if(pauseOnExit)
+	{
+		TraceWriter(stdout) << "\nPress any key twice to continue";
+		fflush(stdout);
+		getchar();
+		getchar();
+	}
 }
 
-void MemoryTracer::AddAllocationDetails(void *ptr, const char *file, int line, const char *type, size_t objectSize)
+void MemoryTracer::AddAllocationDetails(void *ptr, const char *file, int line, const char *type, size_t cookieSize)
 {
 	if(!ptr)
 		return;
 
-	if(mostRecentAllocAddrNode->address != ptr)
+	lock_guard<recursive_mutex> guard(tracerLock);
+	size_t row = liveRecords.Find(ptr);
+	if(row == static_cast<size_t>(-1))
 	{
-		mostRecentAllocAddrNode = RetrieveAddrNode(ptr, objectSize);
-		// if it returns null, it couldn't be found in the stored lists, possibly indicating some problem
-		// during allocation/construction
-		if(!mostRecentAllocAddrNode)
+		row = liveRecords.Find(static_cast<unsigned char*>(ptr) - cookieSize);
+		// if it still can't be found, the object wasn't allocated by the tracer (e.g., placement new into a buffer of
+		// its own), so there is nothing to detail
+		if(row == static_cast<size_t>(-1))
 		{
 			return;
 		}
 	}
+	// placement new into a block which was already detailed doesn't make it a second allocation
+	if(liveRecords.TypeId(row))
+	{
+		return;
+	}
 
-	mostRecentAllocAddrNode->file = file;
-	mostRecentAllocAddrNode->line = line;
-	mostRecentAllocAddrNode->type = type;
+	uint32_t typeId = InternType(type);
+	uint32_t siteId = InternSite(file, line);
+	// if the record can't hold the details, the block stays unknown everywhere
+	if(!liveRecords.SetDetails(row, typeId, siteId))
+	{
+		return;
+	}
+	// the block's size, rather than sizeof(T), so arrays are counted in full
+	size_t size = liveRecords.Size(row);
+	if(typeId)
+	{
+		typeTable[typeId]->blocks++;
+		typeTable[typeId]->memSize += size;
+	}
+	if(siteId)
+	{
+		siteTable[siteId]->blocks++;
+		siteTable[siteId]->memSize += size;
+	}
+	if(peakSnapshot.allocation && liveRecords.AllocationNumber(row) == peakSnapshot.allocation)
+	{
+		DetailPeakSnapshot(typeId, siteId, size);
+	}
+	ProfileDetails(row);
+	if(timelineRunning && typeId)
+	{
+		RecordTimelineEvent(TIMELINE_DETAILS, TypeName(typeId), liveRecords.AllocationNumber(row), size);
+	}
 }
 
-void MemoryTracer::AddToTypeList(const char *type, size_t size)
+uint32_t MemoryTracer::InternType(const char *type)
 {
-	TypeNode *temp_type = head_types;
-	while(temp_type && strcmp(temp_type->type, type))
+	// names come from TypeTag, so the same type almost always has the same pointer
+	long long *knownId = typeIds.Find(reinterpret_cast<uintptr_t>(type), 0);
+	if(knownId)
 	{
-		temp_type = temp_type->next;
+		return static_cast<uint32_t>(*knownId);
 	}
-	if(temp_type)
+
+	uint32_t id = 0;
+	for(size_t i = 1; i <= typeCount && !id; i++)
 	{
-		temp_type->blocks++;
-		temp_type->memSize += size;
+		if(!strcmp(typeTable[i]->type, type))
+		{
+			id = static_cast<uint32_t>(i);
+		}
 	}
-	else
+	if(!id)
 	{
 		TypeNode *newType = static_cast<TypeNode*>(malloc(sizeof(TypeNode)));
+		if(!newType || !GrowArray(typeTable, typeTableCapacity, typeCount + 2))
+		{
+			free(newType);
+			return 0;
+		}
+		new(newType) TypeNode;
 		newType->type = type;
-		newType->blocks = 1;
-		newType->memSize = size;
+		newType->blocks = 0;
+		newType->memSize = 0;
 		newType->next = head_types;
+		newType->nextRegistered = typeRegistry;
+		newType->group = 0;
 		head_types = newType;
+		id = static_cast<uint32_t>(++typeCount);
+		typeTable[id] = newType;
+		// publish the node only once it is filled in
+		typeRegistry.store(newType, memory_order_release);
 	}
+	typeIds.FindOrAdd(reinterpret_cast<uintptr_t>(type), 0, id);
+	return id;
+}
+
+uint32_t MemoryTracer::InternSite(const char *file, int line)
+{
+	long long *knownId = siteIds.Find(reinterpret_cast<uintptr_t>(file), line);
+	if(knownId)
+	{
+		return static_cast<uint32_t>(*knownId);
+	}
+
+	// the same file can be named through different pointers (one per translation unit which uses __FILE__)
+	uint32_t id = 0;
+	for(size_t i = 1; i <= siteCount && !id; i++)
+	{
+		if(siteTable[i]->line == line && !strcmp(siteTable[i]->file, file))
+		{
+			id = static_cast<uint32_t>(i);
+		}
+	}
+	if(!id)
+	{
+		SiteNode *newSite = static_cast<SiteNode*>(malloc(sizeof(SiteNode)));
+		if(!newSite || !GrowArray(siteTable, siteTableCapacity, siteCount + 2))
+		{
+			free(newSite);
+			return 0;
+		}
+		newSite->file = file;
+		newSite->line = line;
+		newSite->blocks = 0;
+		newSite->memSize = 0;
+		newSite->next = head_sites;
+		head_sites = newSite;
+		id = static_cast<uint32_t>(++siteCount);
+		siteTable[id] = newSite;
+	}
+	siteIds.FindOrAdd(reinterpret_cast<uintptr_t>(file), line, id);
+	return id;
 }
 
 void* MemoryTracer::Allocate(size_t size, AllocationType type, bool throwEx)
 {
-	// cast necessary since this is C++ (note the additional bytes for the header)
-	unsigned char *ptr = static_cast<unsigned char*>(malloc(size + sizeof(AllocationHeader)));
+	// cast necessary since this is C++ (note the additional bytes for the header); unless the program has selected
+	// another allocator for this thread, this is a plain malloc
+	BackingAllocator *backend = BackingAllocator::GetCurrent();
+#ifndef _WIN32
+	if(largeBlockThreshold && size >= largeBlockThreshold && !backend)
+	{
+		return AllocateLarge(size, type, throwEx);
+	}
+#endif
+	unsigned char *ptr = static_cast<unsigned char*>(BackingAllocator::AllocateFrom(backend,
+		size + sizeof(AllocationHeader)));
 	// if there was a problem getting memory, either throw an exception or nullptr depending on what version of new
 	// was used
 	if(!ptr)
 	{
 		if(throwEx)
 		{
-			throw std::bad_alloc("Failed to acquire memory.\n");
+			throw std::bad_alloc();
 		}
 		else
 		{
@@ -212,258 +423,359 @@ void* MemoryTracer::Allocate(size_t size, AllocationType type, bool throwEx)
 	AllocationHeader *header = reinterpret_cast<AllocationHeader*>(ptr);
 	header->rawSize = size;
 	header->type = type;
+	header->backend = backend ? backend->GetIndex() : 0;
+	header->grown = false;
+	header->tracked = true;
 
+	lock_guard<recursive_mutex> guard(tracerLock);
 	// only store the address of the memory we give to the user, not the (header + the mem) address, since they will 
 	// release it with that address
-	AddAllocationToList(size, type, ptr + sizeof(AllocationHeader));
+	if(!RecordAllocation(ptr + sizeof(AllocationHeader), header, true))
+	{
+		// a block the tracer has no record of couldn't be freed through it either
+		BackingAllocator::DeallocateFrom(header->backend, header, size + sizeof(AllocationHeader));
+		if(throwEx)
+		{
+			throw std::bad_alloc();
+		}
+		return nullptr;
+	}
+	return ptr + sizeof(AllocationHeader);
+}
+
+bool MemoryTracer::RecordAllocation(void *ptr, AllocationHeader *header, bool headerInBlock)
+{
+	// a thread which was already on its way in when the exit report started leaves the block untracked, since the
+	// records are gone once the report has been written
+	if(state.load(memory_order_relaxed) != TRACER_READY)
+	{
+		header->tracked = false;
+		header->thread = 0;
+		return true;
+	}
+	size_t size = header->rawSize;
+	AllocationType type = static_cast<AllocationType>(header->type);
+	size_t row = liveRecords.Add(ptr, size, type, totalAllocations + 1);
+	if(row == static_cast<size_t>(-1))
+	{
+		return false;
+	}
+	long long *sizeCount = sizeCounts.FindOrAdd(size, type, 0);
+	if(sizeCount)
+	{
+		(*sizeCount)++;
+	}
+	// the frames between here and the program: Allocate and the operator, and AllocateLarge for large blocks
+	int callerFrames = headerInBlock ? 2 : 3;
+	ProfileAllocation(row, callerFrames);
+	CountThreadAllocation(header);
+	if(openEpochs)
+	{
+		LogEpochAllocation(row, header->thread);
+	}
+	// growth steps are marked in the blocks' headers, which large blocks don't have
+	if(detectContainerGrowth && headerInBlock)
+	{
+		TrackGrowthOnAllocate(header);
+	}
 
 	// update stats
+	totalAllocations++;
 	currentBlocks++;
 	if(currentBlocks > peakBlocks)
 	{
-		peakBlocks = currentBlocks;
+		peakBlocks = currentBlocks.load();
 	}
 	currentMemory += size;
 	if(currentMemory > peakMemory)
 	{
-		peakMemory = currentMemory;
+		peakMemory = currentMemory.load();
+		// copying the composition at every new peak would be far too slow, so it is only done when the peak has grown
+		// noticeably since the last copy
+		if(peakMemory >= nextPeakSnapshot)
+		{
+			CapturePeakSnapshot();
+		}
+	}
+	// each spill walks the cold records' pages, so it is only done every 256K allocations
+	if(residentRecordLimit && !runningSnapshots && !(totalAllocations & 0x3FFFF))
+	{
+		liveRecords.SpillColdRecords(residentRecordLimit);
+	}
+	if(timelineRunning)
+	{
+		RecordTimelineEvent(TIMELINE_ALLOCATION, nullptr, totalAllocations, size);
+	}
+
+	// when no zone is active, this is the only cost of no-alloc zones
+	NoAllocZone *zone = NoAllocZone::current;
+	if(zone)
+	{
+		RecordNoAllocViolation(zone, size, type, callerFrames);
 	}
 
 	if(showAllAllocs)
 	{
-		cout << "Allocation >\n\tSize: " <<  size << "\n\tAlloc Type: " << GetAllocTypeAsString(type) << "\n\n";
+		TraceWriter(stdout) << "Allocation >\n\tSize: " <<  size << "\n\tAlloc Type: " << GetAllocTypeAsString(type)
+			<< "\n\n";
 	}
-	return ptr + sizeof(AllocationHeader);
+	return true;
 }
 
-void MemoryTracer::Deallocate(void *ptr, AllocationType type, bool throwEx)
+void MemoryTracer::Deallocate(void *ptr, AllocationType type, bool)
 {
 	// nothing happens if a nullptr is passed in
 	if(ptr)
 	{
+#ifndef _WIN32
+		// large blocks have no header in front of them (the page before may not even be mapped), so page-aligned
+		// pointers are looked up among them first
+		if(!(reinterpret_cast<uintptr_t>(ptr) & (minimumPageSize - 1)) && DeallocateLarge(ptr, type, true))
+		{
+			return;
+		}
+#endif
 		unsigned char *rawPtr = static_cast<unsigned char*>(ptr);
 		AllocationHeader *header = reinterpret_cast<AllocationHeader*>(rawPtr - sizeof(AllocationHeader));
-		if(showAllDeallocs)
+		// allocated while the tracer was being constructed
+		if(!header->tracked)
 		{
-			cout << "Deallocation >\n\tSize: " <<  header->rawSize << "\n\tAlloc Type: " 
-				<< GetAllocTypeAsString(header->type);
+			DeallocateUntracked(ptr);
+			return;
 		}
-		RemoveAllocationFromList(ptr, type);
-		currentMemory -= header->rawSize;
-		currentBlocks--;
-		// free the header address, since that points to the block originally alloc'd through malloc
-		free(header);
+		lock_guard<recursive_mutex> guard(tracerLock);
+		RecordDeallocation(ptr, type, header, true);
+		// free the header address, since that points to the block originally alloc'd through malloc (or the backend)
+		BackingAllocator::DeallocateFrom(header->backend, header, header->rawSize + sizeof(AllocationHeader));
 	}
 }
 
-const char* MemoryTracer::GetAllocTypeAsString(AllocationType type)
+void MemoryTracer::RecordDeallocation(void *ptr, AllocationType type, AllocationHeader *header, bool headerInBlock)
 {
-	return type == ALLOC_NEW ? "non-array" : "array";
+	// as in RecordAllocation, the records may already be gone
+	if(state.load(memory_order_relaxed) != TRACER_READY)
+	{
+		return;
+	}
+	if(showAllDeallocs)
+	{
+		TraceWriter(stdout) << "Deallocation >\n\tSize: " <<  header->rawSize << "\n\tAlloc Type: " 
+			<< GetAllocTypeAsString(static_cast<AllocationType>(header->type));
+	}
+	RemoveAllocationFromList(ptr, type);
+	CountThreadDeallocation(header);
+	if(detectContainerGrowth && headerInBlock)
+	{
+		TrackGrowthOnDeallocate(header);
+	}
+	currentMemory -= header->rawSize;
+	currentBlocks--;
+	totalDeallocations++;
 }
 
-MemoryTracer::MemInfoNode* MemoryTracer::GetListHead(AllocationType type)
+void* MemoryTracer::AllocateUntracked(size_t size, AllocationType type, bool throwEx)
 {
-	return type == ALLOC_NEW ? head_new : head_new_array;
+	unsigned char *ptr = static_cast<unsigned char*>(malloc(size + sizeof(AllocationHeader)));
+	if(!ptr)
+	{
+		if(throwEx)
+		{
+			throw std::bad_alloc();
+		}
+		return nullptr;
+	}
+	AllocationHeader *header = reinterpret_cast<AllocationHeader*>(ptr);
+	header->rawSize = size;
+	header->type = type;
+	header->backend = 0;
+	header->grown = false;
+	header->tracked = false;
+	header->thread = 0;
+	return ptr + sizeof(AllocationHeader);
 }
 
-void MemoryTracer::RemoveAllocationFromList(void *ptr, AllocationType type)
+void MemoryTracer::DeallocateUntracked(void *ptr)
 {
-	MemInfoNode *head = GetListHead(type);
-	unsigned char *rawPtr = static_cast<unsigned char*>(ptr);
-	// get the header address by moving backwards by the size of the header (it's always contiguous)
-	AllocationHeader *header = reinterpret_cast<AllocationHeader*>(rawPtr - sizeof(AllocationHeader));
-	size_t size = header->rawSize;
-
-	auto current = head;
-	// find the mem node whose size matches the pointer size
-	while(current && current->size != size)
+	if(ptr)
 	{
-		current = current->next;
+#ifndef _WIN32
+		// large blocks freed after the exit report still have to be unmapped
+		if(instance && !(reinterpret_cast<uintptr_t>(ptr) & (minimumPageSize - 1))
+			&& instance->DeallocateLarge(ptr, ALLOC_NEW, false))
+		{
+			return;
+		}
+#endif
+		AllocationHeader *header = reinterpret_cast<AllocationHeader*>(static_cast<unsigned char*>(ptr)
+			- sizeof(AllocationHeader));
+		BackingAllocator::DeallocateFrom(header->backend, header, header->rawSize + sizeof(AllocationHeader));
 	}
-	// make sure there was actually a node with that size
-	assert(current);
+}
 
-	auto addressNode = current->addresses;
-	AddrListNode *prevAddressNode = nullptr;
-	// make sure there was at least one address listed under the mem info node
-	assert(addressNode);
-	// and then find the matching address node
-	while(addressNode && addressNode->address != ptr)
+void MemoryTracer::LoadEnvironmentConfig()
+{
+	showAllAllocs = EnvFlag("MEMANALYZER_SHOW_ALLOCS", showAllAllocs);
+	showAllDeallocs = EnvFlag("MEMANALYZER_SHOW_DEALLOCS", showAllDeallocs);
+	dumpLeaksToFile = EnvFlag("MEMANALYZER_DUMP_LEAKS", dumpLeaksToFile);
+	pauseOnExit = EnvFlag("MEMANALYZER_PAUSE_ON_EXIT", pauseOnExit);
+	const char *threshold = getenv("MEMANALYZER_PEAK_THRESHOLD");
+	if(threshold && *threshold)
+	{
+		peakSnapshotThreshold = static_cast<float>(atof(threshold));
+	}
+	reachabilityLeakCheck = EnvFlag("MEMANALYZER_REACHABILITY", reachabilityLeakCheck);
+	detectContainerGrowth = EnvFlag("MEMANALYZER_GROWTH", detectContainerGrowth);
+	captureAllocationStacks = EnvFlag("MEMANALYZER_PROFILE_STACKS", captureAllocationStacks);
+	largeBlockHugePages = EnvFlag("MEMANALYZER_HUGE_PAGES", largeBlockHugePages);
+	const char *threads = getenv("MEMANALYZER_REPORT_THREADS");
+	if(threads && *threads)
 	{
-		prevAddressNode = addressNode;
-		addressNode = addressNode->next;
+		reportThreads = static_cast<unsigned int>(atoi(threads));
+	}
+	const char *largeSize = getenv("MEMANALYZER_LARGE_BLOCKS");
+	if(largeSize && *largeSize)
+	{
+		largeBlockThreshold = static_cast<size_t>(strtoull(largeSize, nullptr, 10));
 	}
-	// make sure the address attempting to be freed was actually created
-	assert(addressNode);
 
-	// if prevAddressNode is non-null, it means the discovered node wasn't the first one
-	// in either case, update the links to remove the address node from the list
-	if(prevAddressNode)
+	const char *fileName = getenv("MEMANALYZER_LEAK_FILE");
+	if(fileName && *fileName)
 	{
-		prevAddressNode->next = addressNode->next;
+		leakFileName = fileName;
 	}
-	else
+	fileName = getenv("MEMANALYZER_HEAP_DUMP");
+	if(fileName && *fileName)
 	{
-		current->addresses = addressNode->next;
+		heapDumpFileName = fileName;
+	}
+	fileName = getenv("MEMANALYZER_SIZE_HISTOGRAM");
+	if(fileName && *fileName)
+	{
+		sizeHistogramFileName = fileName;
+	}
+	fileName = getenv("MEMANALYZER_HEAP_PROFILE");
+	if(fileName && *fileName)
+	{
+		heapProfileFileName = fileName;
 	}
 
-	if(showAllDeallocs)
+#ifdef __linux__
+	fileName = getenv("MEMANALYZER_SPILL_FILE");
+	if(fileName && *fileName)
 	{
-		cout << "\n\tObject Type: " << addressNode->type << "\n\tFile: " << addressNode->file 
-			<< "\n\tLine: " << addressNode->line << "\n\n";
+		const char *resident = getenv("MEMANALYZER_RESIDENT_RECORDS");
+		EnableRecordSpilling(fileName, resident && *resident ? strtoull(resident, nullptr, 10) : 1 << 20);
 	}
-	if(addressNode->type != unknown)
+#endif
+	fileName = getenv("MEMANALYZER_TIMELINE");
+	if(fileName && *fileName)
 	{
-		RemoveFromTypeList(addressNode->type, current->size);
+		StartTimeline(fileName);
 	}
-	free(addressNode);
-	current->numberOfAllocations--;
-}
 
-void MemoryTracer::RemoveFromTypeList(const char *type, size_t size)
-{
-	TypeNode *temp_type = head_types;
-	while(temp_type && strcmp(temp_type->type, type))
+#ifndef _WIN32
+	fileName = getenv("MEMANALYZER_SNAPSHOT_PREFIX");
+	if(fileName && *fileName)
 	{
-		temp_type = temp_type->next;
+		EnableHeapSnapshots(fileName);
 	}
-	assert(temp_type);
-	temp_type->blocks--;
-	temp_type->memSize -= size;
+#endif
 }
 
-MemoryTracer::AddrListNode* MemoryTracer::RetrieveAddrNode(void *ptr, size_t objectSize)
+const char* MemoryTracer::GetAllocTypeAsString(AllocationType type)
 {
-	AddrListNode *temp_addr = nullptr;
-	auto addressFind = [&](MemInfoNode *head) -> bool
+	return type == ALLOC_NEW ? "non-array" : "array";
+}
+
+void MemoryTracer::RemoveAllocationFromList(void *ptr, AllocationType type)
+{
+	size_t row = liveRecords.Find(ptr);
+	// make sure the address attempting to be freed was actually created, and with the matching form of new
+	assert(row != static_cast<size_t>(-1));
+	if(row == static_cast<size_t>(-1))
 	{
-		MemInfoNode *temp_mem = head;
-		// if we don't know the size, just iterate through the lists
-		if(objectSize == -1)
-		{
-			while(temp_mem)
-			{
-				temp_addr = temp_mem->addresses;
-				// move down the address list until it's null or the address matches
-				while(temp_addr && temp_addr->address != ptr)
-				{
-					temp_addr = temp_addr->next;
-				}
-				// if it stopped on a non-null addr node and it matches the address, return it
-				if(temp_addr && temp_addr->address == ptr)
-				{
-					return true;
-				}
-				// otherwise, move to the next size
-				temp_mem = temp_mem->next;
-			}
-		}
-		// but if we do know the size, skip through the memory nodes until we find the correct size
-		else
-		{
-			for( ; temp_mem && temp_mem->size != objectSize; temp_mem = temp_mem->next);
-			if(temp_mem)
-			{
-				temp_addr = temp_mem->addresses;
-				while(temp_addr && temp_addr->address != ptr)
-				{
-					temp_addr = temp_addr->next;
-				}
-				if(temp_addr && temp_addr->address == ptr)
-				{
-					return true;
-				}
-			}
-		}
-		return false;
-	};
+		return;
+	}
+	assert(liveRecords.AllocType(row) == type);
 
-	if(addressFind(head_new))
+	uint32_t typeId = liveRecords.TypeId(row);
+	uint32_t siteId = liveRecords.SiteId(row);
+	size_t size = liveRecords.Size(row);
+	if(showAllDeallocs)
+	{
+		TraceWriter(stdout) << "\n\tObject Type: " << TypeName(typeId) << "\n\tFile: " << SiteFile(siteId) 
+			<< "\n\tLine: " << SiteLine(siteId) << "\n\n";
+	}
+	if(typeId)
 	{
-		return temp_addr;
+		typeTable[typeId]->blocks--;
+		typeTable[typeId]->memSize -= size;
 	}
-	else if(addressFind(head_new_array))
+	if(siteId)
 	{
-		return temp_addr;
+		siteTable[siteId]->blocks--;
+		siteTable[siteId]->memSize -= size;
 	}
-	return nullptr;
+	ProfileDeallocation(row);
+	if(timelineRunning)
+	{
+		RecordTimelineEvent(TIMELINE_FREE, typeId ? TypeName(typeId) : nullptr, liveRecords.AllocationNumber(row),
+			size);
+	}
+	liveRecords.Remove(row);
 }
 
-size_t MemoryTracer::RetrieveAddrSize(void *ptr)
+void MemoryTracer::DisplayAllocations(bool displayNumberOfAllocsFirst, bool displayDetail)
 {
-	auto sizeFind = [=](MemInfoNode *head) -> size_t
+	lock_guard<recursive_mutex> guard(tracerLock);
+	// reports don't allocate through the tracer, so they can't change what they report on
+	long long allocationsBefore = totalAllocations;
+	size_t length, blocks[2];
+	char *text = BuildBlockReport(displayNumberOfAllocsFirst ? REPORT_COUNT_FIRST : REPORT_SIZE_FIRST, displayDetail,
+		length, blocks);
+	if(!text)
 	{
-		while(head)
-		{
-			AddrListNode *temp_addr = head->addresses;
-			// move down the address list until it's null or the address matches
-			while(temp_addr && temp_addr->address != ptr)
-			{
-				temp_addr = temp_addr->next;
-			}
-			// if it stopped on a non-null addr node and it matches the address, return it
-			if(temp_addr && temp_addr->address == ptr)
-			{
-				return head->size;
-			}
-			// otherwise, move to the next size
-			head = head->next;
-		}
-		// node wasn't found
-		return 0;
-	};
-
-	size_t size = sizeFind(head_new);
-	if(size)
-	{
-		return size;
+		return;
 	}
-	size = sizeFind(head_new_array);
-	// if size was found, return it, otherwise return -1 to indicate failure
-	return (size ? size : -1);
+	TraceWriter out(stdout);
+	out.Write(text, length);
+	free(text);
+	
+	out << "\nTotal allocations: " << blocks[ALLOC_NEW] + blocks[ALLOC_NEW_ARRAY] << " (" << blocks[ALLOC_NEW]
+		<< " non-array, " << blocks[ALLOC_NEW_ARRAY] << " array)\n\n";
+	out.Flush();
+	assert(totalAllocations == allocationsBefore);
 }
 
-void MemoryTracer::DisplayAllocations(bool displayNumberOfAllocsFirst, bool displayDetail)
+bool MemoryTracer::ExportSizeHistogram(const char *fileName)
 {
-	int totalAllocsNew = 0, totalAllocsNewArray = 0;
-	auto DisplayAllocs = [=](MemInfoNode *head, AllocationType type, int &allocTotal)
+	FILE *file = fopen(fileName, "w");
+	if(!file)
 	{
-		for(MemInfoNode *temp = head; temp; temp = temp->next)
+		return false;
+	}
+	lock_guard<recursive_mutex> guard(tracerLock);
+	{
+		TraceWriter out(file);
+		out << "# block size (including the " << sizeof(AllocationHeader) << "-byte header), number of allocations\n";
+		sizeCounts.ForEach([&out](uintptr_t size, int, long long count)
 		{
-			// check if there are any current allocations for the current block size
-			if(temp->numberOfAllocations != 0)
-			{
-				cout << "\t";
-				if(displayNumberOfAllocsFirst)
-				{
-					cout << temp->numberOfAllocations << "\tallocation(s) of size: " << temp->size;
-				}
-				else
-				{
-					cout << "Size: " << temp->size << "\t# of allocations: " << temp->numberOfAllocations;
-				}
-				allocTotal += temp->numberOfAllocations;
-				if(displayDetail)
-				{
-					for(auto addrNode = temp->addresses; addrNode; addrNode = addrNode->next)
-					{
-						cout << "\n\tAddress: 0x" << addrNode->address << "  File: " << addrNode->file 
-							<< "  Line: " << addrNode->line;
-					}
-				}
-				cout << "\n";
-			}
-		}
-	};
-
-	cout << "<<Non-array allocations>>\n";
-	DisplayAllocs(head_new, ALLOC_NEW, totalAllocsNew);
+			out << size + sizeof(AllocationHeader) << " " << count << "\n";
+		});
+	}
+	bool ok = !ferror(file);
+	return fclose(file) == 0 && ok;
+}
 
-	cout << "\n<<Array allocations>>\n";
-	DisplayAllocs(head_new_array, ALLOC_NEW_ARRAY, totalAllocsNewArray);
-	
-	cout << "\nTotal allocations: " << totalAllocsNew + totalAllocsNewArray << " (" << totalAllocsNew 
-		<< " non-array, " << totalAllocsNewArray << " array)\n\n";
+const char* MemoryTracer::ShortTypeName(const char *name, char *buffer)
+{
+	if(strlen(name) <= maxTypeNameLength)
+	{
+		return name;
+	}
+	memcpy(buffer, name, maxTypeNameLength - 3);
+	strcpy(buffer + maxTypeNameLength - 3, "...");
+	return buffer;
 }
 
 void MemoryTracer::DisplayStatTable()
@@ -599,37 +911,116 @@ void MemoryTracer::DisplayStatTable()
 		}
 	};
 
-	cout << left << setw(32) << "Object Type" 
-		<< setw(12) << "Blocks" 
-		<< setw(8) << "%"
-		<< setw(12) << "Memory" 
-		<< setw(5) << "%";
-	cout << "\n====================================================================";
+	lock_guard<recursive_mutex> guard(tracerLock);
+	long long allocationsBefore = totalAllocations;
 
-	head_types = sortList(head_types);
-	auto head = head_types;
-	while(head)
+	// with a grouping, the rows are the groups, sorted through a list of their numbers since those have to stay put
+	uint32_t *groupOrder = nullptr;
+	size_t groupRows = 0;
+	if(typeGrouping != GROUP_BY_TYPE || typeGroupRuleCount)
+	{
+		TotalTypeGroups();
+		groupOrder = static_cast<uint32_t*>(malloc((typeGroupCount + 1) * sizeof(uint32_t)));
+	}
+	if(groupOrder)
+	{
+		for(size_t i = 1; i <= typeGroupCount; i++)
+		{
+			if(typeGroups[i].blocks > 0)
+			{
+				groupOrder[groupRows++] = static_cast<uint32_t>(i);
+			}
+		}
+		sort(groupOrder, groupOrder + groupRows, [this](uint32_t a, uint32_t b)
+		{
+			return typeGroups[a].memSize > typeGroups[b].memSize;
+		});
+	}
+	else
+	{
+		head_types = sortList(head_types);
+	}
+
+	// the name column is as wide as the longest name shown (but at least the 32 characters it always had), and names
+	// longer than maxTypeNameLength are cut short
+	size_t nameColumn = 30;
+	for(size_t i = 0; i < groupRows; i++)
+	{
+		nameColumn = max(nameColumn, min(strlen(typeGroups[groupOrder[i]].name), maxTypeNameLength));
+	}
+	for(TypeNode *head = groupOrder ? nullptr : head_types; head; head = head->next)
 	{
 		if(head->blocks > 0)
 		{
-			float memPercent = (static_cast<float>(head->memSize) / static_cast<float>(currentMemory)) * 100;
-			float blockPercent = (static_cast<float>(head->blocks) / static_cast<float>(currentBlocks)) * 100;
-
-			cout << "\n" << left << setfill('.') << setw(32) << head->type 
-				<< setw(12) << head->blocks 
-				<< setw(8) << fixed << setprecision(1) << blockPercent
-				<< setw(12) << head->memSize
-				<< setw(5) << setfill(' ') << fixed << setprecision(1) << memPercent;
+			nameColumn = max(nameColumn, min(strlen(head->type), maxTypeNameLength));
 		}
-		head = head->next;
 	}
-	cout << "\n\n";
+	nameColumn += 2;
+
+	TraceWriter out(stdout);
+	out << TraceWriter::Width(static_cast<int>(nameColumn)) << "Object Type" 
+		<< TraceWriter::Width(12) << "Blocks" 
+		<< TraceWriter::Width(8) << "%"
+		<< TraceWriter::Width(12) << "Memory" 
+		<< TraceWriter::Width(5) << "%";
+	out << "\n";
+	for(size_t i = 0; i < nameColumn + 36; i++)
+	{
+		out << '=';
+	}
+	auto displayRow = [&](const char *name, long blocks, size_t memSize)
+	{
+		float memPercent = (static_cast<float>(memSize) / static_cast<float>(currentMemory)) * 100;
+		float blockPercent = (static_cast<float>(blocks) / static_cast<float>(currentBlocks)) * 100;
+		char shortName[maxTypeNameLength + 1];
+		out << "\n" << TraceWriter::Width(static_cast<int>(nameColumn), '.') << ShortTypeName(name, shortName) 
+			<< TraceWriter::Width(12, '.') << blocks 
+			<< TraceWriter::Width(8, '.') << TraceWriter::Fixed(blockPercent, 1)
+			<< TraceWriter::Width(12, '.') << memSize
+			<< TraceWriter::Width(5) << TraceWriter::Fixed(memPercent, 1);
+	};
+	for(size_t i = 0; i < groupRows; i++)
+	{
+		const TypeGroupNode &group = typeGroups[groupOrder[i]];
+		displayRow(group.name, group.blocks, group.memSize);
+	}
+	for(TypeNode *head = groupOrder ? nullptr : head_types; head; head = head->next)
+	{
+		if(head->blocks > 0)
+		{
+			displayRow(head->type, head->blocks, head->memSize);
+		}
+	}
+	free(groupOrder);
+	out << "\n\n";
+	out.Flush();
+
+	DisplayPeakComposition();
+	if(threadCount > 1)
+	{
+		DisplayThreadStats();
+	}
+	assert(totalAllocations == allocationsBefore);
 }
 
+#ifdef __linux__
+bool MemoryTracer::EnableRecordSpilling(const char *fileName, size_t residentRecords)
+{
+	lock_guard<recursive_mutex> guard(tracerLock);
+	if(!liveRecords.SpillToFile(fileName))
+	{
+		return false;
+	}
+	residentRecordLimit = max<size_t>(residentRecords, 1);
+	return true;
+}
+#endif
+
 MemoryTracer& MemoryTracer::Get()
 {
-	static MemoryTracer mmgr;
-	return mmgr;
+	// constructed on first use, so nothing runs at load time (important when preloaded into another process)
+	Instance();
+	return *reinterpret_cast<MemoryTracer*>(&tracerStorage);
 }
 
 long long MemoryTracer::GetCurrentBlocks()
@@ -658,47 +1049,112 @@ void MemoryTracer::HeapCheck()
 	switch(_heapchk())
 	{
 	case _HEAPOK:
-		cout << "OK - heap is fine.\n";
+		TraceWriter(stdout) << "OK - heap is fine.\n";
 		break;
 	case _HEAPEMPTY:
-		cout << "OK - heap is empty.\n";
+		TraceWriter(stdout) << "OK - heap is empty.\n";
 		break;
 	case _HEAPBADBEGIN:
-		cout << "ERROR - bad start of heap.\n";
+		TraceWriter(stdout) << "ERROR - bad start of heap.\n";
 		break;
 	case _HEAPBADNODE:
-		cout << "ERROR - bad node in heap.\n";
+		TraceWriter(stdout) << "ERROR - bad node in heap.\n";
 		break;
 	}
 }
 #endif
 
 
+// The address operator new or delete returns to, i.e., the call site in the program (or the standard library)
+#ifdef _WIN32
+#define CALLER_ADDRESS() _ReturnAddress()
+#else
+#define CALLER_ADDRESS() __builtin_return_address(0)
+#endif
+
+
 // Non-array versions
 
 // exception version
 void* operator new(size_t size)
 {
-	return MemoryTracer::Get().Allocate(size, ALLOC_NEW, true);
+	MemoryTracer *tracer = MemoryTracer::Instance();
+	if(!tracer)
+	{
+		return MemoryTracer::AllocateUntracked(size, ALLOC_NEW, true);
+	}
+	if(tracer->detectContainerGrowth)
+	{
+		MemoryTracer::growthCaller = CALLER_ADDRESS();
+	}
+	return tracer->Allocate(size, ALLOC_NEW, true);
 }
 
 // non-exception version
 void* operator new(size_t size, const std::nothrow_t&)
 {
-	return MemoryTracer::Get().Allocate(size, ALLOC_NEW);
+	MemoryTracer *tracer = MemoryTracer::Instance();
+	if(!tracer)
+	{
+		return MemoryTracer::AllocateUntracked(size, ALLOC_NEW);
+	}
+	if(tracer->detectContainerGrowth)
+	{
+		MemoryTracer::growthCaller = CALLER_ADDRESS();
+	}
+	return tracer->Allocate(size, ALLOC_NEW);
 }
 
 // exception version
 void operator delete(void *ptr)
 {
-	MemoryTracer::Get().Deallocate(ptr, ALLOC_NEW, true);
+	MemoryTracer *tracer = MemoryTracer::Instance();
+	if(!tracer)
+	{
+		MemoryTracer::DeallocateUntracked(ptr);
+		return;
+	}
+	if(tracer->detectContainerGrowth)
+	{
+		MemoryTracer::growthCaller = CALLER_ADDRESS();
+	}
+	tracer->Deallocate(ptr, ALLOC_NEW, true);
 }
 
 // non-exception version
 void operator delete(void *ptr, const std::nothrow_t&)
 {
-	MemoryTracer::Get().Deallocate(ptr, ALLOC_NEW);
+	MemoryTracer *tracer = MemoryTracer::Instance();
+	if(!tracer)
+	{
+		MemoryTracer::DeallocateUntracked(ptr);
+		return;
+	}
+	if(tracer->detectContainerGrowth)
+	{
+		MemoryTracer::growthCaller = CALLER_ADDRESS();
+	}
+	tracer->Deallocate(ptr, ALLOC_NEW);
+}
+
+#ifdef __cpp_sized_deallocation
+// sized version, which C++14 code (the standard library's containers included) calls when the size is known; it
+// doesn't forward to the unsized one, so growth detection still sees the real caller
+void operator delete(void *ptr, size_t)
+{
+	MemoryTracer *tracer = MemoryTracer::Instance();
+	if(!tracer)
+	{
+		MemoryTracer::DeallocateUntracked(ptr);
+		return;
+	}
+	if(tracer->detectContainerGrowth)
+	{
+		MemoryTracer::growthCaller = CALLER_ADDRESS();
+	}
+	tracer->Deallocate(ptr, ALLOC_NEW, true);
 }
+#endif
 
 
 // Array versions
@@ -706,23 +1162,79 @@ void operator delete(void *ptr, const std::nothrow_t&)
 // exception version
 void* operator new[](size_t size)
 {
-	return MemoryTracer::Get().Allocate(size, ALLOC_NEW_ARRAY, true);
+	MemoryTracer *tracer = MemoryTracer::Instance();
+	if(!tracer)
+	{
+		return MemoryTracer::AllocateUntracked(size, ALLOC_NEW_ARRAY, true);
+	}
+	if(tracer->detectContainerGrowth)
+	{
+		MemoryTracer::growthCaller = CALLER_ADDRESS();
+	}
+	return tracer->Allocate(size, ALLOC_NEW_ARRAY, true);
 }
 
 // non-exception version
 void* operator new[](size_t size, const std::nothrow_t&)
 {
-	return MemoryTracer::Get().Allocate(size, ALLOC_NEW_ARRAY);
+	MemoryTracer *tracer = MemoryTracer::Instance();
+	if(!tracer)
+	{
+		return MemoryTracer::AllocateUntracked(size, ALLOC_NEW_ARRAY);
+	}
+	if(tracer->detectContainerGrowth)
+	{
+		MemoryTracer::growthCaller = CALLER_ADDRESS();
+	}
+	return tracer->Allocate(size, ALLOC_NEW_ARRAY);
 }
 
 // exception version
 void operator delete[](void *ptr)
 {
-	MemoryTracer::Get().Deallocate(ptr, ALLOC_NEW_ARRAY, true);
+	MemoryTracer *tracer = MemoryTracer::Instance();
+	if(!tracer)
+	{
+		MemoryTracer::DeallocateUntracked(ptr);
+		return;
+	}
+	if(tracer->detectContainerGrowth)
+	{
+		MemoryTracer::growthCaller = CALLER_ADDRESS();
+	}
+	tracer->Deallocate(ptr, ALLOC_NEW_ARRAY, true);
 }
 
 // non-exception version
 void operator delete[](void *ptr, const std::nothrow_t&)
 {
-	MemoryTracer::Get().Deallocate(ptr, ALLOC_NEW_ARRAY);
-}
\ No newline at end of file
+	MemoryTracer *tracer = MemoryTracer::Instance();
+	if(!tracer)
+	{
+		MemoryTracer::DeallocateUntracked(ptr);
+		return;
+	}
+	if(tracer->detectContainerGrowth)
+	{
+		MemoryTracer::growthCaller = CALLER_ADDRESS();
+	}
+	tracer->Deallocate(ptr, ALLOC_NEW_ARRAY);
+}
+
+#ifdef __cpp_sized_deallocation
+// sized version (see the non-array one)
+void operator delete[](void *ptr, size_t)
+{
+	MemoryTracer *tracer = MemoryTracer::Instance();
+	if(!tracer)
+	{
+		MemoryTracer::DeallocateUntracked(ptr);
+		return;
+	}
+	if(tracer->detectContainerGrowth)
+	{
+		MemoryTracer::growthCaller = CALLER_ADDRESS();
+	}
+	tracer->Deallocate(ptr, ALLOC_NEW_ARRAY, true);
+}
+#endif
\ No newline at end of file
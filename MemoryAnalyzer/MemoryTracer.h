@@ -7,11 +7,28 @@
 
 
 #include <assert.h>
-#include <fstream>
-#include <iostream>
+#include <atomic>
+#include <mutex>
+#include <new>
 #include <stdlib.h>
 #include <typeinfo>
 
+/** @def MEMORYTRACER_RTTI
+Defined when the compiler has RTTI turned on.  The tracer doesn't need RTTI; it is only used to name types on compilers
+which have no signature string to take the name from (see TypeTag).
+*/
+#if !defined(MEMORYTRACER_RTTI) && (defined(__GXX_RTTI) || defined(_CPPRTTI))
+#define MEMORYTRACER_RTTI
+#endif
+
+#include "BackingAllocator.h"
+#include "LiveRecords.h"
+#include "TraceWriter.h"
+
+#ifndef _WIN32
+#include <signal.h>
+#endif
+
 
 /** @enum AllocationType
 This is used to differentiate between memory allocated through either new or new[]
@@ -49,6 +66,198 @@ public:
 };
 
 
+/** @def MEMORYTRACER_SAMPLE_TOP_TYPES
+Number of types (largest first) recorded in every MemorySample.  Define it before including MemoryAnalyzer.h to change it.
+*/
+#ifndef MEMORYTRACER_SAMPLE_TOP_TYPES
+#define MEMORYTRACER_SAMPLE_TOP_TYPES 5
+#endif
+
+/** @def MEMORYTRACER_GROWTH_STACK_DEPTH
+Number of stack frames which identify a container growth site (see MemoryTracer::detectContainerGrowth).
+*/
+#ifndef MEMORYTRACER_GROWTH_STACK_DEPTH
+#define MEMORYTRACER_GROWTH_STACK_DEPTH 8
+#endif
+
+/** @def MEMORYTRACER_PROFILE_STACK_DEPTH
+Number of stack frames recorded for each allocation when heap profiles are kept by call stack (see
+MemoryTracer::captureAllocationStacks).
+*/
+#ifndef MEMORYTRACER_PROFILE_STACK_DEPTH
+#define MEMORYTRACER_PROFILE_STACK_DEPTH 16
+#endif
+
+/** @def MEMORYTRACER_TIMELINE_CHUNK
+Number of timeline events each thread collects before handing them to the writer thread (see
+MemoryTracer::StartTimeline).
+*/
+#ifndef MEMORYTRACER_TIMELINE_CHUNK
+#define MEMORYTRACER_TIMELINE_CHUNK 2048
+#endif
+
+//! Block of timeline events recorded by one thread; defined in Timeline.cpp
+struct TimelineChunk;
+
+/** @struct MemorySample
+@brief Memory counters at one point in time, as recorded by the sampler thread (see MemoryTracer::StartSampler).
+*/
+struct MemorySample
+{
+	//! Seconds since the sampler was started
+	double time;
+	//! Allocated memory in bytes
+	size_t currentMemory;
+	//! Number of allocated blocks
+	long long currentBlocks;
+	//! Allocations per second since the previous sample
+	double allocationRate;
+	//! Deallocations per second since the previous sample
+	double deallocationRate;
+	//! Types taking up the most memory, largest first; unused entries are nullptr
+	const char *topTypes[MEMORYTRACER_SAMPLE_TOP_TYPES];
+	//! Memory used by each of topTypes, in bytes
+	size_t topTypeMemory[MEMORYTRACER_SAMPLE_TOP_TYPES];
+	//! Number of blocks of each of topTypes
+	long topTypeBlocks[MEMORYTRACER_SAMPLE_TOP_TYPES];
+};
+
+/** @enum TypeGrouping
+How DisplayStatTable and MemoryTracer::GetTypeGroups put types together (see MemoryTracer::SetTypeGrouping).
+*/
+enum TypeGrouping
+{
+	GROUP_BY_TYPE,		/**< Every type on its own */
+	GROUP_BY_TEMPLATE,	/**< Instantiations of the same template together (std::vector<...>), and arrays of any length */
+	GROUP_BY_NAMESPACE	/**< Types in the same outermost namespace (or class) together */
+};
+
+/** @struct TypeGroupStats
+@brief Memory taken up by one group of types (see MemoryTracer::GetTypeGroups).
+*/
+struct TypeGroupStats
+{
+	//! Name of the group; valid until the grouping or its rules are changed
+	const char *name;
+	//! Number of allocated blocks of the group's types
+	long blocks;
+	//! Allocated memory of the group's types, in bytes
+	size_t memSize;
+};
+
+
+/** @brief Extracts the type name from the compiler's signature string for TypeTag<T>::Name.  Called once per type.
+	@param signature __PRETTY_FUNCTION__ or __FUNCSIG__ inside TypeTag<T>::Name
+	@return The type name (in memory which is never freed), or the whole signature if it couldn't be found
+*/
+const char* ParseTypeName(const char *signature);
+
+/** @brief Fills in up to maxFrames return addresses of the calling thread's stack, innermost first.  Available on
+Windows and on Linux with glibc; elsewhere no frames are captured.
+	@param frames Destination array
+	@param maxFrames Size of the destination array (at most 64)
+	@param skip Number of innermost frames to leave out, not counting CaptureStack itself
+	@return Number of frames filled in
+*/
+int CaptureStack(void **frames, int maxFrames, int skip);
+
+/** @brief Finds the name of the function a return address belongs to.  Linux with glibc only (link with -rdynamic to
+get the names of the program's own functions).
+	@param address Address captured by CaptureStack
+	@param demangled Receives memory to be freed with free once the name has been used (nullptr if there is none)
+	@return The demangled name where possible, the symbol name otherwise, or nullptr if it isn't known
+*/
+const char* FindSymbolName(const void *address, char *&demangled);
+
+/** @struct TypeTag
+@brief Names types for the tracer without RTTI.  The name is cut out of the compiler's signature string for Name()
+(which contains T) the first time a type is tagged; after that, getting it is just a load.  Since a new-expression
+always creates an object of exactly type T, this is also the object's dynamic type, so no run-time lookup is needed.
+*/
+template<typename T>
+struct TypeTag
+{
+	static const char* Name()
+	{
+#if defined(__GNUC__) || defined(__clang__)
+		static const char *name = ParseTypeName(__PRETTY_FUNCTION__);
+#elif defined(_MSC_VER)
+		static const char *name = ParseTypeName(__FUNCSIG__);
+#elif defined(MEMORYTRACER_RTTI)
+		// no signature string to take the name from, so the static type's RTTI name is used instead
+		static const char *name = typeid(T).name();
+#else
+		static const char *name = "Unknown type";
+#endif
+		return name;
+	}
+};
+
+
+/** @enum NoAllocPolicy
+What happens when memory is allocated inside a NoAllocZone.
+*/
+enum NoAllocPolicy
+{
+	NOALLOC_COUNT,	/**< Only count the allocation (see MemoryTracer::DisplayNoAllocReport) */
+	NOALLOC_LOG,	/**< Count it and print the zone, size, and call stack in the console */
+	NOALLOC_ABORT	/**< Print it like NOALLOC_LOG, then abort the program (e.g., to stop in the debugger) */
+};
+
+/** @class NoAllocZone
+@brief Marks a scope in which the current thread shouldn't allocate memory (e.g., a render or network thread's frame)
+until the object goes out of scope.  Every allocation made in the zone is recorded as a violation, with its call
+stack, under the zone's name, and handled according to the policy.  Zones can be nested; the innermost one applies.
+When no zone is active, checking for one costs a single thread-local load per allocation.
+
+Example: { NoAllocZone zone("render", NOALLOC_ABORT); RenderFrame(); }
+*/
+class NoAllocZone
+{
+private:
+
+	NoAllocZone *previous;
+
+	//! Innermost zone of the current thread, or nullptr if there is none
+	static thread_local NoAllocZone *current;
+
+	NoAllocZone(const NoAllocZone&);
+	NoAllocZone& operator=(const NoAllocZone&);
+
+	friend class MemoryTracer;
+
+public:
+
+	//! Name the violations are reported under; zones with the same name share their totals
+	const char *name;
+	NoAllocPolicy policy;
+	//! Number of allocations the zone still lets through before they count as violations
+	unsigned int allowance;
+
+	/** @param name Name of the zone; must remain valid for the rest of the program
+		@param policy What to do about each violation (default: NOALLOC_LOG)
+		@param allowedAllocations Number of allocations allowed in the zone before they count as violations, for code
+		which may allocate a little but not in bulk (default: 0)
+	*/
+	explicit NoAllocZone(const char *name, NoAllocPolicy policy = NOALLOC_LOG, unsigned int allowedAllocations = 0)
+		: previous(current), name(name), policy(policy), allowance(allowedAllocations)
+	{
+		current = this;
+	}
+	~NoAllocZone()
+	{
+		current = previous;
+	}
+
+	/** @return Innermost zone of the current thread, or nullptr if there is none
+	*/
+	static NoAllocZone* GetCurrent()
+	{
+		return current;
+	}
+};
+
+
 template<typename T>
 T* operator*(const SourcePacket& packet, T* p);
 
@@ -71,98 +280,638 @@ private:
 	{
 		//! Size of the the object in memory (not including the header)
 		size_t rawSize;
-		AllocationType type;
+		//! AllocationType of the block (a byte, so the fields below fit in what would otherwise be padding)
+		unsigned char type;
+		//! Index of the BackingAllocator the block came from (0 for malloc)
+		unsigned char backend;
+		//! Set when the block replaced a smaller one as part of a container's growth (see detectContainerGrowth)
+		bool grown;
+		//! False for blocks the tracer has no record of (allocated while it was starting up or after its exit report)
+		bool tracked;
+		//! Number of the thread which allocated the block (see ThreadStats), or 0 if it isn't known
+		uint16_t thread;
 	};
 
-	/** @struct AddrListNode
-	Internal information container. Used to keep track of current memory allocations.
+	/** @struct TypeNode
+	Internal information container. Used for memory summary purposes. Only tracks allocations which are caught and detailed
+	by the memory manager.  The counters are atomic so the sampler thread can read them without taking tracerLock.
 	*/
-	struct AddrListNode
+	struct TypeNode
 	{
-		//! Allocation address
-		void *address;
-		//! Object type
 		const char *type;
-		//! Source file
+		std::atomic<long> blocks;
+		std::atomic<size_t> memSize;
+		TypeNode *next;
+		//! Next node in the order the types were first seen.  Unlike next (which DisplayStatTable relinks when it sorts
+		//! the list), this never changes once the node is published, so it can be followed without the lock.
+		TypeNode *nextRegistered;
+		//! Group of the type under the current grouping, or 0 if it hasn't been grouped yet (see GroupType)
+		uint32_t group;
+	};
+
+	/** @struct TypeGroupNode
+	Internal information container. Totals the types a grouping puts together; they are only summed up when asked for
+	(see TotalTypeGroups), so allocations don't pay for grouping.
+	*/
+	struct TypeGroupNode
+	{
+		//! Name of the group (allocated with malloc)
+		char *name;
+		//! Next group whose name has the same hash (0 if there is none)
+		uint32_t nextSameHash;
+		long blocks;
+		size_t memSize;
+	};
+
+	/** @struct TypeGroupRule
+	Puts every type whose name starts with prefix into the named group, ahead of the grouping (see AddTypeGroupRule).
+	*/
+	struct TypeGroupRule
+	{
+		const char *prefix;
+		const char *group;
+	};
+
+	/** @struct SiteNode
+	Internal information container. Like TypeNode, but totals the allocations made on each source line.
+	*/
+	struct SiteNode
+	{
 		const char *file;
-		//! Line number
 		int line;
-		AddrListNode *next;
+		long blocks;
+		size_t memSize;
+		SiteNode *next;
 	};
 
-	/** @struct MemInfoNode
-	Internal information container. Used to help organize individual memory information objects (AddrListNode's).
+	/** @struct GrowthSiteNode
+	Internal information container. Totals the container regrowths (a block replaced by one 1.5-2 times its size)
+	seen at one call stack.
 	*/
-	struct MemInfoNode
+	struct GrowthSiteNode
 	{
-		//! Size of the allocations referenced within
-		size_t size;
-		//! Number of objects allocated with this object's size
-		int numberOfAllocations;
-		//! Linked list of current memory allocations with this object's size
-		AddrListNode *addresses;
-		MemInfoNode *next;
+		void *frames[MEMORYTRACER_GROWTH_STACK_DEPTH];
+		int frameCount;
+		//! Number of times a block was replaced by a larger one (each of which means copying its contents)
+		long long copies;
+		//! Number of growth chains, i.e., containers which grew at least once
+		long long containers;
+		//! Total size of the blocks which were replaced
+		size_t bytesCopied;
+		//! Largest block any of the chains grew to
+		size_t largestBlock;
+		GrowthSiteNode *next;
 	};
 
-	/** @struct TypeNode
-	Internal information container. Used for memory summary purposes. Only tracks allocations which are caught and detailed
-	by the memory manager.
+	/** @struct ProfileTotals
+	Live and cumulative totals of one heap profile entry (see ExportPprof).
 	*/
-	struct TypeNode
+	struct ProfileTotals
+	{
+		long long liveBlocks;
+		size_t liveBytes;
+		//! Blocks allocated so far, including those freed since
+		long long allocatedBlocks;
+		unsigned long long allocatedBytes;
+
+		void AddBlock(size_t size)
+		{
+			liveBlocks++;
+			liveBytes += size;
+			allocatedBlocks++;
+			allocatedBytes += size;
+		}
+
+		void FreeBlock(size_t size)
+		{
+			liveBlocks--;
+			liveBytes -= size;
+		}
+
+		//! Takes a live block back out as if it had never been counted here
+		void RemoveBlock(size_t size)
+		{
+			FreeBlock(size);
+			allocatedBlocks--;
+			allocatedBytes -= size;
+		}
+	};
+
+	/** @struct ProfileSite
+	Heap profile totals of the blocks allocated on one source line as one type.
+	*/
+	struct ProfileSite
+	{
+		uint32_t siteId;
+		uint32_t typeId;
+		ProfileTotals totals;
+	};
+
+	/** @struct ProfileStack
+	Heap profile totals of the blocks allocated from one call stack (see captureAllocationStacks).
+	*/
+	struct ProfileStack
+	{
+		void *frames[MEMORYTRACER_PROFILE_STACK_DEPTH];
+		int frameCount;
+		//! Next stack with the same hash (0 if there is none)
+		uint32_t nextSameHash;
+		ProfileTotals totals;
+	};
+
+	/** @struct ThreadStats
+	Allocation counters of one thread.  Each thread only writes its own counters (apart from liveBytes, which a thread
+	freeing another thread's block lowers), so threads don't contend for them; they are atomic so reports can read them.
+	*/
+	struct ThreadStats
+	{
+		//! Number the tracer gave the thread (1 for the first thread to allocate), as stored in block headers
+		unsigned int index;
+		//! Operating system's ID for the thread
+		unsigned long long systemId;
+		//! Number of exited threads which had this record (and number) before the current one; their counters are
+		//! included, since their blocks may still be live
+		unsigned int earlierThreads;
+		//! Name given with NameCurrentThread, or nullptr
+		const char *name;
+		std::atomic<long long> allocations;
+		std::atomic<long long> deallocations;
+		std::atomic<unsigned long long> bytesAllocated;
+		std::atomic<unsigned long long> bytesFreed;
+		//! Memory allocated by this thread which hasn't been freed yet (by any thread), and the most there has been
+		std::atomic<long long> liveBytes;
+		std::atomic<long long> peakBytes;
+		//! Number and size of the blocks this thread freed which other threads allocated, by allocating thread
+		KeyMap crossFreeBlocks;
+		KeyMap crossFreeBytes;
+		//! Timeline events recorded by this thread which haven't been handed to the writer thread yet (see
+		//! StartTimeline)
+		TimelineChunk *timelineChunk;
+		//! The thread's stack, which ScanForLeaks treats as a root (both 0 if it isn't known, or once the thread has
+		//! exited)
+		uintptr_t stackBegin;
+		uintptr_t stackEnd;
+		//! Keeps the counters of records which were allocated next to each other off each other's cache lines
+		char padding[64];
+	};
+
+	/** @struct NoAllocZoneStats
+	Violations of the NoAllocZones with one name.
+	*/
+	struct NoAllocZoneStats
+	{
+		const char *name;
+		long long violations;
+		unsigned long long bytes;
+		//! Number of violations at each call stack (by index into profileStacks)
+		KeyMap stacks;
+	};
+
+	/** @struct EpochEntry
+	An allocation made while a leak epoch was open (see BeginLeakEpoch).
+	*/
+	struct EpochEntry
+	{
+		void *address;
+		uint64_t allocationNumber;
+		//! Thread which made the allocation, as in AllocationHeader::thread
+		uint16_t thread;
+	};
+
+	/** @struct PeakEntry
+	One row of the peak composition: a type (file is nullptr) or a site (type is nullptr) and its totals at the peak.
+	*/
+	struct PeakEntry
 	{
 		const char *type;
+		const char *file;
+		int line;
 		long blocks;
 		size_t memSize;
-		TypeNode *next;
 	};
 
-	//! Linked list of normal allocations & information
-	MemInfoNode *head_new;
-	//! Linked list of array allocations & information
-	MemInfoNode *head_new_array;
+	/** @struct PeakSnapshot
+	Copy of the type and site totals taken when the peak memory last grew past the snapshot threshold.
+	*/
+	struct PeakSnapshot
+	{
+		//! Memory and blocks allocated when the snapshot was taken (0 if there is no snapshot yet)
+		size_t memory;
+		long long blocks;
+		PeakEntry *types;
+		size_t typeCount;
+		size_t typeCapacity;
+		PeakEntry *sites;
+		size_t siteCount;
+		size_t siteCapacity;
+		//! Number of the allocation which set the peak, until its block has been given a type and site (0 when
+		//! there is none); the snapshot is taken inside Allocate, before the block is detailed
+		uint64_t allocation;
+	};
+
+	/** @struct LargeBlock
+	A block at or above largeBlockThreshold, which has pages of its own and no header (see AllocateLarge).  Its size,
+	type, and site are in liveRecords like any other block's; this is what it takes to free and report the mapping.
+	*/
+	struct LargeBlock
+	{
+		void *address;
+		//! Size of the mapping (the block's size rounded up to whole pages)
+		size_t mappedSize;
+		//! What would otherwise be in the block's header
+		AllocationHeader header;
+		//! Set if transparent huge pages were asked for (see largeBlockHugePages)
+		bool hugePages;
+	};
+
+	//! Every live allocation (address, size, type, site, age)
+	LiveRecordTable liveRecords;
+	//! Live large blocks, in no particular order; there are only ever a handful, so they are searched linearly
+	LargeBlock *largeBlocks;
+	size_t largeBlockCount;
+	size_t largeBlockCapacity;
+	//! Guards the large blocks.  Separate from tracerLock, since blocks are also looked up when freed around the tracer
+	//! (e.g., by the threads the exit report runs on while it holds tracerLock).  Taken after tracerLock, if both are.
+	std::mutex largeBlockLock;
+	//! Number of the newest records kept in memory when the records are spilled to a file (0 if they aren't)
+	size_t residentRecordLimit;
+	//! Number of snapshot children running (see WriteHeapSnapshot); the spill file mustn't change under them
+	unsigned int runningSnapshots;
+	//! Number of allocations ever made of each (size, AllocationType), including those freed since
+	KeyMap sizeCounts;
+	//! Types by ID (index 0 is unused; it means the type is unknown), and the map from type name pointers to IDs
+	TypeNode **typeTable;
+	size_t typeCount;
+	size_t typeTableCapacity;
+	KeyMap typeIds;
+	//! Groups of the types by number (index 0 is unused), the map from the hash of a group's name to the first group
+	//! with that hash, and the rules applied before the grouping, in the order they were added
+	TypeGroupNode *typeGroups;
+	size_t typeGroupCount;
+	size_t typeGroupCapacity;
+	KeyMap typeGroupHashes;
+	TypeGroupRule *typeGroupRules;
+	size_t typeGroupRuleCount;
+	size_t typeGroupRuleCapacity;
+	TypeGrouping typeGrouping;
+	//! Sites by ID (index 0 is unused), and the map from file name pointer and line to IDs
+	SiteNode **siteTable;
+	size_t siteCount;
+	size_t siteTableCapacity;
+	KeyMap siteIds;
+	//! Heap profile totals by site and type, and the map from type ID and site ID to their index
+	ProfileSite *profileSites;
+	size_t profileSiteCount;
+	size_t profileSiteCapacity;
+	KeyMap profileSiteIds;
+	//! Heap profile totals by call stack (index 0 is unused; it means the stack wasn't captured), and the map from the
+	//! hash of a stack to the first stack with that hash
+	ProfileStack *profileStacks;
+	size_t profileStackCount;
+	size_t profileStackCapacity;
+	KeyMap profileStackHashes;
+	//! Counters of every thread which has allocated or freed memory, by number (index 0 is unused)
+	ThreadStats **threadTable;
+	size_t threadCount;
+	size_t threadTableCapacity;
+	//! Numbers of the threads which have exited, handed out again once block headers have no room for new ones
+	uint32_t *exitedThreads;
+	size_t exitedThreadCount;
+	size_t exitedThreadCapacity;
+	//! Violations of each no-alloc zone (in the order the zones were first violated), and the map from zone name
+	//! pointers to their index
+	NoAllocZoneStats **zoneTable;
+	size_t zoneCount;
+	size_t zoneTableCapacity;
+	KeyMap zoneIds;
+	//! Allocations made while any leak epoch was open, in allocation order.  Entries of blocks which have been freed
+	//! are dropped when the log fills up, so it only grows with the number of blocks still allocated.
+	EpochEntry *epochLog;
+	size_t epochLogCount;
+	size_t epochLogCapacity;
+	//! Number of leak epochs which have begun but not ended; allocations are only logged while there are any
+	unsigned int openEpochs;
+	//! True while a timeline is being recorded (see StartTimeline)
+	bool timelineRunning;
 	//! Linked list of types (types, blocks, total size in memory)
 	TypeNode *head_types;
-	//! Pointer to last allocated block of memory.  The detailing function checks this variable first to save time.  If it
-	//! the correct node, it will use it; otherwise, it will search for the node using RetrieveAddrNode.
-	AddrListNode *mostRecentAllocAddrNode;
+	//! Most recently added type node; the start of the nextRegistered chain
+	std::atomic<TypeNode*> typeRegistry;
+	//! Linked list of allocation sites (file, line, blocks, total size in memory)
+	SiteNode *head_sites;
+	//! Composition of memory at the most recent snapshotted peak
+	PeakSnapshot peakSnapshot;
+	//! Peak memory at which the next snapshot is taken
+	size_t nextPeakSnapshot;
+	//! Linked list of container growth sites (only filled in when detectContainerGrowth is set)
+	GrowthSiteNode *head_growthSites;
+	//! Guards the internal lists.  Recursive so that allocations made by the console output inside Allocate/Deallocate
+	//! (which can happen when showAllAllocs/showAllDeallocs are on) don't deadlock.
+	std::recursive_mutex tracerLock;
 	
-	size_t currentMemory;
-	size_t peakMemory;
-	long long currentBlocks;
-	long long peakBlocks;
+	// Only written with tracerLock held, but atomic so they can be read without it
+	std::atomic<size_t> currentMemory;
+	std::atomic<size_t> peakMemory;
+	std::atomic<long long> currentBlocks;
+	std::atomic<long long> peakBlocks;
+	//! Number of allocations/deallocations made so far (used to compute rates)
+	std::atomic<long long> totalAllocations;
+	std::atomic<long long> totalDeallocations;
 	const char *unknown;
 
-	std::ofstream dumpFile;
+	//! Leak file; only open while the exit report is being written
+	FILE *dumpFile;
+
+	/** @enum TracerState
+	Stage of the singleton's life.  The tracer is constructed in place on first use and never destroyed, so it can be
+	used at any point of static initialization and destruction.
+	*/
+	enum TracerState
+	{
+		TRACER_UNCONSTRUCTED,	/**< Nothing has been allocated yet */
+		TRACER_CONSTRUCTING,	/**< Being constructed; the constructing thread's own allocations aren't tracked */
+		TRACER_READY,			/**< Tracking allocations */
+		TRACER_FINISHED			/**< The exit report is being or has been written; allocations aren't tracked */
+	};
+
+	//! Current TracerState.  Constant-initialized, so it is valid before any constructor in the program has run.
+	static std::atomic<int> state;
+	//! Set on the thread which is constructing the tracer (bootstrap mode)
+	static thread_local bool constructingThread;
+
+	//! The calling thread's counters (nullptr until it first allocates or frees memory)
+	static thread_local ThreadStats *currentThreadStats;
+
+	/** @struct ThreadExitHook
+	Lets the tracer know when a thread which has allocated or freed memory exits, so its stack is no longer scanned and
+	its number can be given to a new thread.
+	*/
+	struct ThreadExitHook
+	{
+		~ThreadExitHook();
+	};
+	//! Set up by CurrentThreadStats, so its destructor runs when the thread exits
+	static thread_local ThreadExitHook threadExitHook;
+	//! Set once the calling thread's ThreadExitHook has run; what the thread allocates after that isn't counted, since
+	//! its record may already belong to another thread
+	static thread_local bool threadExited;
+	//! Return address of the operator new or delete call being handled on this thread (only set when
+	//! detectContainerGrowth is), which tells growth steps apart from unrelated allocations
+	static thread_local const void *growthCaller;
 
 	MemoryTracer();
+	//! Never called; the tracer lives until the process ends (see ExitHandler)
 	~MemoryTracer();
 	MemoryTracer(const MemoryTracer&);
 	MemoryTracer& operator=(const MemoryTracer&);
 
-	/**	@brief Adds information for a single allocation to the internal list
-	@param size Size of the allocation requested by the program
-	@param type Allocation type
-	@param ptr Pointer to the allocated memory which needs to be added to the internal list
+	/** @brief Adds context information to an allocation and updates the type and site totals
+	@param ptr Pointer to the allocated object
 	@param file Source filename from which the allocation was requested
 	@param line Line number of the source file on which the allocation request occurred
+	@param type Type of the allocation (i.e., int, Complex, Vector, etc.) as named by TypeTag
+	@param cookieSize Size of the element count new[] may put in front of an array; ptr can be this far past the start
+	of the block
 	*/
-	void AddAllocationToList(size_t size, AllocationType type, void *ptr);
+	void AddAllocationDetails(void *ptr, const char *file, int line, const char *type, size_t cookieSize);
 
-	/** @brief Adds context information to the most recent allocation
-	@param ptr Pointer to the allocated memory
-	@param file Source filename from which the allocation was requested
-	@param line Line number of the source file on which the allocation request occurred
-	@param type Type of the allocation (i.e., int, Complex, Vector, etc.) determined using RTTI
-	@param objectSize Size of the object; used to decrease lookup times if the node matching the ptr address is not the same
-	as the one in mostRecentAllocAddrNode
+	/** @brief Finds the ID of a type, adding it to the type table and list if it is new
+		@param type Object type name
+		@return ID of the type, or 0 if it couldn't be added
 	*/
-	void AddAllocationDetails(void *ptr, const char *file, int line, const char *type, size_t objectSize);
+	uint32_t InternType(const char *type);
 
-	/** @brief Updates stats inn type information list
+	/** @brief Finds the group a type belongs to under the current rules and grouping, adding the group if it is new.
+	Only done once per type until the grouping changes; the result is kept in TypeNode::group.
 		@param type Object type name
-		@param size Object's size in memory
+		@return Number of the group, or 0 if it couldn't be added
+	*/
+	uint32_t GroupType(const char *type);
+
+	/** @brief Sums the current blocks and memory of every type into its group, grouping the types which are new
+	*/
+	void TotalTypeGroups();
+
+	/** @brief Forgets every group (after the grouping or its rules changed), so the types are grouped afresh
+	*/
+	void ResetTypeGroups();
+
+	/** @brief Finds the ID of an allocation site, adding it to the site table and list if it is new
+		@param file Source filename
+		@param line Line number
+		@return ID of the site, or 0 if it couldn't be added
+	*/
+	uint32_t InternSite(const char *file, int line);
+
+	/** @return Name of the type with the given ID ("Unknown" for 0)
+	*/
+	const char* TypeName(uint32_t typeId) const
+	{
+		return typeId ? typeTable[typeId]->type : unknown;
+	}
+
+	/** @return File name of the site with the given ID ("Unknown" for 0)
+	*/
+	const char* SiteFile(uint32_t siteId) const
+	{
+		return siteId ? siteTable[siteId]->file : unknown;
+	}
+
+	/** @return Line number of the site with the given ID (0 for 0)
+	*/
+	int SiteLine(uint32_t siteId) const
+	{
+		return siteId ? siteTable[siteId]->line : 0;
+	}
+
+	/** @enum BlockReportStyle
+	Layout of the text built by BuildBlockReport.
+	*/
+	enum BlockReportStyle
+	{
+		REPORT_LEAKS,		/**< Leak report shown at exit */
+		REPORT_COUNT_FIRST,	/**< DisplayAllocations, number of allocations first */
+		REPORT_SIZE_FIRST	/**< DisplayAllocations, size first */
+	};
+
+	/** @brief Lists the live blocks grouped by allocation type and size (in that order, then by age).  The blocks are
+	grouped and formatted on up to reportThreads threads, and the text is the same whatever the number of threads.  Must
+	be called with tracerLock held.  Defined in BlockReport.cpp.
+		@param style Layout of the text
+		@param displayDetail Set to true to list the address, file, and line of every block (always done for REPORT_LEAKS)
+		@param length Receives the length of the text
+		@param blocks Receives the number of blocks of each AllocationType
+		@return The text (to be freed with free), or nullptr if memory ran out
+	*/
+	char* BuildBlockReport(BlockReportStyle style, bool displayDetail, size_t &length, size_t blocks[2]);
+
+	/** @brief Copies the type and site totals into peakSnapshot.  Called from Allocate when the peak has grown by more
+	than peakSnapshotThreshold since the last snapshot.
+	*/
+	void CapturePeakSnapshot();
+
+	/** @brief Moves the block which set the snapshotted peak from the unknown memory to its type and site, once
+	AddAllocationDetails has found them
+		@param typeId ID of the block's type (0 if it is unknown)
+		@param siteId ID of the block's site (0 if it is unknown)
+		@param size Size of the block
+	*/
+	void DetailPeakSnapshot(uint32_t typeId, uint32_t siteId, size_t size);
+
+	//! Names longer than this are cut short in DisplayStatTable and DisplayPeakComposition, so one long template
+	//! instantiation doesn't push the rest of the table off the screen
+	static const size_t maxTypeNameLength = 96;
+
+	/** @brief Cuts a name longer than maxTypeNameLength short (ending it in "...") for display
+		@param name Name to display
+		@param buffer Room for maxTypeNameLength + 1 characters, which a shortened name is written to
+		@return name if it fits, otherwise buffer
+	*/
+	static const char* ShortTypeName(const char *name, char *buffer);
+
+	/** @brief Checks whether an allocation completes a growth step with the calling thread's previous deallocation.
+	Called from Allocate when detectContainerGrowth is set.
+	@param header Header of the new block
 	*/
-	void AddToTypeList(const char *type, size_t size);
+	void TrackGrowthOnAllocate(AllocationHeader *header);
+
+	/** @brief Checks whether a deallocation completes a growth step with the calling thread's previous allocation.
+	Called from Deallocate when detectContainerGrowth is set.
+	@param header Header of the block being freed
+	*/
+	void TrackGrowthOnDeallocate(AllocationHeader *header);
+
+	/** @brief Adds a growth step to the totals of the current call stack's growth site
+	@param oldSize Size of the block which was replaced
+	@param newSize Size of the block which replaced it
+	@param continued True if the replaced block was itself the result of a growth step
+	*/
+	void RecordGrowth(size_t oldSize, size_t newSize, bool continued);
+
+	/** @brief Finds the heap profile entry of a site and type, adding it if it is new.  Defined in HeapProfile.cpp.
+		@return Index of the entry in profileSites, or -1 if memory ran out
+	*/
+	size_t InternProfileSite(uint32_t siteId, uint32_t typeId);
+
+	/** @brief Finds the heap profile entry of a call stack, adding it if it is new
+		@param frames Return addresses, innermost first
+		@param frameCount Number of frames
+		@return Index of the entry in profileStacks, or 0 if there are no frames or memory ran out
+	*/
+	uint32_t InternProfileStack(void **frames, int frameCount);
+
+	/** @brief Counts a new block in the heap profile (under an unknown site and type until AddAllocationDetails), and
+	records the call stack it was allocated from when captureAllocationStacks is set.  Called from RecordAllocation.
+		@param row Row of the block in liveRecords
+		@param callerFrames Number of the tracer's frames above RecordAllocation (see its headerInBlock)
+	*/
+	void ProfileAllocation(size_t row, int callerFrames);
+
+	/** @brief Moves a block's heap profile totals from the unknown site and type to the ones it was just given
+		@param row Row of the block in liveRecords
+	*/
+	void ProfileDetails(size_t row);
+
+	/** @brief Takes a freed block out of the live heap profile totals
+		@param row Row of the block in liveRecords
+	*/
+	void ProfileDeallocation(size_t row);
+
+	/** @brief Returns the calling thread's counters, adding them the first time the thread allocates or frees memory.
+	Must be called with tracerLock held.  Defined in ThreadStats.cpp.
+		@return The counters, or nullptr if memory ran out
+	*/
+	ThreadStats* CurrentThreadStats();
+
+	/** @return Number the calling thread stamps on the blocks it allocates (see AllocationHeader::thread), or 0 if it
+	has none.  Must be called with tracerLock held.
+	*/
+	uint16_t CurrentThreadNumber();
+
+	/** @brief Stamps a new block with the calling thread's number and adds it to the thread's counters.  Called from
+	Allocate.
+		@param header Header of the new block
+	*/
+	void CountThreadAllocation(AllocationHeader *header);
+
+	/** @brief Adds a freed block to the calling thread's counters, and to the cross-thread frees if another thread
+	allocated it.  Called from Deallocate.
+		@param header Header of the block being freed
+	*/
+	void CountThreadDeallocation(const AllocationHeader *header);
+
+	/** @brief Records an allocation made inside a NoAllocZone (unless the zone still allows it) and applies the
+	zone's policy.  Called from RecordAllocation.  Defined in NoAllocZone.cpp.
+		@param zone Innermost zone of the calling thread
+		@param size Size of the allocation
+		@param type Allocation type
+		@param callerFrames Number of the tracer's frames above RecordAllocation (see its headerInBlock)
+	*/
+	void RecordNoAllocViolation(NoAllocZone *zone, size_t size, AllocationType type, int callerFrames);
+
+	/** @brief Adds a new block to the epoch log.  Called from Allocate while a leak epoch is open.  Defined in
+	LeakEpochs.cpp.
+		@param row Row of the block in liveRecords
+		@param thread Number of the thread which allocated it
+	*/
+	void LogEpochAllocation(size_t row, uint16_t thread);
+
+	/** @enum TimelineEventKind
+	What a timeline event records.
+	*/
+	enum TimelineEventKind
+	{
+		TIMELINE_ALLOCATION,	/**< A block was allocated; only kept if it is large */
+		TIMELINE_DETAILS,		/**< A block was given its type, which starts its lifetime slice */
+		TIMELINE_FREE,			/**< A block was freed, which ends its lifetime slice if it had one */
+		TIMELINE_COUNTERS,		/**< The current memory and blocks */
+		TIMELINE_MARK			/**< A marker added with Mark */
+	};
+
+	/** @brief Adds an event to the calling thread's timeline chunk, preceded by the memory counters if they are due.
+	Must be called with tracerLock held, and only while timelineRunning is set.  Defined in Timeline.cpp.
+		@param kind What happened
+		@param name Type of the block, or name of the marker (nullptr if unknown)
+		@param allocationNumber Allocation number of the block (ignored for markers)
+		@param size Size of the block (ignored for markers)
+	*/
+	void RecordTimelineEvent(TimelineEventKind kind, const char *name, uint64_t allocationNumber, size_t size);
+
+	/** @brief Writes the events of a chunk in Chrome's trace event format.  Called by the timeline's writer thread.
+		@param file File to write to
+		@param chunk Events to write
+	*/
+	static void WriteTimelineChunk(FILE *file, const TimelineChunk *chunk);
+
+	/** @brief Returns the tracer, constructing it on first use.  Fast once the tracer is ready: a single load.
+		@return The tracer, or nullptr if the allocation or deallocation should bypass it (the calling thread is
+		constructing it, or the exit report has been written)
+	*/
+	static MemoryTracer* Instance()
+	{
+		if(state.load(std::memory_order_acquire) == TRACER_READY)
+		{
+			return instance;
+		}
+		return Construct();
+	}
+
+	/** @brief Constructs the tracer in place if nobody has yet, and waits for another thread which is constructing it
+		@return Same as Instance
+	*/
+	static MemoryTracer* Construct();
+
+	//! The tracer, once it has been constructed
+	static MemoryTracer *instance;
+
+	/** @brief Stops tracking and writes the exit report.  Registered with atexit when the tracer is constructed, so it
+	runs after the destructors of the static objects constructed from then on.
+	*/
+	static void ExitHandler();
+
+	/** @brief Writes the exit report: leaks, heap dump, profiles, and so on.  Called by ExitHandler.
+	*/
+	void WriteExitReport();
 
 	/** @brief Allocates memory upon request from the overloaded new operator
 	@param size Requested allocation size
@@ -174,49 +923,98 @@ private:
 	*/
 	void* Allocate(size_t size, AllocationType type, bool throwEx = false);
 
+	/** @brief Adds a new block to liveRecords and updates every total, counter, and report which follows allocations.
+	Must be called with tracerLock held.
+	@param ptr Pointer handed to the program
+	@param header Block's header (filled in apart from the thread)
+	@param headerInBlock False if the header is only a copy on the stack (large blocks), so nothing may keep it.  Also
+	tells how deep in the tracer the call is: Allocate and the operator are above it, and AllocateLarge as well for
+	large blocks.
+	@return False if the block couldn't be recorded (memory ran out), in which case nothing was changed
+	*/
+	bool RecordAllocation(void *ptr, AllocationHeader *header, bool headerInBlock);
+
+	/** @brief Takes a block out of liveRecords and every total and counter.  Must be called with tracerLock held.
+	@param ptr Pointer handed to the program
+	@param type Allocation type it is being freed as
+	@param header Block's header
+	@param headerInBlock False if the header is only a copy (large blocks)
+	*/
+	void RecordDeallocation(void *ptr, AllocationType type, AllocationHeader *header, bool headerInBlock);
+
+#ifndef _WIN32
+	/** @brief Allocates a block at or above largeBlockThreshold straight from mmap, so it starts on a page boundary,
+	and keeps its header in largeBlocks instead of in front of it.  Defined in LargeBlocks.cpp.
+	@param size Requested allocation size
+	@param type Allocation type
+	@param throwEx Indicates whether or not an exception should be thrown if memory couldn't be allocated
+	@return Pointer to allocated memory
+	*/
+	void* AllocateLarge(size_t size, AllocationType type, bool throwEx);
+
+	/** @brief Frees a block if it is a large block
+	@param ptr Pointer which is being freed
+	@param type Allocation type it is being freed as
+	@param tracked False once the exit report has been written, when the block is only unmapped
+	@return False if ptr isn't a large block (and nothing was done)
+	*/
+	bool DeallocateLarge(void *ptr, AllocationType type, bool tracked);
+#endif
+
 	/** @brief Frees memory upon request from the overloaded delete operator
 	@param ptr Pointer to memory which should be freed
 	@param type Allocation type
-	@param throwEx Indicates whether or not an exception should be thrown if memory couldn't be allocated (default: false)
+	@param throwEx Unused, since freeing memory never throws; kept so each operator delete calls this like its operator
+	new calls Allocate (default: false)
 	*/
 	void Deallocate(void *ptr, AllocationType type, bool throwEx = false);
 
-	/**	@brief Returns string version of allocation type enum
-	@param type Allocation type to convert to a string
-	@return Allocation type in string form
+	/** @brief Allocates memory without touching the tracer; used for allocations made while the tracer is being
+	constructed (bootstrap mode) or after its exit report
+	@param size Requested allocation size
+	@param type Allocation type
+	@param throwEx Indicates whether or not an exception should be thrown if memory couldn't be allocated (default: false)
+	@return Pointer to allocated memory
 	*/
-	const char* GetAllocTypeAsString(AllocationType type);
+	static void* AllocateUntracked(size_t size, AllocationType type, bool throwEx = false);
 
-	/**	@brief Returns the head of the linked list for a desired allocation type
-	@param type Allocation type of head of internal list (i.e., ALLOC_NEW for non-array allocation list, etc.)
-	@return Pointer to head of allocation info list for desired type
+	/** @brief Frees memory without touching the tracer; used for blocks it has no record of and after its exit report
+	@param ptr Pointer to memory which should be freed
 	*/
-	MemInfoNode* GetListHead(AllocationType type);
+	static void DeallocateUntracked(void *ptr);
 
-	/**	@brief Removes information for a single allocation from the internal list
-	@param ptr Pointer to the freed memory which needs to be deleted from the internal list
-	@param type Allocation type of ptr
+	/** @brief Writes the heap dump for WriteHeapDump.  The caller must hold tracerLock (or be a forked child of a
+	thread which held it).
+	@param fileName Name of the file to create
+	@return True if the dump was written successfully
 	*/
-	void RemoveAllocationFromList(void *ptr, AllocationType type);
+	bool DumpHeap(const char *fileName);
 
-	/** @brief Performs a stat update in the type list after a deallocation
-		@param type String of the block's typename
-		@param size Object's size in memory
+	/** @brief Fills in a sample from the atomic counters and the type registry, without taking tracerLock
+	@param sample Sample to fill in
+	@param time Seconds since the sampler was started
+	@param elapsed Seconds since the previous sample
+	@param lastAllocations Allocation count at the previous sample; updated to the current count
+	@param lastDeallocations Deallocation count at the previous sample; updated to the current count
 	*/
-	void RemoveFromTypeList(const char *type, size_t size);
+	void TakeSample(MemorySample &sample, double time, double elapsed, long long &lastAllocations,
+		long long &lastDeallocations);
 
-	/** @brief Finds the information node associated with the address.
-		@param ptr Address of the desired node
-		@param objectSize Size of the object pointed to by ptr.  If the size is not known, this parameter can be ignored.
-		@return Pointer to the AddrListNode containing information about the allocation
+	/** @brief Reads the MEMANALYZER_* environment variables and overrides the default settings with them
 	*/
-	AddrListNode* RetrieveAddrNode(void *ptr, size_t objectSize = -1);
+	void LoadEnvironmentConfig();
 
-	/** @brief Finds the size of the object pointed to
-		@param ptr Address of the object
-		@return Size of the object in bytes
+	/**	@brief Returns string version of allocation type enum
+	@param type Allocation type to convert to a string
+	@return Allocation type in string form
 	*/
-	size_t RetrieveAddrSize(void *ptr);
+	const char* GetAllocTypeAsString(AllocationType type);
+
+	/**	@brief Removes a single allocation from liveRecords and the type and site totals
+	@param ptr Pointer to the freed memory
+	@param type Allocation type of ptr
+	*/
+	void RemoveAllocationFromList(void *ptr, AllocationType type);
 	
 public:
 
@@ -231,6 +1029,56 @@ public:
 	/** Set to true to save all memory leaks and related information in a generated file, memleaks.log (default: false).
 	*/
 	bool dumpLeaksToFile;
+	/** Name of the file leaks are dumped to when dumpLeaksToFile is set (default: memleaks.log).
+	*/
+	const char *leakFileName;
+	/** Name of the file a binary heap dump (see HeapDump.h) is written to at exit, or nullptr to skip it (default: nullptr).
+	*/
+	const char *heapDumpFileName;
+	/** Name of the file the size histogram (see ExportSizeHistogram) is written to at exit, or nullptr to skip it
+	(default: nullptr).
+	*/
+	const char *sizeHistogramFileName;
+	/** Set to true to only report blocks which can no longer be reached from the program's globals or stack as leaks at
+	exit, instead of every block still allocated (default: false).  See ScanForLeaks.  Linux only.
+	*/
+	bool reachabilityLeakCheck;
+	/** The composition of memory (by type and by site) is copied whenever the peak memory grows by more than this
+	fraction since the last copy, e.g., 0.05 means every 5% (default: 0.05).  Lower values give a more exact picture of
+	the peak at the cost of more copying; 0 copies at every new peak.
+	*/
+	float peakSnapshotThreshold;
+	/** Set to true to look for containers (such as std::vector and std::string) which grow one step at a time: a block
+	freed right after a block 1.5-2 times its size was allocated on the same thread, from the same code (or the other
+	way around).  Each step is attributed to the call stack it happened at, and DisplayGrowthReport (also shown at exit) lists the stacks
+	where calling reserve() would save the most copying (default: false).
+	*/
+	bool detectContainerGrowth;
+	/** Number of threads the exit leak report and DisplayAllocations are built on, or 0 for one per processor (default:
+	0).  Small heaps use fewer threads; the output is the same either way.
+	*/
+	unsigned int reportThreads;
+	/** Set to true to record the call stack of every allocation, so heap profiles can be exported by stack as well as
+	by source line and type (default: false).  Capturing a stack slows every allocation down considerably; blocks
+	allocated while this is off are left out of the stack profiles.
+	*/
+	bool captureAllocationStacks;
+	/** Name of the file a pprof heap profile (see ExportPprof) is written to at exit, or nullptr to skip it (default:
+	nullptr).  The profile is by stack if captureAllocationStacks is set, and by source line and type otherwise.
+	*/
+	const char *heapProfileFileName;
+	/** Allocations of at least this many bytes get pages of their own straight from mmap, starting on a page boundary
+	and with their header kept elsewhere, and are listed by DisplayLargeBlocks; 0 turns this off (default: 16 MB).
+	Allocations made while a BackingAllocator is in effect always come from it.  Not available on Windows.
+	*/
+	size_t largeBlockThreshold;
+	/** Set to true to ask for transparent huge pages for large blocks of 2 MB or more, which are then also aligned to
+	2 MB (default: false).  Linux only.
+	*/
+	bool largeBlockHugePages;
+	/** Set to true to wait for input after the leak report is displayed at exit (default: true, or false in preload mode).
+	*/
+	bool pauseOnExit;
 	
 	/** @brief Displays current memory allocations in the console according to criteria
 	@param displayNumberOfAllocsFirst Set to true to display the list according to the number of allocations
@@ -244,11 +1092,202 @@ public:
 
 	/** @brief Displays table with allocated object types, the number of times each type appears (i.e., # of blocks), and the
 	percentage of total memory each collection of type <T> objects takes up.  Objects of unknown types are grouped by size
-	and are indicated like so: Unknown type (size: 16 bytes).
+	and are indicated like so: Unknown type (size: 16 bytes).  The types are put together as chosen with
+	SetTypeGrouping and AddTypeGroupRule.
 	*/
 	void DisplayStatTable();
 
-	/** @brief Singleton access
+	/** @brief Chooses how DisplayStatTable and GetTypeGroups put types together, e.g., to see every instantiation of
+	a template as one row.  The grouping of a type is worked out once and kept, so changing it costs a pass over the
+	types the next time the groups are needed.
+		@param grouping How to group the types (the default is GROUP_BY_TYPE)
+	*/
+	void SetTypeGrouping(TypeGrouping grouping);
+
+	/** @brief Adds a rule which puts every type whose name starts with prefix into a group of its own choosing, ahead
+	of the grouping (e.g., "physx::" into "Physics").  Rules are checked in the order they were added.
+		@param prefix Start of the type names; must remain valid for the rest of the program
+		@param group Name of the group; must remain valid for the rest of the program
+		@return True if the rule was added
+	*/
+	bool AddTypeGroupRule(const char *prefix, const char *group);
+
+	/** @brief Removes every rule added with AddTypeGroupRule
+	*/
+	void ClearTypeGroupRules();
+
+	/** @brief Copies the totals of the groups taking up the most memory, largest first.  Only sums up the totals the
+	types already keep and doesn't allocate memory once every type has been grouped, so it is cheap enough to call
+	every frame (e.g., for an in-game overlay).
+		@param groups Destination array
+		@param maxGroups Size of the destination array
+		@return Number of groups copied
+	*/
+	size_t GetTypeGroups(TypeGroupStats *groups, size_t maxGroups);
+
+	/** @brief Displays what memory was made up of (by type and by source line) at the peak, as of the last time the
+	peak grew past peakSnapshotThreshold.  Also shown by DisplayStatTable.
+	@param maxRows Maximum number of types and sites to list (default: 20)
+	*/
+	void DisplayPeakComposition(size_t maxRows = 20);
+
+	/** @brief Displays the call stacks where containers grew the most times (see detectContainerGrowth), with the
+	number of copies and bytes of copying a reserve() at the right size would have saved.
+	@param maxRows Maximum number of stacks to list (default: 20)
+	*/
+	void DisplayGrowthReport(size_t maxRows = 20);
+
+	/** @brief Displays how much memory every thread has allocated and freed, followed by the pairs of threads where
+	one frees memory the other allocated, most frequent first.  Also shown by DisplayStatTable once more than one thread
+	has allocated memory.
+		@param maxRows Maximum number of threads and thread pairs to list (default: 20)
+	*/
+	void DisplayThreadStats(size_t maxRows = 20);
+
+	/** @brief Displays how many allocations were made inside each NoAllocZone, with the call stacks they were made
+	from (most frequent first).  Also shown at exit if there were any.
+		@param maxStacks Maximum number of call stacks to list per zone (default: 5)
+	*/
+	void DisplayNoAllocReport(size_t maxStacks = 5);
+
+	/** @brief Displays every block at or above largeBlockThreshold with its size, type, site, and how much of it is
+	resident in memory (on Linux), i.e., how many of its pages have been touched and not swapped out.  Also shown at
+	exit if any are still allocated.
+	*/
+	void DisplayLargeBlocks();
+
+	/** @brief Retrieves the number of allocations made inside no-alloc zones
+		@param zoneName Name of the zone, or nullptr for all zones (default: nullptr)
+		@return Number of violations so far
+	*/
+	long long GetNoAllocViolations(const char *zoneName = nullptr);
+
+	/** @brief Names the calling thread in DisplayThreadStats
+		@param name Name of the thread; must remain valid for the rest of the program
+	*/
+	void NameCurrentThread(const char *name);
+
+	/** @struct LeakEpoch
+	Handle for a leak epoch, returned by BeginLeakEpoch.
+	*/
+	struct LeakEpoch
+	{
+		//! Number of the first allocation which belongs to the epoch
+		uint64_t firstAllocation;
+		//! Number of the thread whose allocations belong to the epoch (as in DisplayThreadStats), or 0 for all threads
+		unsigned int thread;
+	};
+
+	/** @brief Starts a leak epoch: EndLeakEpoch will report the blocks allocated from here on which are still allocated
+	at that point.  Use one per request, level, or other unit of work which should free everything it allocates.
+	Epochs can overlap and be nested.  While any epoch is open, every allocation is logged, so EndLeakEpoch only has
+	to look at the blocks allocated during the epoch, however large the rest of the heap is.
+		@param currentThreadOnly Set to true to only include the calling thread's allocations, e.g., for a request
+		handled on one thread while other threads keep allocating (default: false)
+		@return Handle to pass to EndLeakEpoch
+	*/
+	LeakEpoch BeginLeakEpoch(bool currentThreadOnly = false);
+
+	/** @brief Ends a leak epoch and reports the blocks allocated during it which haven't been freed, oldest first
+		@param epoch Handle returned by BeginLeakEpoch
+		@param displayLeaks Set to true to list the blocks in the console (default: true)
+		@return Number of blocks allocated during the epoch which are still allocated
+	*/
+	long long EndLeakEpoch(const LeakEpoch &epoch, bool displayLeaks = true);
+
+	/** @brief Writes all current allocations to a compact binary file (see HeapDump.h) which can be examined with the
+	HeapQuery tool.  Much faster than the text reports for large heaps.
+	@param fileName Name of the file to create
+	@return True if the dump was written successfully
+	*/
+	bool WriteHeapDump(const char *fileName);
+
+	/** @brief Writes how many blocks of each size have been allocated so far (whether or not they were freed since) to
+	a text file, one "size count" line per size.  The sizes include the tracer's header, since that is what a backing
+	allocator is asked for.  SizeClassPool::LoadSizeClasses can pick a pool's size classes from the file.
+	@param fileName Name of the file to create
+	@return True if the file was written successfully
+	*/
+	bool ExportSizeHistogram(const char *fileName);
+
+	/** @enum ProfileKey
+	What the entries of an exported heap profile are.
+	*/
+	enum ProfileKey
+	{
+		PROFILE_BY_SITE,	/**< Source line and type of the allocations (a two-frame stack, line first) */
+		PROFILE_BY_STACK	/**< Call stack of the allocations (requires captureAllocationStacks) */
+	};
+
+	/** @enum ProfileValue
+	Measure written for each entry of a folded-stack profile.
+	*/
+	enum ProfileValue
+	{
+		PROFILE_LIVE_BYTES,			/**< Memory still allocated */
+		PROFILE_LIVE_BLOCKS,		/**< Blocks still allocated */
+		PROFILE_ALLOCATED_BYTES,	/**< Memory allocated so far, including what was freed since */
+		PROFILE_ALLOCATED_BLOCKS	/**< Blocks allocated so far, including those freed since */
+	};
+
+	/** @brief Writes a heap profile in the folded-stack format used by flame graph tools (one "frame;frame;... value"
+	line per entry, outermost frame first).  Entries with a value of 0 are left out.  The lines are written as they are
+	produced, so the file can be any size.
+		@param fileName Name of the file to create
+		@param key Whether the entries are source lines and types, or call stacks (default: PROFILE_BY_SITE)
+		@param value Measure to write (default: PROFILE_LIVE_BYTES)
+		@return True if the file was written successfully
+	*/
+	bool ExportFoldedStacks(const char *fileName, ProfileKey key = PROFILE_BY_SITE,
+		ProfileValue value = PROFILE_LIVE_BYTES);
+
+	/** @brief Writes a heap profile which pprof can read (an uncompressed profile.proto message).  Every sample has
+	four values: allocated blocks and bytes (alloc_objects, alloc_space) and live blocks and bytes (inuse_objects,
+	inuse_space, the default).  The messages are written as they are produced, so the file can be any size.
+		@param fileName Name of the file to create
+		@param key Whether the samples are source lines and types, or call stacks (default: PROFILE_BY_SITE)
+		@return True if the file was written successfully
+	*/
+	bool ExportPprof(const char *fileName, ProfileKey key = PROFILE_BY_SITE);
+
+	/** @struct PoolBenchmarkRun
+	Measurements from running a workload on one backing allocator (see BenchmarkPool).
+	*/
+	struct PoolBenchmarkRun
+	{
+		//! Number of allocations made during the run (by all threads)
+		long long allocations;
+		//! Time the fastest run took, in seconds
+		double seconds;
+		double allocationsPerSecond;
+		//! Cache misses of the calling thread during the fastest run, or -1 if they couldn't be counted
+		long long cacheMisses;
+	};
+
+	/** @struct PoolBenchmarkResult
+	Results of BenchmarkPool.
+	*/
+	struct PoolBenchmarkResult
+	{
+		PoolBenchmarkRun withoutPool;
+		PoolBenchmarkRun withPool;
+	};
+
+	/** @brief Runs the same workload with and without a pool behind operator new, to see whether the pool is worth
+	using.  The two are alternated and the fastest run of each is kept.  The pool is only selected on the calling
+	thread (as with ScopedBackingAllocator), and both runs include the tracer's own bookkeeping.  Cache misses are
+	counted with the hardware counters on Linux, if the system allows it.
+		@param workload Function which makes the allocations; it must free everything it allocates
+		@param context Passed to workload
+		@param pool Allocator to compare with malloc
+		@param repetitions Number of times to run the workload on each (default: 3)
+		@param displayResults Set to true to display the comparison in the console (default: true)
+		@return Allocation rate and cache misses with and without the pool
+	*/
+	PoolBenchmarkResult BenchmarkPool(void (*workload)(void*), void *context, BackingAllocator &pool,
+		unsigned int repetitions = 3, bool displayResults = true);
+
+	/** @brief Singleton access.  Safe to call at any time, including during static initialization and destruction.
 	@return Reference to singleton object
 	*/
 	static MemoryTracer& Get();
@@ -273,6 +1312,61 @@ public:
 	*/
 	size_t GetPeakMemory();	
 
+	/** @brief Starts a background thread which records the memory counters (see MemorySample) at a fixed interval into a
+	ring buffer, so you can see how memory use changed over time rather than just its peak.  The sampler never takes the
+	lock used by allocations, so it doesn't slow them down.  Restarting the sampler discards the previous samples.
+		@param intervalMilliseconds Time between samples (default: 100)
+		@param capacity Number of samples kept; once it is full, the oldest are overwritten (default: 3000)
+		@return True if the sampler was started
+	*/
+	bool StartSampler(unsigned int intervalMilliseconds = 100, size_t capacity = 3000);
+
+	/** @brief Stops the sampler thread.  The samples taken so far are kept.
+	*/
+	void StopSampler();
+
+	/** @brief Copies the samples taken so far, oldest first
+		@param samples Destination array
+		@param maxSamples Size of the destination array; if there are more samples, only the newest are copied
+		@return Number of samples copied
+	*/
+	size_t GetSamples(MemorySample *samples, size_t maxSamples);
+
+	/** @brief Writes the samples taken so far to a CSV file, one row per sample
+		@param fileName Name of the file to create
+		@return True if the file was written successfully
+	*/
+	bool ExportSamplesCSV(const char *fileName);
+
+	/** @brief Writes the samples taken so far to a JSON file
+		@param fileName Name of the file to create
+		@return True if the file was written successfully
+	*/
+	bool ExportSamplesJSON(const char *fileName);
+
+	/** @brief Starts recording a timeline of memory use in Chrome's trace event format, which chrome://tracing and the
+	Perfetto UI open.  The timeline has counter tracks of the current memory and blocks, an instant event for every
+	large allocation, a slice for the lifetime of every block with a type (grouped by type), and the markers added with
+	Mark.  Each thread collects its events in a chunk of its own, and a background thread writes out the full chunks,
+	so recording costs little more than reading the clock.  Restarting the timeline finishes the previous file.
+		@param fileName Name of the file to create
+		@param largeAllocationSize Size from which allocations get an instant event (default: 1 MB)
+		@return True if the file was created and the timeline started
+	*/
+	bool StartTimeline(const char *fileName, size_t largeAllocationSize = 1 << 20);
+
+	/** @brief Writes out the rest of the timeline and closes its file.  Called at exit if the timeline is still
+	running.
+		@return True if the timeline was running and its file was written successfully
+	*/
+	bool StopTimeline();
+
+	/** @brief Adds a marker to the timeline (e.g., at the start of every frame), drawn across all threads.  Does nothing
+	unless the timeline is running.
+		@param name Name of the marker; must remain valid until the timeline is stopped
+	*/
+	void Mark(const char *name);
+
 #ifdef _WIN32
 	/** @brief Calls Windows-specific function to check the state of the heap and display a message in the console 
 	indicating said state
@@ -280,6 +1374,77 @@ public:
 	void HeapCheck();
 #endif
 
+#ifdef __linux__
+	/** @struct LeakScanSummary
+	Results of a reachability scan (see ScanForLeaks).
+	*/
+	struct LeakScanSummary
+	{
+		//! Blocks which aren't referenced from anywhere
+		long long definitelyLostBlocks;
+		size_t definitelyLostBytes;
+		//! Blocks which are only referenced from lost blocks (e.g., the nodes of a leaked list)
+		long long indirectlyLostBlocks;
+		size_t indirectlyLostBytes;
+		//! Blocks which can still be reached, and therefore aren't leaks even if they are never freed
+		long long reachableBlocks;
+		size_t reachableBytes;
+		//! False if memory ran out before the scan could finish, in which case the counts are all zero
+		bool completed;
+	};
+
+	/** @brief Finds leaked blocks by following pointers from the roots (the data and bss segments of every loaded
+	module, the calling thread's stack and registers, the stacks of the other threads which have allocated or freed
+	memory, and any regions added with AddRootRegion) through the tracked blocks, similar to a conservative garbage
+	collector's mark phase.  The mark is spread over all available cores.  Other threads should be idle while this
+	runs; their registers can't be read, so a block only they point to is reported as lost.
+		@param displayLeaks Set to true to list the lost blocks in the console (default: true)
+		@return Number and size of the definitely lost, indirectly lost, and still reachable blocks
+	*/
+	LeakScanSummary ScanForLeaks(bool displayLeaks = true);
+
+	/** @brief Adds a memory range which ScanForLeaks should treat as a root (e.g., another thread's stack)
+		@param begin Start of the range
+		@param size Size of the range in bytes
+	*/
+	void AddRootRegion(const void *begin, size_t size);
+
+	/** @brief Removes a range previously added with AddRootRegion
+		@param begin Start of the range
+	*/
+	void RemoveRootRegion(const void *begin);
+
+	/** @brief Keeps the records of live blocks in a scratch file, so that only the records of the newest blocks take up
+	memory, for heaps with tens of millions of blocks.  The records of older blocks are written out every so often and
+	read back when a report or a free needs them.
+		@param fileName File to create; it is removed as soon as it is open
+		@param residentRecords Number of the newest records to keep in memory (default: 1M, i.e., 16 MB)
+		@return True if the records are now kept in the file
+	*/
+	bool EnableRecordSpilling(const char *fileName, size_t residentRecords = 1 << 20);
+#endif
+
+#ifndef _WIN32
+	/** @brief Starts a background thread which writes a heap dump (see WriteHeapDump) whenever the given signal arrives
+	or RequestHeapSnapshot is called.  The dump is taken from a forked copy of the process, so the program only pauses
+	for as long as fork() takes, and it is named <filePrefix>.<pid>.<number>.dump.
+		@param filePrefix Path and file name prefix for the dumps; must remain valid for the rest of the program
+		@param signalNumber Signal which triggers a dump, or 0 to only allow RequestHeapSnapshot (default: SIGUSR2)
+		@return True if snapshots were enabled
+	*/
+	bool EnableHeapSnapshots(const char *filePrefix, int signalNumber = SIGUSR2);
+
+	/** @brief Asks the snapshot thread started by EnableHeapSnapshots to write a dump, without waiting for it
+	*/
+	void RequestHeapSnapshot();
+
+	/** @brief Writes a heap dump from a forked copy of the process and waits for it to finish
+		@param fileName Name of the file to create
+		@return True if the dump was written successfully
+	*/
+	bool WriteHeapSnapshot(const char *fileName);
+#endif
+
 	// These declarations make the new and delete operators friends to provide access to allocation and deallocation
 	// routines (they are private to prevent users from arbitrarily calling them).
 	
@@ -305,6 +1470,14 @@ public:
 	*/
 	friend void operator delete(void *ptr, const std::nothrow_t&);
 
+#ifdef __cpp_sized_deallocation
+	/** @brief Non-array operator delete with the size of the object, as called by C++14 code.  Exception version.
+		@param ptr Pointer to object to be deleted
+		@param size Size of the object (unused; the block's own size is what counts)
+	*/
+	friend void operator delete(void *ptr, size_t size);
+#endif
+
 
 	/** @brief Array operator new.  Exception version.
 		@param size Allocation size
@@ -327,6 +1500,14 @@ public:
 		@param ptr Pointer to object to be deleted
 	*/
 	friend void operator delete[](void *ptr, const std::nothrow_t&);
+
+#ifdef __cpp_sized_deallocation
+	/** @brief Array operator delete with the size of the object, as called by C++14 code.  Exception version.
+		@param ptr Pointer to object to be deleted
+		@param size Size of the object (unused; the block's own size is what counts)
+	*/
+	friend void operator delete[](void *ptr, size_t size);
+#endif
 	
 	template<typename T>
 	friend T* operator*(const SourcePacket& packet, T* p);
@@ -340,32 +1521,20 @@ public:
 template<typename T>
 T* operator*(const SourcePacket& packet, T* p)
 {
-	if(p)
+	MemoryTracer *tracer = MemoryTracer::Instance();
+	if(p && tracer)
 	{
-		const char *type = nullptr;
-		try
-		{
-			 type = typeid(*p).name();
-		}
-		// bad RTTI
-		catch(std::bad_typeid& e)
-		{
-			std::cout << e.what() << "\n";
-			return p;
-		}
-
-		MemoryTracer::Get().AddAllocationDetails(p, packet.file, packet.line, type, sizeof(*p));
+		const char *type = TypeTag<T>::Name();
+		// new[] puts the element count in front of arrays of objects with destructors, padded to T's alignment
+		tracer->AddAllocationDetails(p, packet.file, packet.line, type,
+			alignof(T) > sizeof(size_t) ? alignof(T) : sizeof(size_t));
 		
-		if(MemoryTracer::Get().showAllAllocs)
+		if(tracer->showAllAllocs)
 		{
-			std::cout << "Allocation Information Trace >\n\tObject Type: " << type << "\n\tFile: " << packet.file 
+			TraceWriter out(stdout);
+			out << "Allocation Information Trace >\n\tObject Type: " << type << "\n\tFile: " << packet.file 
 				<< "\n\tLine: " << packet.line << "\n\n";
 		}
-
-		size_t objectSize = MemoryTracer::Get().RetrieveAddrSize(p);
-		assert(objectSize != -1);
-		// we need to send the size in case the ptr is pointing to an array, in which case sizeof(*p) would be wrong
-		MemoryTracer::Get().AddToTypeList(type, objectSize);
 	}
 	return p;
 }
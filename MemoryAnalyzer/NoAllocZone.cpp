@@ -0,0 +1,181 @@
+#include "MemoryTracer.h"
+
+#include <algorithm>
+#include <cstring>
+#include <new>
+
+using namespace std;
+
+
+thread_local NoAllocZone *NoAllocZone::current = nullptr;
+
+// Number of frames of each call stack shown in the console (the innermost ones, where the allocation was made)
+static const int reportFrames = 6;
+
+// Writes the innermost frames of a call stack, one per line
+static void WriteFrames(TraceWriter &out, void *const *frames, int frameCount)
+{
+	for(int f = 0; f < min(frameCount, reportFrames); f++)
+	{
+		out << "\n\t\t" << static_cast<const void*>(frames[f]);
+		char *demangled;
+		const char *symbol = FindSymbolName(frames[f], demangled);
+		if(symbol)
+		{
+			// template names can be enormous; the start is the informative part
+			out << " ";
+			out.Write(symbol, min<size_t>(strlen(symbol), 100));
+		}
+		free(demangled);
+	}
+}
+
+void MemoryTracer::RecordNoAllocViolation(NoAllocZone *zone, size_t size, AllocationType type, int callerFrames)
+{
+	if(zone->allowance)
+	{
+		zone->allowance--;
+		return;
+	}
+
+	// RecordNoAllocViolation, RecordAllocation, and its callers in the tracer are the same for every violation, so
+	// they are left out
+	void *frames[MEMORYTRACER_PROFILE_STACK_DEPTH];
+	int frameCount = CaptureStack(frames, MEMORYTRACER_PROFILE_STACK_DEPTH, 2 + callerFrames);
+
+	// zones are found by name pointer, falling back to comparing the names (as types are)
+	NoAllocZoneStats *stats = nullptr;
+	long long *knownIndex = zoneIds.Find(reinterpret_cast<uintptr_t>(zone->name), 0);
+	if(knownIndex)
+	{
+		stats = zoneTable[*knownIndex];
+	}
+	for(size_t i = 0; i < zoneCount && !stats; i++)
+	{
+		if(!strcmp(zoneTable[i]->name, zone->name))
+		{
+			stats = zoneTable[i];
+			zoneIds.FindOrAdd(reinterpret_cast<uintptr_t>(zone->name), 0, i);
+		}
+	}
+	if(!stats)
+	{
+		stats = static_cast<NoAllocZoneStats*>(malloc(sizeof(NoAllocZoneStats)));
+		if(stats && GrowArray(zoneTable, zoneTableCapacity, zoneCount + 1)
+			&& zoneIds.FindOrAdd(reinterpret_cast<uintptr_t>(zone->name), 0, zoneCount))
+		{
+			new(stats) NoAllocZoneStats;
+			stats->name = zone->name;
+			stats->violations = 0;
+			stats->bytes = 0;
+			zoneTable[zoneCount++] = stats;
+		}
+		else
+		{
+			free(stats);
+			stats = nullptr;
+		}
+	}
+	if(stats)
+	{
+		stats->violations++;
+		stats->bytes += size;
+		// the stacks go in the heap profile's stack table, which already de-duplicates them
+		uint32_t stack = InternProfileStack(frames, frameCount);
+		long long *stackViolations = stack ? stats->stacks.FindOrAdd(stack, 0, 0) : nullptr;
+		if(stackViolations)
+		{
+			(*stackViolations)++;
+		}
+	}
+
+	if(zone->policy != NOALLOC_COUNT)
+	{
+		TraceWriter out(stdout);
+		out << "No-alloc zone \"" << zone->name << "\" violated: " << size << " bytes (" << GetAllocTypeAsString(type)
+			<< ")";
+		WriteFrames(out, frames, frameCount);
+		out << "\n\n";
+	}
+	if(zone->policy == NOALLOC_ABORT)
+	{
+		fflush(stdout);
+		abort();
+	}
+}
+
+long long MemoryTracer::GetNoAllocViolations(const char *zoneName)
+{
+	lock_guard<recursive_mutex> guard(tracerLock);
+	long long violations = 0;
+	for(size_t i = 0; i < zoneCount; i++)
+	{
+		if(!zoneName || !strcmp(zoneTable[i]->name, zoneName))
+		{
+			violations += zoneTable[i]->violations;
+		}
+	}
+	return violations;
+}
+
+void MemoryTracer::DisplayNoAllocReport(size_t maxStacks)
+{
+	lock_guard<recursive_mutex> guard(tracerLock);
+	long long allocationsBefore = totalAllocations;
+	TraceWriter out(stdout);
+	if(!zoneCount)
+	{
+		out << "No allocations were made inside no-alloc zones\n\n";
+		return;
+	}
+
+	out << TraceWriter::Width(32) << "No-alloc zone"
+		<< TraceWriter::Width(14) << "Violations"
+		<< "Bytes"
+		<< "\n====================================================";
+	for(size_t i = 0; i < zoneCount; i++)
+	{
+		const NoAllocZoneStats *stats = zoneTable[i];
+		out << "\n" << TraceWriter::Width(32, '.') << stats->name
+			<< TraceWriter::Width(14, '.') << stats->violations
+			<< stats->bytes;
+
+		// most frequent stacks first
+		uint32_t *stacks = static_cast<uint32_t*>(malloc((maxStacks + 1) * sizeof(uint32_t)));
+		long long *counts = static_cast<long long*>(malloc((maxStacks + 1) * sizeof(long long)));
+		size_t shown = 0;
+		if(stacks && counts)
+		{
+			stats->stacks.ForEach([&](uintptr_t stack, int, long long count)
+			{
+				// insertion into the short list of the largest counts so far
+				size_t position = shown < maxStacks ? shown++ : maxStacks;
+				while(position > 0 && counts[position - 1] < count)
+				{
+					if(position < maxStacks)
+					{
+						stacks[position] = stacks[position - 1];
+						counts[position] = counts[position - 1];
+					}
+					position--;
+				}
+				if(position < maxStacks)
+				{
+					stacks[position] = static_cast<uint32_t>(stack);
+					counts[position] = count;
+				}
+			});
+		}
+		for(size_t s = 0; s < shown; s++)
+		{
+			const ProfileStack &stack = profileStacks[stacks[s]];
+			out << "\n\t" << counts[s] << " violation(s) at:";
+			WriteFrames(out, stack.frames, stack.frameCount);
+		}
+		free(stacks);
+		free(counts);
+	}
+	out << "\n\n";
+	out.Flush();
+	assert(totalAllocations == allocationsBefore);
+}
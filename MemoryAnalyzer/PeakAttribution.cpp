@@ -0,0 +1,228 @@
+#include "MemoryTracer.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdio.h>
+
+using namespace std;
+
+
+// Makes sure a snapshot array can hold count entries; returns false if it couldn't be grown
+static bool ReserveEntries(void *&entries, size_t &capacity, size_t count, size_t entrySize)
+{
+	if(count <= capacity)
+	{
+		return true;
+	}
+	size_t newCapacity = max(count, capacity * 2);
+	void *newEntries = realloc(entries, newCapacity * entrySize);
+	if(!newEntries)
+	{
+		return false;
+	}
+	entries = newEntries;
+	capacity = newCapacity;
+	return true;
+}
+
+void MemoryTracer::CapturePeakSnapshot()
+{
+	// the type and site lists are kept up to date on every allocation, so taking the snapshot is just a copy of a few
+	// totals per type and site rather than a walk over every block
+	size_t typeCount = 0, siteCount = 0;
+	for(TypeNode *type = head_types; type; type = type->next)
+	{
+		typeCount++;
+	}
+	for(SiteNode *site = head_sites; site; site = site->next)
+	{
+		siteCount++;
+	}
+	void *types = peakSnapshot.types, *sites = peakSnapshot.sites;
+	bool reserved = ReserveEntries(types, peakSnapshot.typeCapacity, typeCount, sizeof(PeakEntry))
+		&& ReserveEntries(sites, peakSnapshot.siteCapacity, siteCount, sizeof(PeakEntry));
+	peakSnapshot.types = static_cast<PeakEntry*>(types);
+	peakSnapshot.sites = static_cast<PeakEntry*>(sites);
+	if(!reserved)
+	{
+		return;
+	}
+
+	peakSnapshot.typeCount = 0;
+	for(TypeNode *type = head_types; type; type = type->next)
+	{
+		if(type->blocks > 0)
+		{
+			PeakEntry &entry = peakSnapshot.types[peakSnapshot.typeCount++];
+			entry.type = type->type;
+			entry.file = nullptr;
+			entry.line = 0;
+			entry.blocks = type->blocks;
+			entry.memSize = type->memSize;
+		}
+	}
+	peakSnapshot.siteCount = 0;
+	for(SiteNode *site = head_sites; site; site = site->next)
+	{
+		if(site->blocks > 0)
+		{
+			PeakEntry &entry = peakSnapshot.sites[peakSnapshot.siteCount++];
+			entry.type = nullptr;
+			entry.file = site->file;
+			entry.line = site->line;
+			entry.blocks = site->blocks;
+			entry.memSize = site->memSize;
+		}
+	}
+	peakSnapshot.memory = currentMemory;
+	peakSnapshot.blocks = currentBlocks;
+	peakSnapshot.allocation = totalAllocations;
+
+	size_t growth = static_cast<size_t>(peakSnapshot.memory * (peakSnapshotThreshold > 0 ? peakSnapshotThreshold : 0));
+	nextPeakSnapshot = peakSnapshot.memory + max<size_t>(growth, 1);
+}
+
+void MemoryTracer::DetailPeakSnapshot(uint32_t typeId, uint32_t siteId, size_t size)
+{
+	peakSnapshot.allocation = 0;
+	// the entries point to the same names and files as the lists, so they can be matched by pointer
+	auto addTo = [&](PeakEntry *&entries, size_t &count, size_t &capacity, const char *type, const char *file,
+		int line)
+	{
+		for(size_t i = 0; i < count; i++)
+		{
+			if(entries[i].type == type && entries[i].file == file && entries[i].line == line)
+			{
+				entries[i].blocks++;
+				entries[i].memSize += size;
+				return;
+			}
+		}
+		// if the entry can't be added, the block stays unknown
+		void *grown = entries;
+		bool reserved = ReserveEntries(grown, capacity, count + 1, sizeof(PeakEntry));
+		entries = static_cast<PeakEntry*>(grown);
+		if(reserved)
+		{
+			PeakEntry &entry = entries[count++];
+			entry.type = type;
+			entry.file = file;
+			entry.line = line;
+			entry.blocks = 1;
+			entry.memSize = size;
+		}
+	};
+	if(typeId)
+	{
+		addTo(peakSnapshot.types, peakSnapshot.typeCount, peakSnapshot.typeCapacity, TypeName(typeId), nullptr, 0);
+	}
+	if(siteId)
+	{
+		addTo(peakSnapshot.sites, peakSnapshot.siteCount, peakSnapshot.siteCapacity, nullptr, SiteFile(siteId),
+			SiteLine(siteId));
+	}
+}
+
+void MemoryTracer::DisplayPeakComposition(size_t maxRows)
+{
+	lock_guard<recursive_mutex> guard(tracerLock);
+	TraceWriter out(stdout);
+	if(!peakSnapshot.memory)
+	{
+		out << "No peak composition recorded yet\n\n";
+		return;
+	}
+
+	auto bySize = [](const PeakEntry &a, const PeakEntry &b)
+	{
+		return a.memSize > b.memSize;
+	};
+	size_t typeRows = min(maxRows, peakSnapshot.typeCount);
+	size_t siteRows = min(maxRows, peakSnapshot.siteCount);
+	partial_sort(peakSnapshot.types, peakSnapshot.types + typeRows, peakSnapshot.types + peakSnapshot.typeCount, bySize);
+	partial_sort(peakSnapshot.sites, peakSnapshot.sites + siteRows, peakSnapshot.sites + peakSnapshot.siteCount, bySize);
+
+	size_t taggedMemory = 0;
+	long long taggedBlocks = 0;
+	for(size_t i = 0; i < peakSnapshot.typeCount; i++)
+	{
+		taggedMemory += peakSnapshot.types[i].memSize;
+		taggedBlocks += peakSnapshot.types[i].blocks;
+	}
+
+	// site names keep the end of long paths, since that's the part which identifies the file
+	auto siteName = [](const PeakEntry &site, char *name)
+	{
+		char line[16];
+		size_t lineLength = static_cast<size_t>(snprintf(line, sizeof(line), ":%d", site.line));
+		size_t room = maxTypeNameLength - lineLength;
+		size_t length = strlen(site.file);
+		if(length > room)
+		{
+			snprintf(name, maxTypeNameLength + 1, "...%s%s", site.file + length - (room - 3), line);
+		}
+		else
+		{
+			snprintf(name, maxTypeNameLength + 1, "%s%s", site.file, line);
+		}
+		return name;
+	};
+
+	// both tables share a name column as wide as the longest name shown, as in DisplayStatTable
+	size_t nameColumn = 30;
+	char siteText[maxTypeNameLength + 1];
+	for(size_t i = 0; i < typeRows; i++)
+	{
+		nameColumn = max(nameColumn, min(strlen(peakSnapshot.types[i].type), maxTypeNameLength));
+	}
+	for(size_t i = 0; i < siteRows; i++)
+	{
+		nameColumn = max(nameColumn, strlen(siteName(peakSnapshot.sites[i], siteText)));
+	}
+	nameColumn += 2;
+
+	auto displayHeading = [&](const char *title)
+	{
+		out << TraceWriter::Width(static_cast<int>(nameColumn)) << title
+			<< TraceWriter::Width(12) << "Blocks" 
+			<< TraceWriter::Width(12) << "Memory" 
+			<< TraceWriter::Width(5) << "%";
+		out << "\n";
+		for(size_t i = 0; i < nameColumn + 28; i++)
+		{
+			out << '=';
+		}
+	};
+	auto displayRow = [&](const char *name, long blocks, size_t memSize)
+	{
+		float memPercent = (static_cast<float>(memSize) / static_cast<float>(peakSnapshot.memory)) * 100;
+		char shortName[maxTypeNameLength + 1];
+		out << "\n" << TraceWriter::Width(static_cast<int>(nameColumn), '.') << ShortTypeName(name, shortName)
+			<< TraceWriter::Width(12, '.') << blocks 
+			<< TraceWriter::Width(12, '.') << memSize
+			<< TraceWriter::Width(5) << TraceWriter::Fixed(memPercent, 1);
+	};
+
+	out << "Composition at peak: " << peakSnapshot.memory << " bytes in " << peakSnapshot.blocks
+		<< " blocks (peak memory: " << peakMemory << " bytes)\n";
+	displayHeading("Object Type");
+	for(size_t i = 0; i < typeRows; i++)
+	{
+		displayRow(peakSnapshot.types[i].type, peakSnapshot.types[i].blocks, peakSnapshot.types[i].memSize);
+	}
+	// blocks allocated without DEBUG_NEW don't have a type or site, but still count towards the peak
+	if(peakSnapshot.memory > taggedMemory || peakSnapshot.blocks > taggedBlocks)
+	{
+		displayRow(unknown, static_cast<long>(peakSnapshot.blocks - taggedBlocks),
+			peakSnapshot.memory > taggedMemory ? peakSnapshot.memory - taggedMemory : 0);
+	}
+
+	out << "\n\n";
+	displayHeading("Allocation Site");
+	for(size_t i = 0; i < siteRows; i++)
+	{
+		const PeakEntry &site = peakSnapshot.sites[i];
+		displayRow(siteName(site, siteText), site.blocks, site.memSize);
+	}
+	out << "\n\n";
+}
@@ -0,0 +1,158 @@
+#include "MemoryTracer.h"
+
+#include <chrono>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+
+// Opens a hardware counter for the calling thread's cache misses; returns -1 if it isn't available (other platforms,
+// virtual machines without a PMU, or a perf_event_paranoid setting which doesn't allow it)
+static int OpenCacheMissCounter()
+{
+#ifdef __linux__
+	perf_event_attr attributes;
+	memset(&attributes, 0, sizeof(attributes));
+	attributes.size = sizeof(attributes);
+	attributes.type = PERF_TYPE_HARDWARE;
+	attributes.config = PERF_COUNT_HW_CACHE_MISSES;
+	attributes.disabled = 1;
+	attributes.exclude_kernel = 1;
+	attributes.exclude_hv = 1;
+	return static_cast<int>(syscall(__NR_perf_event_open, &attributes, 0, -1, -1, 0));
+#else
+	return -1;
+#endif
+}
+
+static void StartCounter(int counter)
+{
+#ifdef __linux__
+	if(counter >= 0)
+	{
+		ioctl(counter, PERF_EVENT_IOC_RESET, 0);
+		ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+	}
+#endif
+}
+
+// Stops the counter and returns its count, or -1 if there is no counter
+static long long StopCounter(int counter)
+{
+#ifdef __linux__
+	long long count;
+	if(counter >= 0)
+	{
+		ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+		if(read(counter, &count, sizeof(count)) == sizeof(count))
+		{
+			return count;
+		}
+	}
+#endif
+	return -1;
+}
+
+static void CloseCounter(int counter)
+{
+#ifdef __linux__
+	if(counter >= 0)
+	{
+		close(counter);
+	}
+#endif
+}
+
+MemoryTracer::PoolBenchmarkResult MemoryTracer::BenchmarkPool(void (*workload)(void*), void *context,
+	BackingAllocator &pool, unsigned int repetitions, bool displayResults)
+{
+	typedef chrono::steady_clock Clock;
+
+	PoolBenchmarkRun runs[2];
+	for(PoolBenchmarkRun &run : runs)
+	{
+		run.allocations = 0;
+		run.seconds = -1;
+		run.allocationsPerSecond = 0;
+		run.cacheMisses = -1;
+	}
+
+	int counter = OpenCacheMissCounter();
+	for(unsigned int i = 0; i < (repetitions ? repetitions : 1); i++)
+	{
+		// alternating the two keeps anything which drifts during the benchmark (other processes, clock speed) from
+		// favoring either one
+		for(int usePool = 0; usePool < 2; usePool++)
+		{
+			ScopedBackingAllocator scope(usePool ? &pool : nullptr);
+			long long allocationsBefore = totalAllocations;
+			StartCounter(counter);
+			Clock::time_point start = Clock::now();
+			workload(context);
+			double seconds = chrono::duration<double>(Clock::now() - start).count();
+			long long cacheMisses = StopCounter(counter);
+
+			PoolBenchmarkRun &run = runs[usePool];
+			if(run.seconds < 0 || seconds < run.seconds)
+			{
+				run.allocations = totalAllocations - allocationsBefore;
+				run.seconds = seconds;
+				run.allocationsPerSecond = seconds > 0 ? run.allocations / seconds : 0;
+				run.cacheMisses = cacheMisses;
+			}
+		}
+	}
+	CloseCounter(counter);
+
+	PoolBenchmarkResult result;
+	result.withoutPool = runs[0];
+	result.withPool = runs[1];
+
+	if(displayResults)
+	{
+		TraceWriter out(stdout);
+		out << TraceWriter::Width(16) << "Allocator"
+			<< TraceWriter::Width(14) << "Allocations"
+			<< TraceWriter::Width(12) << "Seconds"
+			<< TraceWriter::Width(16) << "Allocs/sec"
+			<< "Cache misses";
+		out << "\n====================================================================";
+		const char *names[2] = { "malloc", pool.GetName() };
+		for(int r = 0; r < 2; r++)
+		{
+			out << "\n" << TraceWriter::Width(16, '.') << names[r]
+				<< TraceWriter::Width(14, '.') << runs[r].allocations
+				<< TraceWriter::Width(12, '.') << TraceWriter::Fixed(runs[r].seconds, 4)
+				<< TraceWriter::Width(16, '.') << TraceWriter::Fixed(runs[r].allocationsPerSecond, 0);
+			if(runs[r].cacheMisses >= 0)
+			{
+				out << runs[r].cacheMisses;
+			}
+			else
+			{
+				out << "n/a";
+			}
+		}
+		if(runs[0].allocationsPerSecond > 0)
+		{
+			out << "\n\nAllocs/sec with " << pool.GetName() << ": "
+				<< TraceWriter::Fixed((runs[1].allocationsPerSecond / runs[0].allocationsPerSecond - 1) * 100, 1, true) << "%";
+		}
+		if(runs[0].cacheMisses > 0 && runs[1].cacheMisses >= 0)
+		{
+			out << "\nCache misses with " << pool.GetName() << ": "
+				<< TraceWriter::Fixed(static_cast<double>(runs[1].cacheMisses - runs[0].cacheMisses), 0, true) << " ("
+				<< TraceWriter::Fixed((static_cast<double>(runs[1].cacheMisses) / runs[0].cacheMisses - 1) * 100, 1, true)
+				<< "%)";
+		}
+		out << "\n\n";
+	}
+	return result;
+}
@@ -0,0 +1,46 @@
+#include "MemoryTracer.h"
+
+#include <algorithm>
+#include <cstring>
+
+#ifdef _WIN32
+#include <windows.h>
+#elif defined(__GLIBC__)
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <execinfo.h>
+#endif
+
+using namespace std;
+
+
+int CaptureStack(void **frames, int maxFrames, int skip)
+{
+#ifdef _WIN32
+	return CaptureStackBackTrace(skip + 1, maxFrames, frames, nullptr);
+#elif defined(__GLIBC__)
+	void *stack[96];
+	assert(maxFrames + skip + 1 <= static_cast<int>(sizeof(stack) / sizeof(stack[0])));
+	int count = backtrace(stack, min(maxFrames + skip + 1, static_cast<int>(sizeof(stack) / sizeof(stack[0]))));
+	int captured = max(count - skip - 1, 0);
+	memcpy(frames, stack + skip + 1, captured * sizeof(void*));
+	return captured;
+#else
+	return 0;
+#endif
+}
+
+const char* FindSymbolName(const void *address, char *&demangled)
+{
+	demangled = nullptr;
+#if !defined(_WIN32) && defined(__GLIBC__)
+	Dl_info info;
+	if(dladdr(address, &info) && info.dli_sname)
+	{
+		int status;
+		demangled = abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+		return status == 0 && demangled ? demangled : info.dli_sname;
+	}
+#endif
+	return nullptr;
+}
@@ -0,0 +1,340 @@
+#include "MemoryTracer.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <new>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#endif
+
+using namespace std;
+
+
+thread_local MemoryTracer::ThreadStats *MemoryTracer::currentThreadStats = nullptr;
+thread_local MemoryTracer::ThreadExitHook MemoryTracer::threadExitHook;
+thread_local bool MemoryTracer::threadExited = false;
+
+// Block headers only have room for thread numbers up to this; blocks of later threads have no owner
+static const unsigned int maxHeaderThread = 0xFFFF;
+
+static unsigned long long SystemThreadId()
+{
+#ifdef _WIN32
+	return GetCurrentThreadId();
+#elif defined(__linux__)
+	return static_cast<unsigned long long>(syscall(SYS_gettid));
+#else
+	// pthread_t is an integer on some systems and a pointer on others
+	return (unsigned long long)(uintptr_t)pthread_self();
+#endif
+}
+
+MemoryTracer::ThreadStats* MemoryTracer::CurrentThreadStats()
+{
+	if(currentThreadStats || threadExited)
+	{
+		return currentThreadStats;
+	}
+	ThreadStats *thread;
+	// once block headers have no room for more numbers, the records of threads which have exited are handed out
+	// again, so a program which keeps starting threads doesn't lose track of them
+	if(threadCount >= maxHeaderThread && exitedThreadCount)
+	{
+		thread = threadTable[exitedThreads[--exitedThreadCount]];
+		thread->earlierThreads++;
+	}
+	else
+	{
+		thread = static_cast<ThreadStats*>(malloc(sizeof(ThreadStats)));
+		if(!thread || !GrowArray(threadTable, threadTableCapacity, threadCount + 2))
+		{
+			free(thread);
+			return nullptr;
+		}
+		new(thread) ThreadStats;
+		thread->index = static_cast<unsigned int>(++threadCount);
+		thread->earlierThreads = 0;
+		thread->allocations = 0;
+		thread->deallocations = 0;
+		thread->bytesAllocated = 0;
+		thread->bytesFreed = 0;
+		thread->liveBytes = 0;
+		thread->peakBytes = 0;
+		thread->timelineChunk = nullptr;
+		threadTable[thread->index] = thread;
+	}
+	thread->systemId = SystemThreadId();
+	thread->name = nullptr;
+	thread->stackBegin = 0;
+	thread->stackEnd = 0;
+#ifdef __linux__
+	pthread_attr_t attributes;
+	if(pthread_getattr_np(pthread_self(), &attributes) == 0)
+	{
+		void *stackBase;
+		size_t stackSize;
+		if(pthread_attr_getstack(&attributes, &stackBase, &stackSize) == 0)
+		{
+			thread->stackBegin = reinterpret_cast<uintptr_t>(stackBase);
+			thread->stackEnd = thread->stackBegin + stackSize;
+		}
+		pthread_attr_destroy(&attributes);
+	}
+#endif
+	currentThreadStats = thread;
+	// using the hook is what sets it up, so its destructor runs when this thread exits
+	static_cast<void>(&threadExitHook);
+	return thread;
+}
+
+MemoryTracer::ThreadExitHook::~ThreadExitHook()
+{
+	threadExited = true;
+	// a thread only has counters once the tracer exists, and the tracer is never destroyed, so this works even while
+	// the exit report is being written
+	ThreadStats *thread = currentThreadStats;
+	if(!thread)
+	{
+		return;
+	}
+	currentThreadStats = nullptr;
+	// the stack is freed once the thread is gone, so a leak scan must not read it any more (a scan which is running
+	// holds the lock, so the stack stays put until it is done)
+	lock_guard<recursive_mutex> guard(instance->tracerLock);
+	thread->stackBegin = 0;
+	thread->stackEnd = 0;
+	// only numbers a block header can hold are worth handing out again
+	if(thread->index <= maxHeaderThread
+		&& GrowArray(instance->exitedThreads, instance->exitedThreadCapacity, instance->exitedThreadCount + 1))
+	{
+		instance->exitedThreads[instance->exitedThreadCount++] = thread->index;
+	}
+}
+
+uint16_t MemoryTracer::CurrentThreadNumber()
+{
+	ThreadStats *thread = CurrentThreadStats();
+	return thread && thread->index <= maxHeaderThread ? static_cast<uint16_t>(thread->index) : 0;
+}
+
+void MemoryTracer::CountThreadAllocation(AllocationHeader *header)
+{
+	header->thread = CurrentThreadNumber();
+	ThreadStats *thread = CurrentThreadStats();
+	if(!thread)
+	{
+		return;
+	}
+	// only this thread writes these, so a plain load and store is enough (and cheaper than an atomic increment)
+	thread->allocations.store(thread->allocations.load(memory_order_relaxed) + 1, memory_order_relaxed);
+	thread->bytesAllocated.store(thread->bytesAllocated.load(memory_order_relaxed) + header->rawSize,
+		memory_order_relaxed);
+	long long live = thread->liveBytes.fetch_add(header->rawSize, memory_order_relaxed) + header->rawSize;
+	if(live > thread->peakBytes.load(memory_order_relaxed))
+	{
+		thread->peakBytes.store(live, memory_order_relaxed);
+	}
+}
+
+void MemoryTracer::CountThreadDeallocation(const AllocationHeader *header)
+{
+	ThreadStats *thread = CurrentThreadStats();
+	if(!thread)
+	{
+		return;
+	}
+	thread->deallocations.store(thread->deallocations.load(memory_order_relaxed) + 1, memory_order_relaxed);
+	thread->bytesFreed.store(thread->bytesFreed.load(memory_order_relaxed) + header->rawSize, memory_order_relaxed);
+	if(!header->thread)
+	{
+		return;
+	}
+	// the owner's live memory is the only counter another thread touches, and only when it frees the owner's blocks
+	threadTable[header->thread]->liveBytes.fetch_sub(header->rawSize, memory_order_relaxed);
+	if(header->thread != thread->index)
+	{
+		long long *blocks = thread->crossFreeBlocks.FindOrAdd(header->thread, 0, 0);
+		long long *bytes = thread->crossFreeBytes.FindOrAdd(header->thread, 0, 0);
+		if(blocks && bytes)
+		{
+			(*blocks)++;
+			*bytes += header->rawSize;
+		}
+	}
+}
+
+void MemoryTracer::NameCurrentThread(const char *name)
+{
+	lock_guard<recursive_mutex> guard(tracerLock);
+	ThreadStats *thread = CurrentThreadStats();
+	if(thread)
+	{
+		thread->name = name;
+	}
+}
+
+void MemoryTracer::DisplayThreadStats(size_t maxRows)
+{
+	// blocks one thread allocated and another freed
+	struct ThreadPair
+	{
+		unsigned int allocatingThread;
+		unsigned int freeingThread;
+		long long blocks;
+		long long bytes;
+	};
+
+	lock_guard<recursive_mutex> guard(tracerLock);
+	long long allocationsBefore = totalAllocations;
+	// the name if there is one, otherwise the system's ID, and how many exited threads had the number before
+	auto label = [this](unsigned int index, char *text, size_t size)
+	{
+		const ThreadStats *thread = threadTable[index];
+		int length;
+		if(thread->name)
+		{
+			length = snprintf(text, size, "%u %s", index, thread->name);
+		}
+		else
+		{
+			length = snprintf(text, size, "%u [%llu]", index, thread->systemId);
+		}
+		if(thread->earlierThreads && length > 0 && static_cast<size_t>(length) < size)
+		{
+			snprintf(text + length, size - length, " +%u", thread->earlierThreads);
+		}
+	};
+
+	ThreadStats **threads = static_cast<ThreadStats**>(malloc((threadCount + 1) * sizeof(ThreadStats*)));
+	size_t pairCount = 0;
+	for(size_t i = 1; i <= threadCount; i++)
+	{
+		threadTable[i]->crossFreeBlocks.ForEach([&pairCount](uintptr_t, int, long long)
+		{
+			pairCount++;
+		});
+	}
+	ThreadPair *pairs = static_cast<ThreadPair*>(malloc((pairCount + 1) * sizeof(ThreadPair)));
+	if(!threads || !pairs)
+	{
+		free(threads);
+		free(pairs);
+		return;
+	}
+
+	TraceWriter out(stdout);
+	out << TraceWriter::Width(24) << "Thread"
+		<< TraceWriter::Width(12) << "Allocs"
+		<< TraceWriter::Width(12) << "Frees"
+		<< TraceWriter::Width(14) << "Allocated"
+		<< TraceWriter::Width(12) << "Live"
+		<< TraceWriter::Width(12) << "Peak"
+		<< "Cross-thread frees"
+		<< "\n==============================================================================================";
+	memcpy(threads, threadTable + 1, threadCount * sizeof(ThreadStats*));
+	size_t rows = min(maxRows, threadCount);
+	partial_sort(threads, threads + rows, threads + threadCount, [](const ThreadStats *a, const ThreadStats *b)
+	{
+		return a->bytesAllocated > b->bytesAllocated;
+	});
+	long long totalCrossBlocks = 0, totalCrossBytes = 0;
+	for(size_t i = 0; i < threadCount; i++)
+	{
+		long long crossBlocks = 0;
+		threads[i]->crossFreeBlocks.ForEach([&crossBlocks](uintptr_t, int, long long blocks)
+		{
+			crossBlocks += blocks;
+		});
+		threads[i]->crossFreeBytes.ForEach([&totalCrossBytes](uintptr_t, int, long long bytes)
+		{
+			totalCrossBytes += bytes;
+		});
+		totalCrossBlocks += crossBlocks;
+		if(i < rows)
+		{
+			char name[64];
+			label(threads[i]->index, name, sizeof(name));
+			out << "\n" << TraceWriter::Width(24, '.') << name
+				<< TraceWriter::Width(12, '.') << threads[i]->allocations.load()
+				<< TraceWriter::Width(12, '.') << threads[i]->deallocations.load()
+				<< TraceWriter::Width(14, '.') << threads[i]->bytesAllocated.load()
+				<< TraceWriter::Width(12, '.') << threads[i]->liveBytes.load()
+				<< TraceWriter::Width(12, '.') << threads[i]->peakBytes.load()
+				<< crossBlocks;
+		}
+	}
+	out << "\n\n";
+	if(threadCount > maxHeaderThread)
+	{
+		out << "More than " << maxHeaderThread << " threads were running at once; the blocks of the "
+			<< threadCount - maxHeaderThread << " thread(s) started after that have no owner\n\n";
+	}
+	unsigned long long earlierThreads = 0;
+	for(size_t i = 1; i <= threadCount; i++)
+	{
+		earlierThreads += threadTable[i]->earlierThreads;
+	}
+	if(earlierThreads)
+	{
+		out << "The numbers of " << earlierThreads << " exited thread(s) were given to new threads\n"
+			"(a row marked +n includes the n threads which had its number before)\n\n";
+	}
+
+	// the cross-thread free matrix, as a list of the thread pairs which actually occur
+	for(size_t i = 1, pair = 0; i <= threadCount; i++)
+	{
+		const ThreadStats *freeing = threadTable[i];
+		freeing->crossFreeBlocks.ForEach([&](uintptr_t allocating, int, long long blocks)
+		{
+			pairs[pair].allocatingThread = static_cast<unsigned int>(allocating);
+			pairs[pair].freeingThread = freeing->index;
+			pairs[pair].blocks = blocks;
+			// the two counts are added together, but if memory ran out only the first may have an entry
+			const long long *bytes = freeing->crossFreeBytes.Find(allocating, 0);
+			pairs[pair].bytes = bytes ? *bytes : 0;
+			pair++;
+		});
+	}
+	if(pairCount)
+	{
+		out << "Cross-thread frees: " << totalCrossBlocks << " blocks (" << totalCrossBytes << " bytes) between "
+			<< pairCount << " pair(s) of threads\n";
+		out << TraceWriter::Width(24) << "Allocated by"
+			<< TraceWriter::Width(24) << "Freed by"
+			<< TraceWriter::Width(12) << "Blocks"
+			<< "Bytes"
+			<< "\n===================================================================";
+		rows = min(maxRows, pairCount);
+		partial_sort(pairs, pairs + rows, pairs + pairCount, [](const ThreadPair &a, const ThreadPair &b)
+		{
+			return a.blocks > b.blocks;
+		});
+		for(size_t i = 0; i < rows; i++)
+		{
+			char allocating[64], freeing[64];
+			label(pairs[i].allocatingThread, allocating, sizeof(allocating));
+			label(pairs[i].freeingThread, freeing, sizeof(freeing));
+			out << "\n" << TraceWriter::Width(24, '.') << allocating
+				<< TraceWriter::Width(24, '.') << freeing
+				<< TraceWriter::Width(12, '.') << pairs[i].blocks
+				<< pairs[i].bytes;
+		}
+		out << "\n\n";
+	}
+	else
+	{
+		out << "No memory was freed by a thread other than the one which allocated it\n\n";
+	}
+	out.Flush();
+	free(threads);
+	free(pairs);
+	assert(totalAllocations == allocationsBefore);
+}
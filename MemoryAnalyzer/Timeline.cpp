@@ -0,0 +1,360 @@
+#include "MemoryTracer.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <stdio.h>
+#include <thread>
+#include <type_traits>
+
+using namespace std;
+
+
+struct TimelineEvent
+{
+	//! Nanoseconds since the timeline was started
+	long long time;
+	//! Type of the block or name of the marker (nullptr if there is none)
+	const char *name;
+	//! Allocation number of the block, or the number of blocks for TIMELINE_COUNTERS
+	uint64_t id;
+	//! Size of the block, or the memory in use for TIMELINE_COUNTERS
+	size_t size;
+	unsigned char kind;
+};
+
+struct TimelineChunk
+{
+	//! Next chunk in the write queue or the spare list
+	TimelineChunk *next;
+	//! Thread which recorded the events, as in ThreadStats::index
+	unsigned int thread;
+	size_t count;
+	TimelineEvent events[MEMORYTRACER_TIMELINE_CHUNK];
+};
+
+typedef chrono::steady_clock Clock;
+
+// Counters are recorded at most this often (in nanoseconds) and at every marker, so busy threads don't fill the
+// timeline with them
+static const long long counterInterval = 100000;
+// Events which aren't kept (small allocations, frees of blocks without a type) only look at the clock this often to
+// see whether the counters are due, since reading it costs about as much as the rest of recording
+static const unsigned int counterCheckEvents = 32;
+
+// Recording state; only used with tracerLock held
+static Clock::time_point timelineStart;
+static size_t largeAllocation = 0;
+// Blocks allocated before the timeline started have no lifetime slice to end
+static uint64_t firstAllocation = 0;
+static long long nextCounters = 0;
+static unsigned int uncheckedEvents = 0;
+
+// Everything below is guarded by timelineLock, which is private to the timeline: recording threads only take it to
+// hand over a full chunk, so they never wait for the writer thread's file output.
+static mutex timelineLock;
+// The timeline can be started while the tracer is constructed during static initialization (MEMANALYZER_TIMELINE),
+// possibly before this file's own static objects, so the condition variable is constructed in place on first use
+// (and never destroyed, like the tracer) instead of being a static object
+static aligned_storage<sizeof(condition_variable), alignof(condition_variable)>::type timelineWakeStorage;
+static condition_variable *timelineWake = nullptr;
+static thread *timelineThread = nullptr;
+static bool timelineStop = false;
+// Only written by the writer thread while it runs
+static FILE *timelineFile = nullptr;
+// Full chunks waiting to be written, oldest first, and written chunks waiting to be reused (allocated with malloc so
+// they never show up in the tracer's own lists)
+static TimelineChunk *queueHead = nullptr;
+static TimelineChunk *queueTail = nullptr;
+static TimelineChunk *spareChunks = nullptr;
+
+// Hands a chunk to the writer thread
+static void QueueChunk(TimelineChunk *chunk)
+{
+	{
+		lock_guard<mutex> guard(timelineLock);
+		chunk->next = nullptr;
+		if(queueTail)
+		{
+			queueTail->next = chunk;
+		}
+		else
+		{
+			queueHead = chunk;
+		}
+		queueTail = chunk;
+	}
+	timelineWake->notify_one();
+}
+
+// Returns an empty chunk for the given thread, or nullptr if memory ran out
+static TimelineChunk* TakeChunk(unsigned int thread)
+{
+	TimelineChunk *chunk;
+	{
+		lock_guard<mutex> guard(timelineLock);
+		chunk = spareChunks;
+		if(chunk)
+		{
+			spareChunks = chunk->next;
+		}
+	}
+	if(!chunk)
+	{
+		chunk = static_cast<TimelineChunk*>(malloc(sizeof(TimelineChunk)));
+		if(!chunk)
+		{
+			return nullptr;
+		}
+	}
+	chunk->thread = thread;
+	chunk->count = 0;
+	return chunk;
+}
+
+// Writes a string as a JSON string literal
+static void WriteJSONString(TraceWriter &out, const char *str)
+{
+	out << '"';
+	for( ; *str; str++)
+	{
+		if(*str == '"' || *str == '\\')
+		{
+			out << '\\';
+		}
+		out << *str;
+	}
+	out << '"';
+}
+
+// Writes the pid, tid, and timestamp fields of an event (in microseconds with three decimals, the trace format's unit)
+static void WriteEventStart(TraceWriter &out, long long time, unsigned int thread)
+{
+	char fraction[4] = { static_cast<char>('0' + time / 100 % 10), static_cast<char>('0' + time / 10 % 10),
+		static_cast<char>('0' + time % 10), '\0' };
+	out << ",\"pid\":1,\"tid\":" << thread << ",\"ts\":" << time / 1000 << '.' << fraction;
+}
+
+void MemoryTracer::RecordTimelineEvent(TimelineEventKind kind, const char *name, uint64_t allocationNumber,
+	size_t size)
+{
+	// small blocks only show in the counters, and only blocks with a type (allocated since the start) get a lifetime
+	bool keep = kind == TIMELINE_ALLOCATION ? size >= largeAllocation
+		: kind == TIMELINE_MARK || (name && allocationNumber >= firstAllocation);
+	if(!keep && ++uncheckedEvents < counterCheckEvents)
+	{
+		return;
+	}
+	uncheckedEvents = 0;
+	ThreadStats *thread = CurrentThreadStats();
+	if(!thread)
+	{
+		return;
+	}
+	long long now = chrono::duration_cast<chrono::nanoseconds>(Clock::now() - timelineStart).count();
+	bool counters = now >= nextCounters || kind == TIMELINE_MARK;
+
+	auto append = [&](TimelineEventKind eventKind, const char *eventName, uint64_t id, size_t eventSize)
+	{
+		TimelineChunk *chunk = thread->timelineChunk;
+		if(!chunk || chunk->count == MEMORYTRACER_TIMELINE_CHUNK)
+		{
+			if(chunk)
+			{
+				QueueChunk(chunk);
+			}
+			// if memory ran out, the event is lost
+			chunk = thread->timelineChunk = TakeChunk(thread->index);
+			if(!chunk)
+			{
+				return;
+			}
+		}
+		TimelineEvent &event = chunk->events[chunk->count++];
+		event.time = now;
+		event.name = eventName;
+		event.id = id;
+		event.size = eventSize;
+		event.kind = static_cast<unsigned char>(eventKind);
+	};
+	if(counters)
+	{
+		append(TIMELINE_COUNTERS, nullptr, currentBlocks.load(memory_order_relaxed),
+			currentMemory.load(memory_order_relaxed));
+		nextCounters = now + counterInterval;
+	}
+	if(keep)
+	{
+		append(kind, name, allocationNumber, size);
+	}
+}
+
+void MemoryTracer::WriteTimelineChunk(FILE *file, const TimelineChunk *chunk)
+{
+	// the events are formatted by hand rather than with fprintf, so the writer thread keeps up with busy programs
+	TraceWriter out(file);
+	// every event is preceded by a comma, since the file starts with the process name
+	for(size_t i = 0; i < chunk->count; i++)
+	{
+		const TimelineEvent &event = chunk->events[i];
+		switch(event.kind)
+		{
+		case TIMELINE_ALLOCATION:
+			out << ",\n{\"name\":\"Large allocation\",\"cat\":\"memory\",\"ph\":\"i\",\"s\":\"t\"";
+			WriteEventStart(out, event.time, chunk->thread);
+			out << ",\"args\":{\"bytes\":" << event.size << ",\"allocation\":" << event.id << "}}";
+			break;
+		case TIMELINE_DETAILS:
+		case TIMELINE_FREE:
+			// async slices are matched by category and ID, and grouped into tracks by name
+			out << ",\n{\"name\":";
+			WriteJSONString(out, event.name);
+			out << ",\"cat\":\"block\",\"ph\":\"" << (event.kind == TIMELINE_DETAILS ? 'b' : 'e') << "\",\"id\":\""
+				<< event.id << '"';
+			WriteEventStart(out, event.time, chunk->thread);
+			if(event.kind == TIMELINE_DETAILS)
+			{
+				out << ",\"args\":{\"bytes\":" << event.size << '}';
+			}
+			out << '}';
+			break;
+		case TIMELINE_COUNTERS:
+			// counters belong to the process, so the tid is only there to keep WriteEventStart simple
+			out << ",\n{\"name\":\"Memory\",\"ph\":\"C\"";
+			WriteEventStart(out, event.time, chunk->thread);
+			out << ",\"args\":{\"bytes\":" << event.size << "}},\n{\"name\":\"Blocks\",\"ph\":\"C\"";
+			WriteEventStart(out, event.time, chunk->thread);
+			out << ",\"args\":{\"blocks\":" << event.id << "}}";
+			break;
+		case TIMELINE_MARK:
+			out << ",\n{\"name\":";
+			WriteJSONString(out, event.name);
+			out << ",\"cat\":\"mark\",\"ph\":\"i\",\"s\":\"g\"";
+			WriteEventStart(out, event.time, chunk->thread);
+			out << '}';
+			break;
+		}
+	}
+}
+
+bool MemoryTracer::StartTimeline(const char *fileName, size_t largeAllocationSize)
+{
+	StopTimeline();
+	FILE *file = fopen(fileName, "w");
+	if(!file)
+	{
+		return false;
+	}
+	fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n"
+		"{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"MemoryAnalyzer\"}}");
+	if(!timelineWake)
+	{
+		timelineWake = new(&timelineWakeStorage) condition_variable;
+	}
+	{
+		lock_guard<mutex> guard(timelineLock);
+		timelineFile = file;
+		timelineStop = false;
+	}
+
+	timelineThread = new thread([]()
+	{
+		unique_lock<mutex> guard(timelineLock);
+		for(;;)
+		{
+			timelineWake->wait(guard, [] { return queueHead || timelineStop; });
+			// once stopped, the queue is emptied before the thread ends
+			TimelineChunk *chunk = queueHead;
+			if(!chunk)
+			{
+				break;
+			}
+			queueHead = chunk->next;
+			if(!queueHead)
+			{
+				queueTail = nullptr;
+			}
+			guard.unlock();
+			WriteTimelineChunk(timelineFile, chunk);
+			guard.lock();
+			chunk->next = spareChunks;
+			spareChunks = chunk;
+		}
+	});
+
+	lock_guard<recursive_mutex> guard(tracerLock);
+	timelineStart = Clock::now();
+	largeAllocation = largeAllocationSize;
+	firstAllocation = totalAllocations + 1;
+	nextCounters = 0;
+	uncheckedEvents = 0;
+	timelineRunning = true;
+	return true;
+}
+
+bool MemoryTracer::StopTimeline()
+{
+	{
+		lock_guard<recursive_mutex> guard(tracerLock);
+		if(!timelineRunning)
+		{
+			return false;
+		}
+		timelineRunning = false;
+		// the chunks which aren't full yet are written out too
+		for(size_t i = 1; i <= threadCount; i++)
+		{
+			if(threadTable[i]->timelineChunk)
+			{
+				QueueChunk(threadTable[i]->timelineChunk);
+				threadTable[i]->timelineChunk = nullptr;
+			}
+		}
+	}
+	{
+		lock_guard<mutex> guard(timelineLock);
+		timelineStop = true;
+	}
+	timelineWake->notify_all();
+	timelineThread->join();
+	delete timelineThread;
+	timelineThread = nullptr;
+
+	FILE *file = timelineFile;
+	timelineFile = nullptr;
+	for(TimelineChunk *chunk = spareChunks, *next; chunk; chunk = next)
+	{
+		next = chunk->next;
+		free(chunk);
+	}
+	spareChunks = nullptr;
+
+	// the threads are named last, since threads can be named at any time
+	lock_guard<recursive_mutex> guard(tracerLock);
+	{
+		TraceWriter out(file);
+		for(size_t i = 1; i <= threadCount; i++)
+		{
+			out << ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << i << ",\"args\":{\"name\":";
+			if(threadTable[i]->name)
+			{
+				WriteJSONString(out, threadTable[i]->name);
+			}
+			else
+			{
+				out << "\"Thread " << i << " [" << threadTable[i]->systemId << "]\"";
+			}
+			out << "}}";
+		}
+		out << "\n]}\n";
+	}
+	return fclose(file) == 0;
+}
+
+void MemoryTracer::Mark(const char *name)
+{
+	lock_guard<recursive_mutex> guard(tracerLock);
+	if(timelineRunning)
+	{
+		RecordTimelineEvent(TIMELINE_MARK, name, 0, 0);
+	}
+}
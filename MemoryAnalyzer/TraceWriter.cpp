@@ -0,0 +1,165 @@
+#include "TraceWriter.h"
+
+#include <stdint.h>
+#include <string.h>
+
+
+TraceWriter::TraceWriter(FILE *file)
+	: file(file), length(0), pending(0)
+{}
+
+TraceWriter::~TraceWriter()
+{
+	Flush();
+}
+
+void TraceWriter::Flush()
+{
+	if(length && file)
+	{
+		fwrite(buffer, 1, length, file);
+	}
+	length = 0;
+}
+
+TraceWriter& TraceWriter::Write(const char *text, size_t textLength)
+{
+	while(textLength)
+	{
+		if(length == sizeof(buffer))
+		{
+			Flush();
+		}
+		size_t piece = sizeof(buffer) - length < textLength ? sizeof(buffer) - length : textLength;
+		memcpy(buffer + length, text, piece);
+		length += piece;
+		text += piece;
+		textLength -= piece;
+	}
+	return *this;
+}
+
+void TraceWriter::WriteItem(const char *text, size_t itemLength)
+{
+	Write(text, itemLength);
+	for(size_t i = itemLength; i < static_cast<size_t>(pending.width); i++)
+	{
+		Write(&pending.fill, 1);
+	}
+	pending.width = 0;
+}
+
+void TraceWriter::WriteInteger(unsigned long long magnitude, bool negative)
+{
+	char digits[24];
+	char *begin = digits + sizeof(digits);
+	do
+	{
+		*--begin = static_cast<char>('0' + magnitude % 10);
+		magnitude /= 10;
+	} while(magnitude);
+	if(negative)
+	{
+		*--begin = '-';
+	}
+	WriteItem(begin, digits + sizeof(digits) - begin);
+}
+
+TraceWriter& TraceWriter::operator<<(const char *text)
+{
+	if(!text)
+	{
+		text = "(null)";
+	}
+	WriteItem(text, strlen(text));
+	return *this;
+}
+
+TraceWriter& TraceWriter::operator<<(char c)
+{
+	WriteItem(&c, 1);
+	return *this;
+}
+
+TraceWriter& TraceWriter::operator<<(int value)
+{
+	return *this << static_cast<long long>(value);
+}
+
+TraceWriter& TraceWriter::operator<<(long value)
+{
+	return *this << static_cast<long long>(value);
+}
+
+TraceWriter& TraceWriter::operator<<(long long value)
+{
+	// negating in unsigned arithmetic works for the most negative value as well
+	WriteInteger(value < 0 ? 0ull - static_cast<unsigned long long>(value) : static_cast<unsigned long long>(value),
+		value < 0);
+	return *this;
+}
+
+TraceWriter& TraceWriter::operator<<(unsigned int value)
+{
+	WriteInteger(value, false);
+	return *this;
+}
+
+TraceWriter& TraceWriter::operator<<(unsigned long value)
+{
+	WriteInteger(value, false);
+	return *this;
+}
+
+TraceWriter& TraceWriter::operator<<(unsigned long long value)
+{
+	WriteInteger(value, false);
+	return *this;
+}
+
+TraceWriter& TraceWriter::operator<<(double value)
+{
+	char text[32];
+	int textLength = snprintf(text, sizeof(text), "%g", value);
+	WriteItem(text, textLength > 0 ? textLength : 0);
+	return *this;
+}
+
+TraceWriter& TraceWriter::operator<<(const void *pointer)
+{
+	uintptr_t address = reinterpret_cast<uintptr_t>(pointer);
+	if(!address)
+	{
+		WriteItem("0", 1);
+		return *this;
+	}
+	char digits[2 + sizeof(uintptr_t) * 2];
+	char *begin = digits + sizeof(digits);
+	for( ; address; address >>= 4)
+	{
+		*--begin = "0123456789abcdef"[address & 0xF];
+	}
+	*--begin = 'x';
+	*--begin = '0';
+	WriteItem(begin, digits + sizeof(digits) - begin);
+	return *this;
+}
+
+TraceWriter& TraceWriter::operator<<(const Width &width)
+{
+	pending = width;
+	return *this;
+}
+
+TraceWriter& TraceWriter::operator<<(const Fixed &number)
+{
+	char text[64];
+	int textLength = snprintf(text, sizeof(text), number.showSign ? "%+.*f" : "%.*f", number.precision, number.value);
+	// snprintf reports the full length even when the number didn't fit
+	if(textLength >= static_cast<int>(sizeof(text)))
+	{
+		textLength = sizeof(text) - 1;
+	}
+	WriteItem(text, textLength > 0 ? textLength : 0);
+	return *this;
+}
@@ -0,0 +1,109 @@
+/** @file TraceWriter.h
+@brief Allocation-free text output for the tracer's messages and reports.  Included by MemoryTracer.h.
+*/
+
+#ifndef TRACEWRITER_H
+#define TRACEWRITER_H
+
+
+#include <stdio.h>
+
+/** @def MEMORYTRACER_WRITER_BUFFER
+Number of characters a TraceWriter collects before handing them to its file.
+*/
+#ifndef MEMORYTRACER_WRITER_BUFFER
+#define MEMORYTRACER_WRITER_BUFFER 1024
+#endif
+
+/** @class TraceWriter
+@brief Writes text to a stdio file without allocating memory.
+
+Text is collected in a fixed buffer inside the writer (which normally lives on the stack) and handed to the file when
+the buffer fills up and when the writer is destroyed.  Integers and pointers are formatted by hand, and floating point
+numbers through snprintf into a local buffer, so nothing goes through operator new.  This makes it safe to use inside
+operator new and delete and while holding the tracer's lock, which std::cout (with its locale and iomanip state) is not.
+
+Writing to stdout keeps the text in order with std::cout, which shares stdout's buffer unless the program has called
+std::ios::sync_with_stdio(false).
+*/
+class TraceWriter
+{
+public:
+
+	/** @struct Width
+	Pads the next item with the fill character to at least the given width, text first (like std::setw with std::left
+	and std::setfill).
+	*/
+	struct Width
+	{
+		int width;
+		char fill;
+
+		explicit Width(int width, char fill = ' ') : width(width), fill(fill)
+		{}
+	};
+
+	/** @struct Fixed
+	A number written with a set number of decimals (like std::fixed with std::setprecision), and optionally with its sign
+	even when positive (like std::showpos).
+	*/
+	struct Fixed
+	{
+		double value;
+		int precision;
+		bool showSign;
+
+		Fixed(double value, int precision, bool showSign = false) : value(value), precision(precision),
+			showSign(showSign)
+		{}
+	};
+
+	/** @param file File to write to (e.g., stdout)
+	*/
+	explicit TraceWriter(FILE *file);
+	~TraceWriter();
+
+	TraceWriter& operator<<(const char *text);
+	TraceWriter& operator<<(char c);
+	TraceWriter& operator<<(int value);
+	TraceWriter& operator<<(long value);
+	TraceWriter& operator<<(long long value);
+	TraceWriter& operator<<(unsigned int value);
+	TraceWriter& operator<<(unsigned long value);
+	TraceWriter& operator<<(unsigned long long value);
+	/** @brief Writes the number the way std::cout does by default (six significant digits)
+	*/
+	TraceWriter& operator<<(double value);
+	/** @brief Writes the address in hexadecimal, starting with 0x (0 for nullptr)
+	*/
+	TraceWriter& operator<<(const void *pointer);
+	TraceWriter& operator<<(const Width &width);
+	TraceWriter& operator<<(const Fixed &number);
+
+	/** @brief Writes the given number of characters of text
+	*/
+	TraceWriter& Write(const char *text, size_t length);
+
+	/** @brief Hands the collected text to the file
+	*/
+	void Flush();
+
+private:
+
+	FILE *file;
+	char buffer[MEMORYTRACER_WRITER_BUFFER];
+	size_t length;
+	//! Width (and fill) the next item is padded to; 0 if it isn't padded
+	Width pending;
+
+	TraceWriter(const TraceWriter&);
+	TraceWriter& operator=(const TraceWriter&);
+
+	/** @brief Writes one item, padded to the pending width
+	*/
+	void WriteItem(const char *text, size_t itemLength);
+
+	void WriteInteger(unsigned long long magnitude, bool negative);
+};
+
+#endif
@@ -0,0 +1,274 @@
+#include "MemoryTracer.h"
+
+#include <algorithm>
+#include <cstring>
+
+using namespace std;
+
+
+// Longest group name worked out by a grouping; longer ones are cut short (and so share a group if they only differ
+// past this point)
+static const size_t maxGroupNameLength = 255;
+
+// Appends text to a group name, cutting it short at maxGroupNameLength
+static void AppendName(char *name, size_t &length, const char *text, size_t textLength)
+{
+	textLength = min(textLength, maxGroupNameLength - length);
+	memcpy(name + length, text, textLength);
+	length += textLength;
+}
+
+// Writes the name of a template instantiation with its arguments left out ("std::map<...>::iterator"), and an array
+// without its length ("Particle [...]")
+static size_t CollapseTemplates(const char *type, char *name)
+{
+	size_t length = 0;
+	int depth = 0;
+	for(const char *c = type; *c; c++)
+	{
+		if(*c == '<')
+		{
+			if(depth++ == 0)
+			{
+				AppendName(name, length, "<...>", 5);
+			}
+		}
+		else if(*c == '>' && depth)
+		{
+			depth--;
+		}
+		else if(!depth)
+		{
+			// the length of an array, as in "Particle [16]"
+			const char *close = c;
+			if(*c == '[')
+			{
+				for(close++; *close >= '0' && *close <= '9'; close++)
+				{
+				}
+			}
+			if(*close == ']' && close > c + 1)
+			{
+				AppendName(name, length, "[...]", 5);
+				c = close;
+			}
+			else
+			{
+				AppendName(name, length, c, 1);
+			}
+		}
+	}
+	return length;
+}
+
+// Writes the outermost namespace (or class) a type is declared in, e.g., "std" for "std::__cxx11::basic_string<...>"
+static size_t OutermostNamespace(const char *type, char *name)
+{
+	size_t length = 0;
+	// a qualifier isn't part of the namespace
+	for(const char *qualifier : { "const ", "volatile " })
+	{
+		if(!strncmp(type, qualifier, strlen(qualifier)))
+		{
+			type += strlen(qualifier);
+		}
+	}
+	// the name ends at the first "::" which isn't inside template arguments, or GCC's "{anonymous}" and the like
+	int depth = 0;
+	for(const char *c = type; *c; c++)
+	{
+		depth += *c == '<' || *c == '(' || *c == '[' || *c == '{';
+		depth -= *c == '>' || *c == ')' || *c == ']' || *c == '}';
+		if(!depth && c[0] == ':' && c[1] == ':')
+		{
+			AppendName(name, length, type, c - type);
+			return length;
+		}
+	}
+	AppendName(name, length, "(global namespace)", strlen("(global namespace)"));
+	return length;
+}
+
+// FNV-1a hash of a group name
+static uintptr_t HashName(const char *name)
+{
+	uint64_t hash = 14695981039346656037ull;
+	for( ; *name; name++)
+	{
+		hash = (hash ^ static_cast<unsigned char>(*name)) * 1099511628211ull;
+	}
+	return static_cast<uintptr_t>(hash ^ (hash >> 32));
+}
+
+uint32_t MemoryTracer::GroupType(const char *type)
+{
+	char name[maxGroupNameLength + 1];
+	size_t length = 0;
+	const char *ruleGroup = nullptr;
+	for(size_t i = 0; i < typeGroupRuleCount && !ruleGroup; i++)
+	{
+		if(!strncmp(type, typeGroupRules[i].prefix, strlen(typeGroupRules[i].prefix)))
+		{
+			ruleGroup = typeGroupRules[i].group;
+		}
+	}
+	if(ruleGroup || typeGrouping == GROUP_BY_TYPE)
+	{
+		const char *whole = ruleGroup ? ruleGroup : type;
+		AppendName(name, length, whole, strlen(whole));
+	}
+	else if(typeGrouping == GROUP_BY_TEMPLATE)
+	{
+		length = CollapseTemplates(type, name);
+	}
+	else
+	{
+		length = OutermostNamespace(type, name);
+	}
+	name[length] = '\0';
+
+	uintptr_t hash = HashName(name);
+	long long *firstWithHash = typeGroupHashes.Find(hash, 0);
+	uint32_t first = firstWithHash ? static_cast<uint32_t>(*firstWithHash) : 0;
+	for(uint32_t id = first; id; id = typeGroups[id].nextSameHash)
+	{
+		if(!strcmp(typeGroups[id].name, name))
+		{
+			return id;
+		}
+	}
+
+	// entry 0 means a type hasn't been grouped, so the first group goes in entry 1
+	size_t id = typeGroupCount + 1;
+	char *groupName = static_cast<char*>(malloc(length + 1));
+	if(!groupName || !GrowArray(typeGroups, typeGroupCapacity, id + 1))
+	{
+		free(groupName);
+		return 0;
+	}
+	long long *head = typeGroupHashes.FindOrAdd(hash, 0, id);
+	if(!head)
+	{
+		free(groupName);
+		return 0;
+	}
+	// the new group goes in front of the others with the same hash
+	*head = id;
+	memcpy(groupName, name, length + 1);
+	TypeGroupNode &group = typeGroups[id];
+	group.name = groupName;
+	group.nextSameHash = first;
+	group.blocks = 0;
+	group.memSize = 0;
+	typeGroupCount = id;
+	return static_cast<uint32_t>(id);
+}
+
+void MemoryTracer::TotalTypeGroups()
+{
+	for(size_t i = 1; i <= typeGroupCount; i++)
+	{
+		typeGroups[i].blocks = 0;
+		typeGroups[i].memSize = 0;
+	}
+	for(size_t i = 1; i <= typeCount; i++)
+	{
+		TypeNode *type = typeTable[i];
+		// if memory ran out, the type is left out until it can be grouped
+		if(!type->group)
+		{
+			type->group = GroupType(type->type);
+		}
+		if(type->group)
+		{
+			typeGroups[type->group].blocks += type->blocks;
+			typeGroups[type->group].memSize += type->memSize;
+		}
+	}
+}
+
+void MemoryTracer::ResetTypeGroups()
+{
+	for(size_t i = 1; i <= typeGroupCount; i++)
+	{
+		free(typeGroups[i].name);
+	}
+	typeGroupCount = 0;
+	typeGroupHashes.Clear();
+	for(size_t i = 1; i <= typeCount; i++)
+	{
+		typeTable[i]->group = 0;
+	}
+}
+
+void MemoryTracer::SetTypeGrouping(TypeGrouping grouping)
+{
+	lock_guard<recursive_mutex> guard(tracerLock);
+	if(grouping != typeGrouping)
+	{
+		typeGrouping = grouping;
+		ResetTypeGroups();
+	}
+}
+
+bool MemoryTracer::AddTypeGroupRule(const char *prefix, const char *group)
+{
+	lock_guard<recursive_mutex> guard(tracerLock);
+	if(!GrowArray(typeGroupRules, typeGroupRuleCapacity, typeGroupRuleCount + 1))
+	{
+		return false;
+	}
+	typeGroupRules[typeGroupRuleCount].prefix = prefix;
+	typeGroupRules[typeGroupRuleCount].group = group;
+	typeGroupRuleCount++;
+	ResetTypeGroups();
+	return true;
+}
+
+void MemoryTracer::ClearTypeGroupRules()
+{
+	lock_guard<recursive_mutex> guard(tracerLock);
+	if(typeGroupRuleCount)
+	{
+		typeGroupRuleCount = 0;
+		ResetTypeGroups();
+	}
+}
+
+size_t MemoryTracer::GetTypeGroups(TypeGroupStats *groups, size_t maxGroups)
+{
+	lock_guard<recursive_mutex> guard(tracerLock);
+	long long allocationsBefore = totalAllocations;
+	TotalTypeGroups();
+
+	// the destination is kept as a heap with the smallest of the groups taken so far on top, so the largest
+	// maxGroups are found in one pass without sorting all of the groups
+	auto larger = [](const TypeGroupStats &a, const TypeGroupStats &b)
+	{
+		return a.memSize > b.memSize;
+	};
+	size_t count = 0;
+	for(size_t i = 1; i <= typeGroupCount && maxGroups; i++)
+	{
+		const TypeGroupNode &group = typeGroups[i];
+		if(group.blocks <= 0)
+		{
+			continue;
+		}
+		if(count == maxGroups)
+		{
+			if(group.memSize <= groups[0].memSize)
+			{
+				continue;
+			}
+			pop_heap(groups, groups + count--, larger);
+		}
+		groups[count].name = group.name;
+		groups[count].blocks = group.blocks;
+		groups[count].memSize = group.memSize;
+		push_heap(groups, groups + ++count, larger);
+	}
+	sort_heap(groups, groups + count, larger);
+	assert(totalAllocations == allocationsBefore);
+	return count;
+}
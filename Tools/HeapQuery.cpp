@@ -0,0 +1,434 @@
+/** @file HeapQuery.cpp
+@brief Command-line tool for filtering and aggregating the binary heap dumps written by MemoryTracer::WriteHeapDump.
+
+The dump is mapped into memory and scanned once, so even multi-gigabyte dumps don't need to be loaded.  This is a
+standalone program; build it separately from the program you are analyzing (don't include MemoryAnalyzer.h).
+
+Usage: HeapQuery dumpfile [--type text] [--file text] [--min-size bytes] [--max-size bytes]
+	[--group type|file|site|size] [--top count]
+
+--type and --file keep only blocks whose type or source filename contains the given text.  --group selects what the
+results are totaled by (default: site, i.e., file, line, and type), and --top limits the number of rows shown (default:
+20), largest total size first.
+
+Example: HeapQuery heap.dump --file Renderer --min-size 1024 --group type
+*/
+
+#include "../MemoryAnalyzer/HeapDump.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unordered_map>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+
+/** @enum GroupBy
+What query results are totaled by
+*/
+enum GroupBy
+{
+	GROUP_TYPE,		/**< Object type */
+	GROUP_FILE,		/**< Source file */
+	GROUP_SITE,		/**< Source file, line, and object type */
+	GROUP_SIZE		/**< Block size */
+};
+
+/** @struct Query
+Command-line options
+*/
+struct Query
+{
+	const char *dumpFile;
+	const char *typeFilter;
+	const char *fileFilter;
+	uint64_t minSize;
+	uint64_t maxSize;
+	GroupBy groupBy;
+	size_t top;
+};
+
+/** @struct Group
+One row of the results
+*/
+struct Group
+{
+	//! First record of the group, used to print the key
+	const HeapDumpRecord *first;
+	uint64_t blocks;
+	uint64_t bytes;
+};
+
+/** @class MappedDump
+@brief Read-only view of a dump file mapped into memory.
+*/
+class MappedDump
+{
+private:
+
+#ifdef _WIN32
+	HANDLE file;
+	HANDLE mapping;
+#else
+	int fd;
+#endif
+	const unsigned char *data;
+	size_t size;
+
+	MappedDump(const MappedDump&);
+	MappedDump& operator=(const MappedDump&);
+
+public:
+
+	MappedDump() : data(nullptr), size(0)
+	{}
+	~MappedDump()
+	{
+#ifdef _WIN32
+		if(data)
+		{
+			UnmapViewOfFile(data);
+			CloseHandle(mapping);
+			CloseHandle(file);
+		}
+#else
+		if(data)
+		{
+			munmap(const_cast<unsigned char*>(data), size);
+			close(fd);
+		}
+#endif
+	}
+
+	/** @brief Maps the file and validates its header
+		@param fileName Dump file
+		@return Error message, or nullptr on success
+	*/
+	const char* Open(const char *fileName)
+	{
+#ifdef _WIN32
+		file = CreateFileA(fileName, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN,
+			nullptr);
+		if(file == INVALID_HANDLE_VALUE)
+		{
+			return "could not open file";
+		}
+		LARGE_INTEGER fileSize;
+		GetFileSizeEx(file, &fileSize);
+		size = static_cast<size_t>(fileSize.QuadPart);
+		mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		data = mapping ? static_cast<const unsigned char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0)) : nullptr;
+		if(!data)
+		{
+			if(mapping)
+			{
+				CloseHandle(mapping);
+			}
+			CloseHandle(file);
+			return "could not map file";
+		}
+#else
+		fd = open(fileName, O_RDONLY);
+		if(fd < 0)
+		{
+			return "could not open file";
+		}
+		struct stat info;
+		if(fstat(fd, &info) != 0 || info.st_size == 0)
+		{
+			close(fd);
+			return "could not read file size";
+		}
+		size = static_cast<size_t>(info.st_size);
+		void *mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if(mapping == MAP_FAILED)
+		{
+			close(fd);
+			return "could not map file";
+		}
+		// the records are scanned front to back exactly once
+		madvise(mapping, size, MADV_SEQUENTIAL);
+		data = static_cast<const unsigned char*>(mapping);
+#endif
+
+		if(size < sizeof(HeapDumpHeader))
+		{
+			return "not a heap dump";
+		}
+		const HeapDumpHeader *header = Header();
+		if(memcmp(header->magic, HEAPDUMP_MAGIC, sizeof(HEAPDUMP_MAGIC)))
+		{
+			return "not a heap dump";
+		}
+		if(header->version != HEAPDUMP_VERSION || header->recordSize != sizeof(HeapDumpRecord))
+		{
+			return "unsupported heap dump version";
+		}
+		if(header->stringDataOffset > size || header->recordsOffset > size
+			|| header->recordCount > (size - header->recordsOffset) / sizeof(HeapDumpRecord))
+		{
+			return "truncated heap dump";
+		}
+		// the offset table and the strings it points to are checked once here, so String() can't read past the end
+		// of the mapping however the file was damaged
+		if(header->stringTableOffset > size
+			|| header->stringCount > (size - header->stringTableOffset) / sizeof(uint64_t)
+			|| header->stringCount > UINT32_MAX)
+		{
+			return "truncated heap dump";
+		}
+		if(header->stringTableOffset % sizeof(uint64_t) || header->recordsOffset % sizeof(uint64_t))
+		{
+			return "corrupt heap dump";
+		}
+		const uint64_t *offsets = reinterpret_cast<const uint64_t*>(data + header->stringTableOffset);
+		size_t stringDataSize = size - static_cast<size_t>(header->stringDataOffset);
+		for(uint64_t i = 0; i < header->stringCount; i++)
+		{
+			// each string has to start inside the string data and be terminated before the end of the file
+			if(offsets[i] >= stringDataSize || !memchr(data + header->stringDataOffset + offsets[i], '\0',
+				stringDataSize - static_cast<size_t>(offsets[i])))
+			{
+				return "corrupt heap dump (string table)";
+			}
+		}
+		return nullptr;
+	}
+
+	const HeapDumpHeader* Header() const
+	{
+		return reinterpret_cast<const HeapDumpHeader*>(data);
+	}
+
+	const HeapDumpRecord* Records() const
+	{
+		return reinterpret_cast<const HeapDumpRecord*>(data + Header()->recordsOffset);
+	}
+
+	const char* String(uint32_t index) const
+	{
+		const uint64_t *offsets = reinterpret_cast<const uint64_t*>(data + Header()->stringTableOffset);
+		return reinterpret_cast<const char*>(data + Header()->stringDataOffset + offsets[index]);
+	}
+};
+
+static void PrintUsage()
+{
+	fprintf(stderr, "Usage: HeapQuery dumpfile [--type text] [--file text] [--min-size bytes] [--max-size bytes]\n"
+		"\t[--group type|file|site|size] [--top count]\n");
+}
+
+static bool ParseArguments(int argc, char *argv[], Query &query)
+{
+	if(argc < 2)
+	{
+		return false;
+	}
+	query.dumpFile = argv[1];
+	query.typeFilter = nullptr;
+	query.fileFilter = nullptr;
+	query.minSize = 0;
+	query.maxSize = UINT64_MAX;
+	query.groupBy = GROUP_SITE;
+	query.top = 20;
+
+	for(int i = 2; i < argc; i += 2)
+	{
+		if(i + 1 >= argc)
+		{
+			return false;
+		}
+		const char *option = argv[i];
+		const char *value = argv[i + 1];
+		if(!strcmp(option, "--type"))
+		{
+			query.typeFilter = value;
+		}
+		else if(!strcmp(option, "--file"))
+		{
+			query.fileFilter = value;
+		}
+		else if(!strcmp(option, "--min-size"))
+		{
+			query.minSize = strtoull(value, nullptr, 10);
+		}
+		else if(!strcmp(option, "--max-size"))
+		{
+			query.maxSize = strtoull(value, nullptr, 10);
+		}
+		else if(!strcmp(option, "--top"))
+		{
+			query.top = static_cast<size_t>(strtoull(value, nullptr, 10));
+		}
+		else if(!strcmp(option, "--group"))
+		{
+			if(!strcmp(value, "type"))
+				query.groupBy = GROUP_TYPE;
+			else if(!strcmp(value, "file"))
+				query.groupBy = GROUP_FILE;
+			else if(!strcmp(value, "site"))
+				query.groupBy = GROUP_SITE;
+			else if(!strcmp(value, "size"))
+				query.groupBy = GROUP_SIZE;
+			else
+				return false;
+		}
+		else
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	Query query;
+	if(!ParseArguments(argc, argv, query))
+	{
+		PrintUsage();
+		return 1;
+	}
+
+	MappedDump dump;
+	const char *error = dump.Open(query.dumpFile);
+	if(error)
+	{
+		fprintf(stderr, "%s: %s\n", query.dumpFile, error);
+		return 1;
+	}
+	const HeapDumpHeader *header = dump.Header();
+	const HeapDumpRecord *records = dump.Records();
+
+	// the string table is tiny compared to the records, so the text filters are evaluated once per string up front
+	vector<char> typeMatches(static_cast<size_t>(header->stringCount), 1);
+	vector<char> fileMatches(static_cast<size_t>(header->stringCount), 1);
+	for(uint32_t i = 0; i < header->stringCount; i++)
+	{
+		if(query.typeFilter)
+		{
+			typeMatches[i] = strstr(dump.String(i), query.typeFilter) != nullptr;
+		}
+		if(query.fileFilter)
+		{
+			fileMatches[i] = strstr(dump.String(i), query.fileFilter) != nullptr;
+		}
+	}
+
+	vector<Group> groups;
+	// type and file groups are indexed by string; size groups by a hash map; site groups are runs of consecutive
+	// records, since the records are sorted by site
+	vector<size_t> groupByString;
+	unordered_map<uint64_t, size_t> groupBySize;
+	if(query.groupBy == GROUP_TYPE || query.groupBy == GROUP_FILE)
+	{
+		groupByString.assign(static_cast<size_t>(header->stringCount), SIZE_MAX);
+	}
+
+	uint64_t totalBlocks = 0, totalBytes = 0, rejected = 0;
+	const HeapDumpRecord *previous = nullptr;
+	for(const HeapDumpRecord *record = records, *end = records + header->recordCount; record != end; record++)
+	{
+		// a record naming a string which isn't in the table is damaged, so it's left out rather than guessed at
+		if(record->type >= header->stringCount || record->file >= header->stringCount)
+		{
+			rejected++;
+			continue;
+		}
+		if(record->size < query.minSize || record->size > query.maxSize || !typeMatches[record->type]
+			|| !fileMatches[record->file])
+		{
+			continue;
+		}
+
+		size_t *slot = nullptr;
+		size_t newSlot = groups.size();
+		switch(query.groupBy)
+		{
+		case GROUP_TYPE:
+			slot = &groupByString[record->type];
+			break;
+		case GROUP_FILE:
+			slot = &groupByString[record->file];
+			break;
+		case GROUP_SIZE:
+			slot = &groupBySize.insert(make_pair(record->size, SIZE_MAX)).first->second;
+			break;
+		case GROUP_SITE:
+			if(previous && previous->file == record->file && previous->line == record->line
+				&& previous->type == record->type)
+			{
+				newSlot = groups.size() - 1;
+			}
+			else
+			{
+				newSlot = SIZE_MAX;
+			}
+			slot = &newSlot;
+			break;
+		}
+		if(*slot == SIZE_MAX)
+		{
+			Group group = { record, 0, 0 };
+			*slot = groups.size();
+			groups.push_back(group);
+		}
+		groups[*slot].blocks++;
+		groups[*slot].bytes += record->size;
+		totalBlocks++;
+		totalBytes += record->size;
+		previous = record;
+	}
+
+	if(rejected)
+	{
+		fprintf(stderr, "%s: skipped %llu corrupt records (string index out of range)\n", query.dumpFile,
+			static_cast<unsigned long long>(rejected));
+	}
+
+	size_t shown = min(query.top, groups.size());
+	partial_sort(groups.begin(), groups.begin() + shown, groups.end(), [](const Group &a, const Group &b)
+	{
+		return a.bytes > b.bytes;
+	});
+
+	printf("%-14s %-14s %s\n", "Bytes", "Blocks", "Group");
+	for(size_t i = 0; i < shown; i++)
+	{
+		const HeapDumpRecord *first = groups[i].first;
+		printf("%-14llu %-14llu ", static_cast<unsigned long long>(groups[i].bytes),
+			static_cast<unsigned long long>(groups[i].blocks));
+		switch(query.groupBy)
+		{
+		case GROUP_TYPE:
+			printf("%s\n", dump.String(first->type));
+			break;
+		case GROUP_FILE:
+			printf("%s\n", dump.String(first->file));
+			break;
+		case GROUP_SITE:
+			printf("%s:%u (%s)\n", dump.String(first->file), first->line, dump.String(first->type));
+			break;
+		case GROUP_SIZE:
+			printf("%llu bytes\n", static_cast<unsigned long long>(first->size));
+			break;
+		}
+	}
+	printf("\nMatched %llu of %llu blocks, %llu bytes (%zu groups, %llu bytes allocated at dump time, peak %llu)\n",
+		static_cast<unsigned long long>(totalBlocks), static_cast<unsigned long long>(header->recordCount),
+		static_cast<unsigned long long>(totalBytes), groups.size(),
+		static_cast<unsigned long long>(header->currentMemory), static_cast<unsigned long long>(header->peakMemory));
+	return 0;
+}
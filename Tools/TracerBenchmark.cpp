@@ -0,0 +1,731 @@
+/** @file TracerBenchmark.cpp
+@brief Measures the tracer's overhead on workloads modeled on a game engine's allocation patterns.
+
+Each workload is a synthetic but realistic mix of allocations: per-frame temporaries, a long-lived scene graph tagged by
+DEBUG_NEW, polymorphic components (a type tag per class), particle buffers allocated with new[], and bursts of jobs run
+on several threads.  The same source is built twice, once without the tracer (the baseline) and once with it, and the
+tracked build divides its times by the baseline's to show each workload's overhead.  Build both with the same
+optimization flags.
+
+Baseline build: g++ -O2 TracerBenchmark.cpp -o TracerBenchmarkBase -lpthread
+Tracked build: g++ -O2 -D_DEBUG TracerBenchmark.cpp ../MemoryAnalyzer/[A-Z]*.cpp -o TracerBenchmark -lpthread
+
+Usage: TracerBenchmark [--frames count] [--repetitions count] [--save file] [--baseline file] [--fail-above ratio]
+
+--frames sets the number of simulated frames per workload (default: 300), and --repetitions the number of times each
+workload is run (default: 5); the fastest run counts.  --save writes the times to a file, and --baseline reads a file
+saved by the other build and adds the overhead to the results.  With --fail-above, the exit code is 2 if any workload's
+overhead is higher than the given ratio, so a regression in Allocate, Deallocate, or the type and site tables fails a
+scripted run.
+
+Example: TracerBenchmarkBase --save base.txt && TracerBenchmark --baseline base.txt --fail-above 8
+*/
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+// included last, so DEBUG_NEW only rewrites the new expressions in this file (some standard headers call operator new
+// directly, which the macro would break)
+#include "../MemoryAnalyzer/MemoryAnalyzer.h"
+
+using namespace std;
+
+
+//! Every workload adds what it computes to this, so the optimizer can't drop allocations whose contents go unused
+static volatile uint64_t checksum;
+
+/** @class Random
+@brief Small deterministic generator (xorshift), so both builds do exactly the same work.
+*/
+class Random
+{
+private:
+
+	uint32_t state;
+
+public:
+
+	explicit Random(uint32_t seed) : state(seed * 2654435761u + 1)
+	{}
+
+	uint32_t Next()
+	{
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		return state;
+	}
+
+	//! Returns a number from 0 to limit - 1
+	uint32_t Below(uint32_t limit)
+	{
+		return Next() % limit;
+	}
+};
+
+
+// Per-frame temporaries: render commands, a debug label, and a scratch buffer, all freed at the end of the frame
+
+struct DrawCommand
+{
+	uint32_t mesh;
+	uint32_t material;
+	float transform[16];
+};
+
+static uint64_t FrameTemporaries(unsigned int frames)
+{
+	uint64_t sum = 0;
+	for(unsigned int frame = 0; frame < frames; frame++)
+	{
+		Random random(frame);
+		vector<DrawCommand*> commands;
+		uint32_t count = 256 + random.Below(256);
+		for(uint32_t i = 0; i < count; i++)
+		{
+			DrawCommand *command = new DrawCommand;
+			command->mesh = random.Next();
+			command->material = random.Below(64);
+			command->transform[0] = static_cast<float>(i);
+			commands.push_back(command);
+		}
+		string label = "Frame " + to_string(frame) + " opaque pass, " + to_string(count) + " draws";
+		size_t scratchSize = 64 + random.Below(4096);
+		unsigned char *scratch = new unsigned char[scratchSize];
+		memset(scratch, static_cast<int>(frame), scratchSize);
+
+		sum += label.size() + scratch[scratchSize / 2];
+		for(DrawCommand *command : commands)
+		{
+			sum += command->mesh + command->material + static_cast<uint64_t>(command->transform[0]);
+			delete command;
+		}
+		delete[] scratch;
+	}
+	return sum;
+}
+
+
+// Scene graph: thousands of long-lived nodes, a few of which are replaced every frame
+
+struct SceneNode
+{
+	SceneNode *parent;
+	vector<SceneNode*> children;
+	float localTransform[16];
+	string name;
+};
+
+static SceneNode* CreateNode(SceneNode *parent, uint32_t id)
+{
+	SceneNode *node = new SceneNode;
+	node->parent = parent;
+	node->localTransform[0] = static_cast<float>(id);
+	node->name = "Level01/Props/StaticMesh_" + to_string(id);
+	if(parent)
+	{
+		parent->children.push_back(node);
+	}
+	return node;
+}
+
+static void DestroyTree(SceneNode *node)
+{
+	for(SceneNode *child : node->children)
+	{
+		DestroyTree(child);
+	}
+	delete node;
+}
+
+static uint64_t SumTree(const SceneNode *node)
+{
+	uint64_t sum = static_cast<uint64_t>(node->localTransform[0]) + node->name.size();
+	for(const SceneNode *child : node->children)
+	{
+		sum += SumTree(child);
+	}
+	return sum;
+}
+
+static uint64_t SceneGraph(unsigned int frames)
+{
+	const uint32_t nodeCount = 4096;
+	Random random(1);
+	vector<SceneNode*> nodes;
+	nodes.push_back(CreateNode(nullptr, 0));
+	for(uint32_t id = 1; id < nodeCount; id++)
+	{
+		nodes.push_back(CreateNode(nodes[random.Below(static_cast<uint32_t>(nodes.size()))], id));
+	}
+
+	uint64_t sum = 0;
+	uint32_t nextId = nodeCount;
+	for(unsigned int frame = 0; frame < frames; frame++)
+	{
+		// replace about 1% of the nodes (leaves only, so the rest of the tree stays intact)
+		for(uint32_t replaced = 0; replaced < nodeCount / 100; replaced++)
+		{
+			size_t index = 1 + random.Below(static_cast<uint32_t>(nodes.size() - 1));
+			SceneNode *node = nodes[index];
+			if(!node->children.empty())
+			{
+				continue;
+			}
+			vector<SceneNode*> &siblings = node->parent->children;
+			siblings.erase(find(siblings.begin(), siblings.end(), node));
+			delete node;
+			nodes[index] = CreateNode(nodes[random.Below(static_cast<uint32_t>(index))], nextId++);
+		}
+		// the transform update touches every node once a frame
+		if(frame % 16 == 0)
+		{
+			sum += SumTree(nodes[0]);
+		}
+	}
+	DestroyTree(nodes[0]);
+	return sum;
+}
+
+
+// Components: a polymorphic hierarchy created through a factory and destroyed through the base class
+
+class Component
+{
+public:
+	virtual ~Component()
+	{}
+	virtual uint64_t Update(uint32_t frame) = 0;
+};
+
+class Transform : public Component
+{
+	float position[3], rotation[4], scale[3];
+public:
+	Transform()
+	{
+		memset(position, 0, sizeof(position));
+		memset(rotation, 0, sizeof(rotation));
+		memset(scale, 0, sizeof(scale));
+	}
+	uint64_t Update(uint32_t frame) override
+	{
+		position[0] += 1.0f;
+		return frame + static_cast<uint64_t>(position[0]);
+	}
+};
+
+class MeshRenderer : public Component
+{
+	uint32_t mesh, material;
+	float bounds[6];
+public:
+	MeshRenderer() : mesh(7), material(3)
+	{
+		memset(bounds, 0, sizeof(bounds));
+	}
+	uint64_t Update(uint32_t frame) override
+	{
+		return mesh * frame + material;
+	}
+};
+
+class RigidBody : public Component
+{
+	float velocity[3], mass;
+public:
+	RigidBody() : mass(1.0f)
+	{
+		memset(velocity, 0, sizeof(velocity));
+	}
+	uint64_t Update(uint32_t frame) override
+	{
+		velocity[1] -= 0.1f;
+		return frame + static_cast<uint64_t>(mass);
+	}
+};
+
+class AudioSource : public Component
+{
+	uint32_t clip;
+	float volume;
+public:
+	AudioSource() : clip(11), volume(0.5f)
+	{}
+	uint64_t Update(uint32_t) override
+	{
+		return clip + static_cast<uint64_t>(volume * 10);
+	}
+};
+
+class ScriptComponent : public Component
+{
+	string scriptName;
+	int state[8];
+public:
+	ScriptComponent() : scriptName("Scripts/Gameplay/EnemyBehaviour.lua")
+	{
+		memset(state, 0, sizeof(state));
+	}
+	uint64_t Update(uint32_t frame) override
+	{
+		state[frame % 8]++;
+		return scriptName.size() + state[0];
+	}
+};
+
+static Component* CreateComponent(uint32_t kind)
+{
+	switch(kind % 5)
+	{
+	case 0:
+		return new Transform;
+	case 1:
+		return new MeshRenderer;
+	case 2:
+		return new RigidBody;
+	case 3:
+		return new AudioSource;
+	default:
+		return new ScriptComponent;
+	}
+}
+
+static uint64_t Components(unsigned int frames)
+{
+	const uint32_t componentCount = 2048;
+	Random random(2);
+	vector<Component*> components;
+	for(uint32_t i = 0; i < componentCount; i++)
+	{
+		components.push_back(CreateComponent(random.Next()));
+	}
+
+	uint64_t sum = 0;
+	for(unsigned int frame = 0; frame < frames; frame++)
+	{
+		// entities are spawned and despawned all the time
+		for(int i = 0; i < 64; i++)
+		{
+			Component *&component = components[random.Below(componentCount)];
+			delete component;
+			component = CreateComponent(random.Next());
+		}
+		for(Component *component : components)
+		{
+			sum += component->Update(frame);
+		}
+	}
+	for(Component *component : components)
+	{
+		delete component;
+	}
+	return sum;
+}
+
+
+// Particles: emitters whose buffers are reallocated with new[] as their particle counts change
+
+struct Particle
+{
+	float position[3];
+	float velocity[3];
+	float color[4];
+	float life;
+};
+
+struct Emitter
+{
+	Particle *particles;
+	uint32_t count;
+};
+
+static uint64_t Particles(unsigned int frames)
+{
+	const int emitterCount = 32;
+	Random random(3);
+	Emitter emitters[emitterCount];
+	for(Emitter &emitter : emitters)
+	{
+		emitter.count = 16 + random.Below(512);
+		emitter.particles = new Particle[emitter.count];
+		memset(emitter.particles, 0, emitter.count * sizeof(Particle));
+	}
+
+	uint64_t sum = 0;
+	for(unsigned int frame = 0; frame < frames; frame++)
+	{
+		for(Emitter &emitter : emitters)
+		{
+			// a quarter of the emitters change size each frame
+			if(random.Below(4) == 0)
+			{
+				uint32_t count = 16 + random.Below(512);
+				Particle *particles = new Particle[count];
+				memcpy(particles, emitter.particles, min(count, emitter.count) * sizeof(Particle));
+				if(count > emitter.count)
+				{
+					memset(particles + emitter.count, 0, (count - emitter.count) * sizeof(Particle));
+				}
+				delete[] emitter.particles;
+				emitter.particles = particles;
+				emitter.count = count;
+			}
+			// the sort keys for back-to-front rendering only live for the frame
+			uint32_t *keys = new uint32_t[emitter.count];
+			for(uint32_t i = 0; i < emitter.count; i++)
+			{
+				emitter.particles[i].life += 1.0f;
+				keys[i] = i ^ frame;
+			}
+			sum += keys[emitter.count - 1] + static_cast<uint64_t>(emitter.particles[0].life);
+			delete[] keys;
+		}
+	}
+	for(Emitter &emitter : emitters)
+	{
+		delete[] emitter.particles;
+	}
+	return sum;
+}
+
+
+// Job bursts: once a frame, every worker thread allocates a batch of jobs; half are freed by the thread which made
+// them and half by the next worker, in the next burst
+
+struct Job
+{
+	uint32_t id;
+	float data[15];
+};
+
+/** @class JobSystem
+@brief Fixed set of worker threads which run one burst at a time.
+*/
+class JobSystem
+{
+private:
+
+	static const uint32_t jobsPerBurst = 256;
+
+	mutex lock;
+	condition_variable wake;
+	condition_variable finished;
+	unsigned int burst;
+	unsigned int workersDone;
+	bool quit;
+	vector<thread> workers;
+	//! Jobs handed to each worker, by burst parity; filled during one burst and freed during the next
+	vector<vector<Job*>> handoff[2];
+	vector<uint64_t> sums;
+
+	JobSystem(const JobSystem&);
+	JobSystem& operator=(const JobSystem&);
+
+	void RunBurst(size_t worker, unsigned int number)
+	{
+		size_t next = (worker + 1) % workers.size();
+		vector<Job*> &incoming = handoff[(number + 1) % 2][worker];
+		vector<Job*> &outgoing = handoff[number % 2][next];
+		for(Job *job : incoming)
+		{
+			sums[worker] += job->id;
+			delete job;
+		}
+		incoming.clear();
+
+		Random random(static_cast<uint32_t>(number * workers.size() + worker));
+		for(uint32_t i = 0; i < jobsPerBurst; i++)
+		{
+			Job *job = new Job;
+			job->id = random.Next();
+			job->data[0] = static_cast<float>(i);
+			if(i % 2)
+			{
+				outgoing.push_back(job);
+			}
+			else
+			{
+				sums[worker] += job->id + static_cast<uint64_t>(job->data[0]);
+				delete job;
+			}
+		}
+	}
+
+	void WorkerLoop(size_t worker)
+	{
+		unsigned int lastBurst = 0;
+		for(;;)
+		{
+			unsigned int number;
+			{
+				unique_lock<mutex> guard(lock);
+				wake.wait(guard, [&]() { return quit || burst != lastBurst; });
+				if(quit)
+				{
+					return;
+				}
+				number = lastBurst = burst;
+			}
+			RunBurst(worker, number);
+			lock_guard<mutex> guard(lock);
+			if(++workersDone == workers.size())
+			{
+				finished.notify_one();
+			}
+		}
+	}
+
+public:
+
+	explicit JobSystem(unsigned int workerCount) : burst(0), workersDone(0), quit(false)
+	{
+		handoff[0].resize(workerCount);
+		handoff[1].resize(workerCount);
+		sums.resize(workerCount);
+		// the workers only start waiting once the vector is complete, since they read its size
+		unique_lock<mutex> guard(lock);
+		for(unsigned int i = 0; i < workerCount; i++)
+		{
+			workers.push_back(thread(&JobSystem::WorkerLoop, this, i));
+		}
+	}
+
+	~JobSystem()
+	{
+		{
+			lock_guard<mutex> guard(lock);
+			quit = true;
+		}
+		wake.notify_all();
+		for(thread &worker : workers)
+		{
+			worker.join();
+		}
+		for(vector<vector<Job*>> &jobs : handoff)
+		{
+			for(vector<Job*> &workerJobs : jobs)
+			{
+				for(Job *job : workerJobs)
+				{
+					delete job;
+				}
+			}
+		}
+	}
+
+	//! Runs a burst on every worker and waits for all of them to finish
+	void Burst()
+	{
+		unique_lock<mutex> guard(lock);
+		workersDone = 0;
+		burst++;
+		wake.notify_all();
+		finished.wait(guard, [&]() { return workersDone == workers.size(); });
+	}
+
+	uint64_t Sum() const
+	{
+		uint64_t sum = 0;
+		for(uint64_t workerSum : sums)
+		{
+			sum += workerSum;
+		}
+		return sum;
+	}
+};
+
+static uint64_t JobBursts(unsigned int frames)
+{
+	unsigned int workerCount = max(2u, min(8u, thread::hardware_concurrency()));
+	JobSystem jobs(workerCount);
+	for(unsigned int frame = 0; frame < frames; frame++)
+	{
+		jobs.Burst();
+	}
+	return jobs.Sum();
+}
+
+
+/** @struct Workload
+One benchmark and its results
+*/
+struct Workload
+{
+	const char *name;
+	uint64_t (*run)(unsigned int frames);
+	//! Fastest run, in milliseconds
+	double milliseconds;
+	//! Time from the baseline file, or 0 if there is none
+	double baselineMilliseconds;
+};
+
+/** @struct Options
+Command-line options
+*/
+struct Options
+{
+	unsigned int frames;
+	unsigned int repetitions;
+	const char *saveFile;
+	const char *baselineFile;
+	double failAbove;
+};
+
+static void PrintUsage()
+{
+	fprintf(stderr, "Usage: TracerBenchmark [--frames count] [--repetitions count] [--save file] [--baseline file]\n"
+		"\t[--fail-above ratio]\n");
+}
+
+static bool ParseArguments(int argc, char *argv[], Options &options)
+{
+	options.frames = 300;
+	options.repetitions = 5;
+	options.saveFile = nullptr;
+	options.baselineFile = nullptr;
+	options.failAbove = 0;
+
+	for(int i = 1; i < argc; i += 2)
+	{
+		if(i + 1 >= argc)
+		{
+			return false;
+		}
+		const char *option = argv[i];
+		const char *value = argv[i + 1];
+		if(!strcmp(option, "--frames"))
+		{
+			options.frames = static_cast<unsigned int>(strtoul(value, nullptr, 10));
+		}
+		else if(!strcmp(option, "--repetitions"))
+		{
+			options.repetitions = max(1u, static_cast<unsigned int>(strtoul(value, nullptr, 10)));
+		}
+		else if(!strcmp(option, "--save"))
+		{
+			options.saveFile = value;
+		}
+		else if(!strcmp(option, "--baseline"))
+		{
+			options.baselineFile = value;
+		}
+		else if(!strcmp(option, "--fail-above"))
+		{
+			options.failAbove = strtod(value, nullptr);
+		}
+		else
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+int main(int argc, char *argv[])
+{
+	Options options;
+	if(!ParseArguments(argc, argv, options))
+	{
+		PrintUsage();
+		return 1;
+	}
+#ifdef _DEBUG
+	// the report at exit is irrelevant here, and waiting for input would stall scripted runs
+	memAnalyzer->pauseOnExit = false;
+	memAnalyzer->dumpLeaksToFile = false;
+	const char *build = "tracked";
+#else
+	const char *build = "baseline";
+#endif
+
+	Workload workloads[] =
+	{
+		{ "frame-temporaries", FrameTemporaries, 0, 0 },
+		{ "scene-graph", SceneGraph, 0, 0 },
+		{ "components", Components, 0, 0 },
+		{ "particles", Particles, 0, 0 },
+		{ "job-bursts", JobBursts, 0, 0 }
+	};
+	const size_t workloadCount = sizeof(workloads) / sizeof(workloads[0]);
+
+	if(options.baselineFile)
+	{
+		FILE *file = fopen(options.baselineFile, "r");
+		if(!file)
+		{
+			fprintf(stderr, "%s: could not open file\n", options.baselineFile);
+			return 1;
+		}
+		char name[64];
+		double milliseconds;
+		while(fscanf(file, "%63s %lf", name, &milliseconds) == 2)
+		{
+			for(Workload &workload : workloads)
+			{
+				if(!strcmp(workload.name, name))
+				{
+					workload.baselineMilliseconds = milliseconds;
+				}
+			}
+		}
+		fclose(file);
+	}
+
+	printf("%s build, %u frames, best of %u runs\n\n", build, options.frames, options.repetitions);
+	printf("%-20s%12s%15s%11s\n", "Workload", "Time (ms)", "Baseline (ms)", "Overhead");
+	printf("==========================================================\n");
+	bool failed = false;
+	for(Workload &workload : workloads)
+	{
+		for(unsigned int run = 0; run < options.repetitions; run++)
+		{
+			chrono::steady_clock::time_point start = chrono::steady_clock::now();
+			checksum += workload.run(options.frames);
+			double milliseconds = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+			if(run == 0 || milliseconds < workload.milliseconds)
+			{
+				workload.milliseconds = milliseconds;
+			}
+		}
+
+		printf("%-20s%12.2f", workload.name, workload.milliseconds);
+		if(workload.baselineMilliseconds > 0)
+		{
+			double overhead = workload.milliseconds / workload.baselineMilliseconds;
+			printf("%15.2f%10.2fx", workload.baselineMilliseconds, overhead);
+			if(options.failAbove > 0 && overhead > options.failAbove)
+			{
+				printf("  (above %.2fx)", options.failAbove);
+				failed = true;
+			}
+		}
+		printf("\n");
+		fflush(stdout);
+	}
+	printf("\n");
+
+	if(options.saveFile)
+	{
+		FILE *file = fopen(options.saveFile, "w");
+		if(!file)
+		{
+			fprintf(stderr, "%s: could not create file\n", options.saveFile);
+			return 1;
+		}
+		for(size_t i = 0; i < workloadCount; i++)
+		{
+			fprintf(file, "%s %.4f\n", workloads[i].name, workloads[i].milliseconds);
+		}
+		fclose(file);
+	}
+	return failed ? 2 : 0;
+}